@@ -21,6 +21,7 @@ const config = {
 const client = new net.Socket();
 let isConnected = false;
 let responseBuffer = Buffer.alloc(0); // Buffer to assemble incoming data chunks
+let responseFrames = []; // Bodies of the frames received so far for a streamed (STREAM ON) response
 let awaitingResponse = false;
 let startTime; // To store the start time for latency measurement
 
@@ -85,14 +86,24 @@ client.on("data", (chunk) => {
       break; 
     }
 
-    const bodyLength = Number(responseBuffer.readBigUInt64BE(0));
+    // The top bit of the length marks a frame that more frames of the same response follow.
+    const header = responseBuffer.readBigUInt64BE(0);
+    const moreFrames = (header >> 63n) === 1n;
+    const bodyLength = Number(header & ((1n << 63n) - 1n));
     const totalMsgLength = 8 + bodyLength;
 
     if (responseBuffer.length < totalMsgLength) {
       break; 
     }
 
-    const responseBody = responseBuffer.subarray(8, totalMsgLength).toString("utf-8");
+    responseFrames.push(responseBuffer.subarray(8, totalMsgLength));
+    responseBuffer = responseBuffer.subarray(totalMsgLength);
+    if (moreFrames) {
+      continue;
+    }
+
+    const responseBody = Buffer.concat(responseFrames).toString("utf-8");
+    responseFrames = [];
     const endTime = performance.now();
     const latency = (endTime - startTime).toFixed(2);
     
@@ -101,7 +112,6 @@ client.on("data", (chunk) => {
     
     console.log(coloredResponse + coloredLatency);
 
-    responseBuffer = responseBuffer.subarray(totalMsgLength);
     awaitingResponse = false;
     setPrompt();
   }
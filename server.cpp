@@ -16,16 +16,33 @@
 #include <thread>
 #include <atomic>
 #include <queue>
+#include <deque>
 #include <condition_variable>
 #include <future>
 #include <list>
+#include <map>
+#include <set>
+#include <bitset>
+#include <array>
+#include <cmath>
 #include <cstdio>
 #include <locale>
 #include <memory>
 #include <cctype>
 #include <new>
+#include <cstring>
+#include <string_view>
 
 // --- Platform-Specific Includes ---
+#if defined(__x86_64__) || defined(_M_X64)
+    #include <immintrin.h>
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #include <intrin.h>
+        #define NK_TARGET_AVX2
+    #else
+        #define NK_TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
 #ifdef _WIN32
     #include <winsock2.h>
     #include <ws2tcpip.h>
@@ -45,6 +62,13 @@
     #include <netinet/tcp.h>
     #include <sys/param.h> 
     #include <sys/stat.h>
+    #include <csignal>
+    #if defined(__APPLE__) && defined(__MACH__)
+        #include <mach/mach.h>
+    #endif
+    #if defined(__GLIBC__)
+        #include <malloc.h>
+    #endif
     using socket_t = int;
     const socket_t INVALID_SOCKET_VAL = -1;
     #define close_socket(s) close(s)
@@ -80,6 +104,8 @@ const unsigned short SERVER_PORT = 8080;
 // CRITICAL: This security and stability feature prevents memory exhaustion from malicious scanners or malformed requests.
 const uint64_t MAX_PAYLOAD_SIZE = 1 * 1024 * 1024 * 1024; // 1 GB sanity limit
 std::atomic<bool> DEBUG_MODE(false); // Set to 'false' by default for clean production logs
+std::atomic<unsigned long long> CLIENT_BUFFER_BYTES(0); // Request/response bytes currently held by connection threads
+std::atomic<int> ACTIVE_CONNECTIONS(0);
 bool PERSISTENCE_ENABLED = true;
 std::string DATABASE_FILENAME = "nukekv.db";
 
@@ -88,16 +114,43 @@ bool CACHING_ENABLED = true;
 unsigned long long MAX_RAM_GB = 0;
 int WORKERS_THREAD_COUNT = 0;
 std::atomic<int> BATCH_PROCESSING_SIZE = 1;
+double EVICTION_HIGH_WATERMARK = 0.90; // Background eviction kicks in above this fraction of MAX_RAM_GB
+double EVICTION_LOW_WATERMARK = 0.75;  // ...and keeps evicting until usage falls below this fraction
+int EVICTION_INLINE_BUDGET = 8;        // Max keys a single write may evict inline once the hard limit is crossed
+int EVICTION_BATCH_SIZE = 256;         // Keys the background evictor frees per exclusive-lock acquisition
+int EVICTION_THROTTLE_MAX_MS = 50;     // Longest a write waits for the evictor while usage is above the hard limit
+bool LAZY_FREE_ENABLED = true;                      // DEL, eviction and expiry hand large values to the background reclaimer
+size_t LAZY_FREE_THRESHOLD_BYTES = 64 * 1024;       // Values smaller than this are cheaper to free inline
+bool TIERED_STORAGE_ENABLED = false;                // Spill cold values to VALUE_FILENAME instead of evicting them
+std::string VALUE_FILENAME = "nukekv.values";       // Scratch file for spilled values; rebuilt from the database on startup
+unsigned long long VALUE_FILE_COMPACT_MIN_BYTES = 64ULL * 1024 * 1024; // Dead bytes before the value file is compacted
+std::atomic<bool> COMPRESSION_ENABLED(true);        // Transparently compress values of at least COMPRESSION_THRESHOLD_BYTES
+size_t COMPRESSION_THRESHOLD_BYTES = 4096;
+size_t COMPRESSION_DICT_SIZE = 32 * 1024;           // Upper bound for dictionaries built by COMPRESSION TRAIN
+bool JSON_BINARY_STORAGE = false;                   // Store JSON.SET values in the compact NKB encoding; reads navigate it without building a tree
+unsigned long long JSON_DOC_CACHE_BYTES = 256ULL * 1024 * 1024; // Parsed JSON documents kept in RAM; least recently used are serialized back to text
+std::string JOURNAL_FILENAME = "nukekv.journal";    // Path writes made since the last snapshot of DATABASE_FILENAME, replayed on startup
+unsigned long long JOURNAL_COMPACT_BYTES = 64ULL * 1024 * 1024; // Journal size at which the next batch save takes a full snapshot instead
+size_t QUERY_CACHE_SIZE = 1024;                     // Compiled JSON.GET/UPDATE/DEL plans kept in an LRU (0 disables the cache)
+size_t PARALLEL_SCAN_MIN_ITEMS = 16384;             // Arrays at least this long are scanned by idle workers too (0 disables)
+size_t PARALLEL_SCAN_CHUNK_ITEMS = 2048;            // Smallest range of elements handed to one worker
+size_t STREAM_FRAME_BYTES = 1024 * 1024;            // Array results bigger than this go to STREAM ON connections in frames of about this size
+size_t CURSOR_DEFAULT_LIMIT = 1000;                 // Page size of CURSOR reads without a LIMIT
+size_t RESULT_CACHE_BYTES = 64 * 1024 * 1024;       // Replies kept for keys with JSON.CACHE ON; a reply over an eighth of this is not kept (0 disables)
+size_t VECTOR_INDEX_M = 16;                         // Neighbours per node on the upper layers of a VINDEX graph (twice this on the bottom layer)
+size_t VECTOR_EF_CONSTRUCTION = 100;                // Candidate list size while inserting into a VINDEX graph; higher builds slower, recalls better
+size_t VECTOR_EF_SEARCH = 64;                       // Default candidate list size for VSEARCH (at least K; raised per query with EF)
 
 // --- Utility Functions ---
 inline std::string format_memory_size(unsigned long long bytes) { if (bytes == 0) return "0 B"; const char* suffixes[] = {"B", "KB", "MB", "GB", "TB", "PB"}; int i = 0; double d_bytes = bytes; while (d_bytes >= 1024 && i < 5) { d_bytes /= 1024; i++; } std::stringstream ss; ss << std::fixed << std::setprecision(2) << d_bytes << " " << suffixes[i]; return ss.str(); }
 inline std::string format_duration(double seconds) { std::stringstream ss; ss << std::fixed; if (seconds < 0.001) ss << std::setprecision(2) << seconds * 1000000.0 << u8"µs"; else if (seconds < 1.0) ss << std::setprecision(2) << seconds * 1000.0 << "ms"; else if (seconds < 60.0) ss << std::setprecision(3) << seconds << "s"; else if (seconds < 3600.0) { ss << static_cast<int>(seconds) / 60 << "m " << std::setprecision(2) << fmod(seconds, 60.0) << "s"; } else { ss << static_cast<int>(seconds) / 3600 << "h " << static_cast<int>(fmod(seconds, 3600.0)) / 60 << "m " << std::setprecision(2) << fmod(seconds, 60.0) << "s"; } return ss.str(); }
-inline json::json_pointer to_json_pointer(const std::string& path) { if (path.empty() || path == "$") return json::json_pointer(""); std::string p = path; if (p.rfind("$.", 0) == 0) p = p.substr(2); else if (p.rfind("$[", 0) == 0) p = p.substr(1); std::replace(p.begin(), p.end(), '.', '/'); std::string res; for (char c : p) { if (c == '[') res += '/'; else if (c != ']') res += c; } return json::json_pointer("/" + res); }
+inline json::json_pointer to_json_pointer(const std::string& path) { if (path.empty() || path == "$") return json::json_pointer(""); std::string p = path; if (p.rfind("$.", 0) == 0) p = p.substr(2); else if (p.rfind("$[", 0) == 0) p = p.substr(1); std::replace(p.begin(), p.end(), '.', '/'); std::string res; for (char c : p) { if (c == '[') res += '/'; else if (c != ']') res += c; } if (!res.empty() && res[0] == '/') res.erase(0, 1); return json::json_pointer("/" + res); }
 
-inline unsigned long long get_current_ram_usage() {
+// High-water mark of the process's resident memory. On Linux/macOS this never goes down.
+inline unsigned long long get_peak_ram_usage() {
     #if defined(_WIN32)
         PROCESS_MEMORY_COUNTERS_EX pmc;
-        return GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc)) ? pmc.PrivateUsage : 0;
+        return GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc)) ? pmc.PeakWorkingSetSize : 0;
     #else
         struct rusage usage;
         return getrusage(RUSAGE_SELF, &usage) == 0 ? (
@@ -110,6 +163,66 @@ inline unsigned long long get_current_ram_usage() {
     #endif
 }
 
+// Resident memory right now (from /proc on Linux), falling back to the peak where no live figure is available.
+inline unsigned long long get_current_ram_usage() {
+    #if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS_EX pmc;
+        return GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc)) ? pmc.WorkingSetSize : 0;
+    #elif defined(__APPLE__) && defined(__MACH__)
+        mach_task_basic_info info; mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+        return task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) == KERN_SUCCESS ? info.resident_size : get_peak_ram_usage();
+    #else
+        std::ifstream statm("/proc/self/statm");
+        unsigned long long total_pages = 0, resident_pages = 0;
+        if (statm >> total_pages >> resident_pages) return resident_pages * static_cast<unsigned long long>(sysconf(_SC_PAGESIZE));
+        return get_peak_ram_usage();
+    #endif
+}
+
+// What the C allocator reports about its heap, where the platform exposes it.
+struct AllocatorStats { bool available = false; unsigned long long allocated = 0, free_in_heap = 0, mapped = 0; };
+inline AllocatorStats get_allocator_stats() {
+    AllocatorStats stats;
+    #if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+        struct mallinfo2 mi = mallinfo2();
+        stats.available = true; stats.allocated = mi.uordblks + mi.hblkhd; stats.free_in_heap = mi.fordblks; stats.mapped = mi.hblkhd;
+    #elif defined(__GLIBC__)
+        struct mallinfo mi = mallinfo();
+        stats.available = true; stats.allocated = static_cast<unsigned int>(mi.uordblks) + static_cast<unsigned int>(mi.hblkhd); stats.free_in_heap = static_cast<unsigned int>(mi.fordblks); stats.mapped = static_cast<unsigned int>(mi.hblkhd);
+    #endif
+    return stats;
+}
+
+// Heap bytes owned by a string, i.e. nothing while it still fits in the small-string buffer.
+inline size_t string_heap_bytes(const std::string& s) {
+    const char* p = s.data();
+    const char* self = reinterpret_cast<const char*>(&s);
+    return (p >= self && p < self + sizeof(std::string)) ? 0 : s.capacity() + 1;
+}
+
+// Approximate RAM held by a parsed document: its own slot plus every string, vector and tree node below it.
+inline size_t estimate_json_bytes(const json& j) {
+    size_t bytes = sizeof(json);
+    switch (j.type()) {
+        case json::value_t::string: bytes += sizeof(std::string) + string_heap_bytes(j.get_ref<const std::string&>()); break;
+        case json::value_t::binary: bytes += sizeof(json::binary_t) + j.get_binary().capacity(); break;
+        case json::value_t::array: {
+            const auto& arr = j.get_ref<const json::array_t&>();
+            bytes += sizeof(json::array_t) + (arr.capacity() - arr.size()) * sizeof(json);
+            for (const auto& el : arr) bytes += estimate_json_bytes(el);
+            break;
+        }
+        case json::value_t::object: {
+            const auto& obj = j.get_ref<const json::object_t&>();
+            bytes += sizeof(json::object_t);
+            for (const auto& el : obj) bytes += 4 * sizeof(void*) + sizeof(std::string) + string_heap_bytes(el.first) + estimate_json_bytes(el.second);
+            break;
+        }
+        default: break;
+    }
+    return bytes;
+}
+
 inline long long get_file_size(const std::string& filename) {
     #ifdef _WIN32
         HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -148,15 +261,40 @@ inline bool is_word_delimiter(unsigned char c) {
     return !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'));
 }
 
-// ** NEW: Advanced word-based, case-insensitive recursive JSON search **
-inline bool json_contains_word(const json& j, const std::string& term) {
-    // Predicate for case-insensitive comparison, defined once as a static local for efficiency
-    static const auto case_insensitive_equals = [](unsigned char c1, unsigned char c2) {
-        return std::tolower(c1) == std::tolower(c2);
-    };
+// --- Word Search Kernels ---
+// Case-insensitive, whole-word search for `term` inside one string. The vector kernels compare the term's first
+// and last bytes against 16 (SSE2) or 32 (AVX2) text positions at once, folding ASCII case with a single OR of
+// 0x20 where the term byte is a letter, and only run the full comparison on positions where both agree.
+// Case folding is ASCII-only, so results do not depend on the process locale.
+namespace wordsearch {
+    inline bool is_ascii_letter(unsigned char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+    inline unsigned char fold(unsigned char c) { return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c + ('a' - 'A')) : c; }
+    // Full check of a candidate: every byte matches case-insensitively and both ends sit on word boundaries.
+    inline bool verify(std::string_view text, size_t pos, const std::string& term) {
+        if (pos > 0 && !is_word_delimiter(text[pos - 1])) return false;
+        if (pos + term.size() < text.size() && !is_word_delimiter(text[pos + term.size()])) return false;
+        for (size_t k = 0; k < term.size(); ++k) if (fold(text[pos + k]) != fold(term[k])) return false;
+        return true;
+    }
+    inline bool scan_tail(std::string_view text, size_t from, const std::string& term) {
+        unsigned char first = fold(term[0]);
+        for (size_t i = from; i + term.size() <= text.size(); ++i) if (fold(text[i]) == first && verify(text, i, term)) return true;
+        return false;
+    }
+    inline unsigned lowest_bit(unsigned mask) {
+    #if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long index; _BitScanForward(&index, mask); return static_cast<unsigned>(index);
+    #else
+        return static_cast<unsigned>(__builtin_ctz(mask));
+    #endif
+    }
 
-    if (j.is_string()) {
-        const std::string& text = j.get<std::string>();
+    // The original byte-at-a-time implementation; the fallback, and the baseline for STRESS SEARCH.
+    inline bool scalar(std::string_view text, const std::string& term) {
+        // Predicate for case-insensitive comparison, defined once as a static local for efficiency
+        static const auto case_insensitive_equals = [](unsigned char c1, unsigned char c2) {
+            return std::tolower(c1) == std::tolower(c2);
+        };
         if (term.length() > text.length()) return false;
 
         auto it = text.begin();
@@ -176,11 +314,346 @@ inline bool json_contains_word(const json& j, const std::string& term) {
             if (left_boundary_ok && right_boundary_ok) {
                 return true; // Confirmed whole word match
             }
-            
+
             // Not a whole word, so advance iterator to continue searching after this spot
             ++it;
         }
         return false; // No whole word match found in this string
+    }
+
+#if defined(__x86_64__) || defined(_M_X64)
+    inline bool sse2(std::string_view text, const std::string& term) {
+        const size_t n = term.size();
+        if (n == 0) return scalar(text, term);
+        if (n > text.size()) return false;
+        const __m128i first = _mm_set1_epi8(static_cast<char>(fold(term[0]))), first_case = _mm_set1_epi8(is_ascii_letter(term[0]) ? 0x20 : 0);
+        const __m128i last = _mm_set1_epi8(static_cast<char>(fold(term[n - 1]))), last_case = _mm_set1_epi8(is_ascii_letter(term[n - 1]) ? 0x20 : 0);
+        size_t i = 0;
+        for (; i + n - 1 + 16 <= text.size(); i += 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i + n - 1));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(a, first_case), first), _mm_cmpeq_epi8(_mm_or_si128(b, last_case), last))));
+            for (; mask; mask &= mask - 1) if (verify(text, i + lowest_bit(mask), term)) return true;
+        }
+        return scan_tail(text, i, term);
+    }
+    NK_TARGET_AVX2 inline bool avx2(std::string_view text, const std::string& term) {
+        const size_t n = term.size();
+        if (n == 0) return scalar(text, term);
+        if (n > text.size()) return false;
+        const __m256i first = _mm256_set1_epi8(static_cast<char>(fold(term[0]))), first_case = _mm256_set1_epi8(is_ascii_letter(term[0]) ? 0x20 : 0);
+        const __m256i last = _mm256_set1_epi8(static_cast<char>(fold(term[n - 1]))), last_case = _mm256_set1_epi8(is_ascii_letter(term[n - 1]) ? 0x20 : 0);
+        size_t i = 0;
+        for (; i + n - 1 + 32 <= text.size(); i += 32) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text.data() + i));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text.data() + i + n - 1));
+            unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_or_si256(a, first_case), first), _mm256_cmpeq_epi8(_mm256_or_si256(b, last_case), last))));
+            for (; mask; mask &= mask - 1) if (verify(text, i + lowest_bit(mask), term)) return true;
+        }
+        return scan_tail(text, i, term);
+    }
+    inline bool cpu_has_avx2() {
+    #if defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        return os_saves_ymm && (info[1] & (1 << 5));
+    #else
+        return __builtin_cpu_supports("avx2");
+    #endif
+    }
+#endif
+
+    using Kernel = bool (*)(std::string_view, const std::string&);
+    struct Dispatch { Kernel kernel; const char* name; };
+    // Picks the widest kernel the CPU supports, once.
+    inline const Dispatch& best() {
+        static const Dispatch chosen = [] {
+        #if defined(__x86_64__) || defined(_M_X64)
+            if (cpu_has_avx2()) return Dispatch{avx2, "AVX2"};
+            return Dispatch{sse2, "SSE2"};
+        #else
+            return Dispatch{scalar, "scalar"};
+        #endif
+        }();
+        return chosen;
+    }
+}
+
+inline bool text_contains_word(std::string_view text, const std::string& term) { return wordsearch::best().kernel(text, term); }
+
+// --- JSON Validation & Minification ---
+// A two-stage scanner in the style of simdjson, used where a JSON text only has to be checked and compacted.
+// Stage 1 classifies 64-byte blocks into bitmasks with SIMD compares (quotes, backslashes, whitespace, structural
+// characters, control and non-ASCII bytes). A prefix XOR over the unescaped quotes marks the bytes inside strings.
+// Everything except whitespace outside strings is copied to the output, and the output offset of every token is
+// recorded. Stage 2 walks only those token offsets to check the grammar; string bodies are revisited only when they
+// contain escapes or non-ASCII bytes. The accepted language matches nlohmann::json::parse, so parsing the output
+// gives the same document as parsing the input.
+namespace jsonscan {
+    struct Masks { uint64_t quote = 0, backslash = 0, space = 0, op = 0, control = 0, high = 0; };
+    inline unsigned lowest_bit(uint64_t mask) {
+    #if defined(_MSC_VER) && !defined(__clang__)
+        unsigned long index; _BitScanForward64(&index, mask); return static_cast<unsigned>(index);
+    #else
+        return static_cast<unsigned>(__builtin_ctzll(mask));
+    #endif
+    }
+    inline unsigned bit_count(uint64_t mask) {
+    #if defined(_MSC_VER) && !defined(__clang__)
+        return static_cast<unsigned>(__popcnt64(mask));
+    #else
+        return static_cast<unsigned>(__builtin_popcountll(mask));
+    #endif
+    }
+    // Bit i of the result is the XOR of bits 0..i: 1 from an opening quote up to (not including) its closing quote.
+    inline uint64_t prefix_xor(uint64_t x) { x ^= x << 1; x ^= x << 2; x ^= x << 4; x ^= x << 8; x ^= x << 16; x ^= x << 32; return x; }
+
+    inline Masks classify_scalar(const char* block) {
+        Masks m;
+        for (int i = 0; i < 64; ++i) {
+            unsigned char c = static_cast<unsigned char>(block[i]);
+            uint64_t bit = 1ULL << i;
+            if (c == '"') m.quote |= bit;
+            else if (c == '\\') m.backslash |= bit;
+            else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') m.space |= bit;
+            else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') m.op |= bit;
+            if (c < 0x20) m.control |= bit;
+            if (c >= 0x80) m.high |= bit;
+        }
+        return m;
+    }
+#if defined(__x86_64__) || defined(_M_X64)
+    // '[' and ']' differ from '{' and '}' only in bit 0x20, so four compares find the six structural characters.
+    inline Masks classify_sse2(const char* block) {
+        Masks m;
+        const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+        const __m128i case_bit = _mm_set1_epi8(0x20), open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}'), colon = _mm_set1_epi8(':'), comma = _mm_set1_epi8(','), low = _mm_set1_epi8(static_cast<char>(0xE0)), zero = _mm_setzero_si128();
+        for (int k = 0; k < 4; ++k) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * k));
+            __m128i folded = _mm_or_si128(v, case_bit);
+            const int shift = 16 * k;
+            m.quote |= static_cast<uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)))) << shift;
+            m.backslash |= static_cast<uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash)))) << shift;
+            m.space |= static_cast<uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)), _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)))))) << shift;
+            m.op |= static_cast<uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)), _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)))))) << shift;
+            m.control |= static_cast<uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, low), zero)))) << shift;
+            m.high |= static_cast<uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(v))) << shift;
+        }
+        return m;
+    }
+    NK_TARGET_AVX2 inline Masks classify_avx2(const char* block) {
+        Masks m;
+        const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\'), space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+        const __m256i case_bit = _mm256_set1_epi8(0x20), open = _mm256_set1_epi8('{'), close = _mm256_set1_epi8('}'), colon = _mm256_set1_epi8(':'), comma = _mm256_set1_epi8(','), low = _mm256_set1_epi8(static_cast<char>(0xE0)), zero = _mm256_setzero_si256();
+        for (int k = 0; k < 2; ++k) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32 * k));
+            __m256i folded = _mm256_or_si256(v, case_bit);
+            const int shift = 32 * k;
+            m.quote |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)))) << shift;
+            m.backslash |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, backslash)))) << shift;
+            m.space |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)), _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)))))) << shift;
+            m.op |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(folded, open), _mm256_cmpeq_epi8(folded, close)), _mm256_or_si256(_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, comma)))))) << shift;
+            m.control |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, low), zero)))) << shift;
+            m.high |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(v))) << shift;
+        }
+        return m;
+    }
+#endif
+    using Classifier = Masks (*)(const char*);
+    struct Dispatch { Classifier classify; const char* name; };
+    inline const Dispatch& best() {
+        static const Dispatch chosen = [] {
+        #if defined(__x86_64__) || defined(_M_X64)
+            if (wordsearch::cpu_has_avx2()) return Dispatch{classify_avx2, "AVX2"};
+            return Dispatch{classify_sse2, "SSE2"};
+        #else
+            return Dispatch{classify_scalar, "scalar"};
+        #endif
+        }();
+        return chosen;
+    }
+
+    inline int hex_digit(char c) { return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1; }
+    inline bool hex4(const char* s, size_t len, unsigned& code) {
+        if (len < 4) return false;
+        code = 0;
+        for (int i = 0; i < 4; ++i) { int d = hex_digit(s[i]); if (d < 0) return false; code = code << 4 | static_cast<unsigned>(d); }
+        return true;
+    }
+    // Escapes in a string body; a \u high surrogate must be followed by a \u low surrogate and vice versa.
+    inline bool escapes_ok(const char* s, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            if (s[i] != '\\') continue;
+            if (++i >= len) return false;
+            switch (s[i]) {
+                case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't': break;
+                case 'u': {
+                    unsigned code, low;
+                    if (!hex4(s + i + 1, len - i - 1, code)) return false;
+                    i += 4;
+                    if (code >= 0xDC00 && code <= 0xDFFF) return false;
+                    if (code >= 0xD800 && code <= 0xDBFF) {
+                        if (i + 6 >= len || s[i + 1] != '\\' || s[i + 2] != 'u' || !hex4(s + i + 3, len - i - 3, low) || low < 0xDC00 || low > 0xDFFF) return false;
+                        i += 6;
+                    }
+                    break;
+                }
+                default: return false;
+            }
+        }
+        return true;
+    }
+    // Rejects malformed sequences, overlong encodings, surrogates and code points above U+10FFFF.
+    inline bool utf8_ok(std::string_view s) {
+        for (size_t i = 0; i < s.size();) {
+            if (i + 8 <= s.size()) { uint64_t word; std::memcpy(&word, s.data() + i, 8); if ((word & 0x8080808080808080ULL) == 0) { i += 8; continue; } }
+            unsigned char c = static_cast<unsigned char>(s[i]);
+            if (c < 0x80) { ++i; continue; }
+            size_t n; uint32_t code;
+            if ((c & 0xE0) == 0xC0) { n = 1; code = c & 0x1F; }
+            else if ((c & 0xF0) == 0xE0) { n = 2; code = c & 0x0F; }
+            else if ((c & 0xF8) == 0xF0) { n = 3; code = c & 0x07; }
+            else return false;
+            if (i + n >= s.size()) return false;
+            for (size_t k = 1; k <= n; ++k) { unsigned char d = static_cast<unsigned char>(s[i + k]); if ((d & 0xC0) != 0x80) return false; code = code << 6 | (d & 0x3F); }
+            if ((n == 1 && code < 0x80) || (n == 2 && code < 0x800) || (n == 3 && code < 0x10000) || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF)) return false;
+            i += n + 1;
+        }
+        return true;
+    }
+    // true, false, null or a number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    inline bool atom_ok(const char* s, size_t len) {
+        switch (s[0]) {
+            case 't': return len == 4 && std::memcmp(s, "true", 4) == 0;
+            case 'f': return len == 5 && std::memcmp(s, "false", 5) == 0;
+            case 'n': return len == 4 && std::memcmp(s, "null", 4) == 0;
+        }
+        size_t i = 0;
+        auto digits = [&] { size_t from = i; while (i < len && s[i] >= '0' && s[i] <= '9') ++i; return i > from; };
+        if (s[i] == '-') ++i;
+        if (i < len && s[i] == '0') ++i;
+        else if (!digits()) return false;
+        if (i < len && s[i] == '.') { ++i; if (!digits()) return false; }
+        bool exponent = i < len && (s[i] == 'e' || s[i] == 'E');
+        if (exponent) { ++i; if (i < len && (s[i] == '+' || s[i] == '-')) ++i; if (!digits()) return false; }
+        if (i != len) return false;
+        // Like the DOM parser, reject numbers beyond the range of a double.
+        return !(exponent || len > 300) || std::isfinite(std::strtod(std::string(s, len).c_str(), nullptr));
+    }
+
+    // What minify learned about the document: its first character and, for an array, how many elements it has.
+    struct Info { char root = 0; size_t items = 0; };
+    // Validates `in` as a single JSON text. On success `out` holds it without insignificant whitespace (and without a
+    // leading byte order mark); on failure the contents of `out` are unspecified.
+    inline bool minify(std::string_view in, std::string& out, Info* info = nullptr) {
+        size_t start = in.size() >= 3 && std::memcmp(in.data(), "\xEF\xBB\xBF", 3) == 0 ? 3 : 0;
+        if (in.size() - start > std::numeric_limits<uint32_t>::max()) return false;
+        out.resize(in.size() - start);
+        char* dst = out.empty() ? nullptr : &out[0];
+        size_t n = 0;
+        std::vector<uint32_t> tokens;
+        tokens.reserve((in.size() - start) / 8 + 16);
+        const Classifier classify = best().classify;
+        uint64_t in_string_carry = 0, escape_carry = 0, scalar_carry = 0, high = 0;
+        char padded[64];
+        // Stage 1
+        for (size_t pos = start; pos < in.size(); pos += 64) {
+            size_t len = std::min<size_t>(64, in.size() - pos);
+            const char* block = in.data() + pos;
+            if (len < 64) { std::memset(padded, ' ', sizeof(padded)); std::memcpy(padded, block, len); block = padded; }
+            const uint64_t valid = len == 64 ? ~0ULL : (1ULL << len) - 1;
+            Masks m = classify(block);
+            // A backslash escapes the next byte unless it is escaped itself. Runs of backslashes are rare, so they
+            // are resolved bit by bit.
+            uint64_t escaped = escape_carry;
+            escape_carry = 0;
+            for (uint64_t bs = m.backslash; bs; bs &= bs - 1) {
+                unsigned i = lowest_bit(bs);
+                if (escaped >> i & 1) continue;
+                if (i == 63) escape_carry = 1; else escaped |= 1ULL << (i + 1);
+            }
+            const uint64_t quotes = m.quote & ~escaped;
+            const uint64_t in_string = prefix_xor(quotes) ^ in_string_carry; // opening quote and body
+            in_string_carry = static_cast<uint64_t>(static_cast<int64_t>(in_string) >> 63);
+            const uint64_t strings = in_string | quotes;
+            if (m.control & in_string & valid) return false;
+            high |= m.high & valid;
+            const uint64_t keep = ~(m.space & ~strings) & valid;
+            const uint64_t scalar = ~(m.space | m.op | strings) & valid;
+            const uint64_t starts = ((m.op & ~strings) | (quotes & in_string) | (scalar & ~(scalar << 1 | scalar_carry))) & valid;
+            scalar_carry = scalar >> 63;
+            for (uint64_t s = starts; s; s &= s - 1) { unsigned i = lowest_bit(s); tokens.push_back(static_cast<uint32_t>(n + bit_count(keep & ((1ULL << i) - 1)))); }
+            if (keep == valid) { std::memcpy(dst + n, block, len); n += len; continue; }
+            for (uint64_t rest = keep; rest;) {
+                unsigned from = lowest_bit(rest);
+                uint64_t run = ~(rest >> from);
+                unsigned count = run ? lowest_bit(run) : 64 - from;
+                std::memcpy(dst + n, block + from, count);
+                n += count;
+                rest = from + count >= 64 ? 0 : rest & ~((1ULL << (from + count)) - 1);
+            }
+        }
+        if (in_string_carry || tokens.empty()) return false;
+        out.resize(n);
+        if (high && !utf8_ok(in.substr(start))) return false;
+        // Stage 2
+        const char* o = out.data();
+        tokens.push_back(static_cast<uint32_t>(n));
+        const size_t count = tokens.size() - 1;
+        auto string_ok = [&](size_t k) {
+            size_t from = tokens[k], end = tokens[k + 1];
+            if (end < from + 2 || o[end - 1] != '"') return false;
+            const char* body = o + from + 1;
+            size_t len = end - from - 2;
+            return !std::memchr(body, '\\', len) || escapes_ok(body, len);
+        };
+        enum class State { Value, ValueOrEnd, Key, KeyOrEnd, AfterValue };
+        State state = State::Value;
+        std::vector<char> stack;
+        size_t items = 0;
+        for (size_t k = 0;;) {
+            if (k >= count) { if (state != State::AfterValue || !stack.empty()) return false; break; }
+            const char c = o[tokens[k]];
+            switch (state) {
+                case State::ValueOrEnd:
+                    if (c == ']') { stack.pop_back(); ++k; state = State::AfterValue; break; }
+                    // fall through
+                case State::Value:
+                    if (stack.size() == 1 && stack[0] == '[') ++items;
+                    if (c == '{') { stack.push_back('{'); state = State::KeyOrEnd; }
+                    else if (c == '[') { stack.push_back('['); state = State::ValueOrEnd; }
+                    else if (c == '"') { if (!string_ok(k)) return false; state = State::AfterValue; }
+                    else if (c == '}' || c == ']' || c == ':' || c == ',' || !atom_ok(o + tokens[k], tokens[k + 1] - tokens[k])) return false;
+                    else state = State::AfterValue;
+                    ++k;
+                    break;
+                case State::KeyOrEnd:
+                    if (c == '}') { stack.pop_back(); ++k; state = State::AfterValue; break; }
+                    // fall through
+                case State::Key:
+                    if (c != '"' || !string_ok(k) || k + 1 >= count || o[tokens[k + 1]] != ':') return false;
+                    k += 2;
+                    state = State::Value;
+                    break;
+                case State::AfterValue:
+                    if (stack.empty()) return false;
+                    if (c == ',') { state = stack.back() == '{' ? State::Key : State::Value; ++k; }
+                    else if (c == (stack.back() == '{' ? '}' : ']')) { stack.pop_back(); ++k; }
+                    else return false;
+                    break;
+            }
+        }
+        if (info) { info->root = o[0]; info->items = o[0] == '[' ? items : 0; }
+        return true;
+    }
+}
+
+// ** NEW: Advanced word-based, case-insensitive recursive JSON search **
+inline bool json_contains_word(const json& j, const std::string& term) {
+    if (j.is_string()) {
+        return text_contains_word(j.get_ref<const std::string&>(), term);
     } else if (j.is_object()) {
         for (const auto& el : j.items()) {
             if (json_contains_word(el.value(), term)) return true;
@@ -193,209 +666,4628 @@ inline bool json_contains_word(const json& j, const std::string& term) {
     return false;
 }
 
-class NukeKV;
-struct Task { std::string command_str; std::vector<std::string> args; std::promise<HandlerResult> promise; };
+// --- Value Compression (NukeLZ) ---
+// A small LZ77 block codec in the spirit of LZ4. A block is a run of sequences, each
+// <token><literal-length*><literals><offset:2 LE><match-length*>, where the token packs the literal
+// length in its high nibble and (match length - 4) in the low one; 15 means "more length bytes follow".
+// The last sequence carries literals only. An optional dictionary acts as history preceding the input.
+namespace nukelz {
+    constexpr size_t MIN_MATCH = 4;
+    constexpr int HASH_BITS = 14;
+    constexpr size_t MAX_OFFSET = 65535;
 
-// --- Core Database Engine ---
-class NukeKV {
-private:
-    std::unordered_map<std::string, std::string> kv_store_;
-    std::unordered_map<std::string, long long> ttl_map_;
-    std::list<std::string> lru_list_;
-    std::unordered_map<std::string, std::list<std::string>::iterator> lru_map_;
-    
-    mutable std::shared_mutex data_mutex_;
-    std::vector<std::thread> workers_;
-    std::queue<Task> task_queue_;
-    std::mutex queue_mutex_;
-    std::condition_variable condition_;
-    std::atomic<bool> stop_all_ = false;
-    std::thread background_manager_thread_;
-    std::atomic<int> dirty_operations_ = 0;
-    std::atomic<unsigned long long> estimated_memory_usage_ = 0;
-    unsigned long long max_memory_bytes_ = 0;
-    
-    void _update_lru(const std::string& key) { if (!CACHING_ENABLED || max_memory_bytes_ == 0) return; if (lru_map_.count(key)) lru_list_.erase(lru_map_[key]); lru_list_.push_front(key); lru_map_[key] = lru_list_.begin(); }
-    void _enforce_memory_limit() { if (!CACHING_ENABLED || max_memory_bytes_ == 0) return; while (estimated_memory_usage_ > max_memory_bytes_ && !lru_list_.empty()) { std::string key_to_evict = lru_list_.back(); lru_list_.pop_back(); kv_store_.erase(key_to_evict); ttl_map_.erase(key_to_evict); lru_map_.erase(key_to_evict); if(DEBUG_MODE.load()) { std::cout << "\n[CACHE] Evicted key '" << key_to_evict << "' to stay within memory limits." << std::endl; } } }
-    void _save_to_file_unlocked(const std::string& filename) { if (!PERSISTENCE_ENABLED) return; json db_json; db_json["store"] = kv_store_; db_json["ttl"] = ttl_map_; std::ofstream db_file(filename); if (db_file.is_open()) db_file << db_json.dump(4); if (filename == DATABASE_FILENAME) dirty_operations_ = 0; }
-    void _worker_function();
-    void _background_manager() { while (!stop_all_) { std::this_thread::sleep_for(std::chrono::seconds(1)); std::unique_lock<std::shared_mutex> lock(data_mutex_, std::try_to_lock); if (!lock.owns_lock()) continue; auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count(); std::vector<std::string> expired_keys; for (const auto& pair : ttl_map_) if (now_ms > pair.second) expired_keys.push_back(pair.first); if (!expired_keys.empty()) { for (const auto& key : expired_keys) { if (!kv_store_.count(key)) continue; estimated_memory_usage_ -= (key.size() + kv_store_.at(key).size()); kv_store_.erase(key); ttl_map_.erase(key); if (CACHING_ENABLED && lru_map_.count(key)) { lru_list_.erase(lru_map_[key]); lru_map_.erase(key); } dirty_operations_++; } if (DEBUG_MODE.load()) std::cout << "\n[BG] Expired " << expired_keys.size() << " key(s)." << std::endl; } int batch_size = BATCH_PROCESSING_SIZE.load(); if (batch_size > 0 && dirty_operations_ >= batch_size) { int ops = dirty_operations_.load(); _save_to_file_unlocked(DATABASE_FILENAME); if (DEBUG_MODE.load()) std::cout << "\n[BG] Batch saved " << ops << " operations to disk." << std::endl; } } }
-    HandlerResult _handle_set(const std::vector<std::string>& args, bool mark_dirty = true) { if (args.size() != 2 && args.size() != 4) return {400, "-ERR wrong number of arguments for 'SET'. Expected: SET <key> \"<value>\" [EX <seconds>]"}; std::unique_lock<std::shared_mutex> lock(data_mutex_); const auto& key = args[0]; const std::string& value = args[1]; unsigned long long old_size = kv_store_.count(key) ? key.size() + kv_store_[key].size() : 0; kv_store_[key] = value; estimated_memory_usage_ += (key.size() + value.size()) - old_size; _update_lru(key); if (args.size() == 4) { std::string mode = args[2]; std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper); if (mode == "EX") { try { ttl_map_[key] = std::chrono::duration_cast<std::chrono::milliseconds>((std::chrono::system_clock::now() + std::chrono::seconds(std::stoll(args[3]))).time_since_epoch()).count(); } catch (...) { return {400, "-ERR value is not an integer"}; } } } else { ttl_map_.erase(key); } if (mark_dirty) { dirty_operations_++; if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); } _enforce_memory_limit(); return {200, "+OK"}; }
-    HandlerResult _handle_get(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR wrong number of arguments"}; const auto& key = args[0]; std::string result_value; { std::shared_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(key)) return {404, "(nil)"}; result_value = kv_store_.at(key); } { std::unique_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(key)) return {404, "(nil)"}; _update_lru(key); } return {200, result_value}; }
-    HandlerResult _handle_update(const std::vector<std::string>& args) { if (args.size() != 2) return {400, "-ERR wrong number of arguments for 'UPDATE'. Expected: UPDATE <key> \"<value>\""}; std::unique_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(args[0])) return {404, "(nil)"}; const auto& key = args[0]; const std::string& value = args[1]; unsigned long long old_size = key.size() + kv_store_.at(key).size(); kv_store_[key] = value; estimated_memory_usage_ += (key.size() + value.size()) - old_size; _update_lru(key); dirty_operations_++; _enforce_memory_limit(); if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, "+OK"}; }
-    HandlerResult _handle_del(const std::vector<std::string>& args, bool mark_dirty = true) { if (args.empty()) return {400, "-ERR wrong number of arguments"}; std::unique_lock<std::shared_mutex> lock(data_mutex_); int deleted_count = 0; for (const auto& key : args) { if (kv_store_.count(key)) { estimated_memory_usage_ -= (key.size() + kv_store_.at(key).size()); kv_store_.erase(key); ttl_map_.erase(key); if (CACHING_ENABLED && lru_map_.count(key)) { lru_list_.erase(lru_map_[key]); lru_map_.erase(key); } deleted_count++; } } if (deleted_count == 0) return {200, "0"}; if (mark_dirty) { dirty_operations_ += deleted_count; if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); } return {200, std::to_string(deleted_count)}; }
-    HandlerResult _handle_incr_decr(const std::vector<std::string>& args, bool is_incr) { if (args.empty() || args.size() > 2) return {400, "-ERR wrong number of arguments"}; std::unique_lock<std::shared_mutex> lock(data_mutex_); const auto& key = args[0]; long long amount = 1; if (args.size() == 2) { try { amount = std::stoll(args[1]); } catch (...) { return {400, "-ERR not an integer"}; } } if (!is_incr) amount = -amount; long long current_val = 0; unsigned long long old_size = 0; if (kv_store_.count(key)) { try { current_val = std::stoll(kv_store_.at(key)); old_size = key.size() + kv_store_.at(key).size(); } catch (...) { return {400, "-ERR value is not an integer"}; } } std::string new_val_str = std::to_string(current_val + amount); kv_store_[key] = new_val_str; estimated_memory_usage_ += (key.size() + new_val_str.size()) - old_size; _update_lru(key); dirty_operations_++; _enforce_memory_limit(); if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, new_val_str}; }
-    HandlerResult _handle_json_set(const std::vector<std::string>& args) { if (args.size() != 2 && args.size() != 4) return {400, "-ERR wrong number of arguments for 'JSON.SET'. Expected: JSON.SET <key> '<value>' [EX <seconds>]"}; json j; try { j = json::parse(args[1]); } catch (const json::parse_error& e) { return {400, std::string("-ERR invalid JSON: ") + e.what()}; } std::vector<std::string> set_args = {args[0], j.dump()}; if (args.size() == 4) { set_args.push_back(args[2]); set_args.push_back(args[3]); } return _handle_set(set_args); }
-    HandlerResult _handle_json_get(const std::vector<std::string>& args) { if (args.empty()) return {400, "-ERR wrong number of arguments"}; const auto& key = args[0]; std::string result_dump; { std::shared_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(key)) return {404, "(nil)"}; json doc; try { doc = json::parse(kv_store_.at(key)); } catch (...) { return {500, "-ERR not a valid JSON document"}; } auto where_it = std::find(args.begin(), args.end(), "WHERE"); if (where_it != args.end()) { if (std::distance(where_it, args.end()) != 3) return {400, "-ERR syntax: ... WHERE <field> <value>"}; if (!doc.is_array()) return {400, "-ERR `WHERE` clause can only be used on JSON arrays."}; const auto& field = *(where_it + 1); json value_to_find; try { value_to_find = json::parse(*(where_it + 2)); } catch(...) { value_to_find = *(where_it + 2); } json results = json::array(); for (const auto& item : doc) { if (item.is_object() && item.contains(field) && item[field] == value_to_find) { results.push_back(item); } } if (results.empty()) return {404, "[]"}; result_dump = results.dump(2); } else if (args.size() > 1) { json result = json::object(); for (size_t i = 1; i < args.size(); ++i) { std::string path_key = args[i]; std::string clean_key = path_key; if (clean_key.rfind("$.", 0) == 0) clean_key = clean_key.substr(2); else if (clean_key.rfind("$[", 0) == 0) clean_key = clean_key.substr(1); try { result[clean_key] = doc.at(to_json_pointer(path_key)); } catch (...) { result[clean_key] = nullptr; } } result_dump = result.dump(2); } else { result_dump = doc.dump(2); } } { std::unique_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(key)) return {404, "(nil)"}; _update_lru(key); } return {200, result_dump}; }
-    HandlerResult _handle_json_update(const std::vector<std::string>& args) { if (args.size() < 4) return {400, "-ERR invalid syntax for JSON.UPDATE"}; auto where_it = std::find(args.begin(), args.end(), "WHERE"); auto set_it = std::find(args.begin(), args.end(), "SET"); if (where_it == args.end() || set_it == args.end() || std::distance(where_it, set_it) != 3) return {400, "-ERR syntax error. Expected: ... WHERE <field> <value> SET ..."}; const std::string& key = args[0]; const std::string& where_field = *(where_it + 1); json where_value; try { where_value = json::parse(*(where_it + 2)); } catch(...) { where_value = *(where_it + 2); } if (std::distance(set_it, args.end()) < 3 || (std::distance(set_it, args.end()) - 1) % 2 != 0) return {400, "-ERR syntax error. Expected: ... SET <field1> <value1> ..."}; std::unique_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(key)) return {404, "(nil)"}; unsigned long long old_size = key.size() + kv_store_.at(key).size(); json doc; try { doc = json::parse(kv_store_.at(key)); } catch(...) { return {500, "-ERR not a valid JSON document"}; } if (!doc.is_array()) return {400, "-ERR `WHERE` clause can only be used on JSON arrays."}; int updated_count = 0; for (auto& item : doc) { if (item.is_object() && item.contains(where_field) && item[where_field] == where_value) { for (auto it = set_it + 1; it != args.end() && it + 1 != args.end(); it += 2) { const auto& set_field = *it; json set_value; try { set_value = json::parse(*(it + 1)); } catch(...) { set_value = *(it + 1); } item[set_field] = set_value; } updated_count++; } } if (updated_count == 0) return {200, "0"}; std::string new_dump = doc.dump(); kv_store_[key] = new_dump; estimated_memory_usage_ += (key.size() + new_dump.size()) - old_size; _update_lru(key); dirty_operations_++; _enforce_memory_limit(); if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, std::to_string(updated_count)}; }
-    HandlerResult _handle_json_del(const std::vector<std::string>& args) { if (args.empty()) return {400, "-ERR wrong number of arguments"}; if (args.size() == 1) return _handle_del(args); if (args.size() != 4 || args[1] != "WHERE") return {400, "-ERR syntax: JSON.DEL <key> [WHERE <field> <value>]"}; const auto& key = args[0]; const auto& field = args[2]; json value_to_find; try { value_to_find = json::parse(args[3]); } catch (...) { value_to_find = args[3]; } std::unique_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(key)) return {404, "(nil)"}; unsigned long long old_size = key.size() + kv_store_.at(key).size(); json doc; try { doc = json::parse(kv_store_.at(key)); } catch (...) { return {500, "-ERR not a valid JSON document"}; } if (!doc.is_array()) return {400, "-ERR WHERE clause can only be used on JSON arrays."}; auto original_array_size = doc.size(); doc.erase(std::remove_if(doc.begin(), doc.end(), [&](const json& item) { return item.is_object() && item.contains(field) && item[field] == value_to_find; }), doc.end()); auto deleted_count = original_array_size - doc.size(); if (deleted_count == 0) return {200, "0"}; std::string new_dump = doc.dump(); kv_store_[key] = new_dump; estimated_memory_usage_ += (key.size() + new_dump.size()) - old_size; _update_lru(key); dirty_operations_++; _enforce_memory_limit(); if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, std::to_string(deleted_count)}; }
-    // ** UPDATED: The new high-performance, whole-word JSON search implementation **
-    HandlerResult _handle_json_search(const std::vector<std::string>& args) {
-        // Syntax: JSON.SEARCH <key> "<term>" [MAX <count>]
-        if (args.size() != 2 && args.size() != 4) {
-            return {400, "-ERR syntax: JSON.SEARCH <key> \"<term>\" [MAX <count>]"};
-        }
-        
-        const auto& key = args[0];
-        const auto& term = args[1];
-        if (term.empty()) {
-            return {400, "-ERR search term cannot be empty"};
-        }
+    inline uint32_t read32(const unsigned char* p) { uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+    inline uint32_t hash4(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+    inline void write_length(std::string& out, size_t len) { while (len >= 255) { out.push_back(static_cast<char>(255)); len -= 255; } out.push_back(static_cast<char>(len)); }
+    inline void write_sequence(std::string& out, const unsigned char* literals, size_t literal_len, size_t offset, size_t match_len) {
+        size_t ml = match_len ? match_len - MIN_MATCH : 0;
+        out.push_back(static_cast<char>(((literal_len >= 15 ? 15 : literal_len) << 4) | (ml >= 15 ? 15 : ml)));
+        if (literal_len >= 15) write_length(out, literal_len - 15);
+        out.append(reinterpret_cast<const char*>(literals), literal_len);
+        if (match_len == 0) return;
+        out.push_back(static_cast<char>(offset & 0xFF)); out.push_back(static_cast<char>(offset >> 8));
+        if (ml >= 15) write_length(out, ml - 15);
+    }
 
-        size_t max_results = std::numeric_limits<size_t>::max(); // Default to all matches
-        if (args.size() == 4) {
-            std::string mode = args[2];
-            std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
-            if (mode != "MAX") {
-                return {400, "-ERR expected MAX keyword after term"};
+    inline std::string compress(const std::string& input, const std::string& dict = std::string()) {
+        // Matches may reach back into the dictionary, so work over dict+input with the table pre-seeded from the dictionary.
+        std::string joined;
+        const std::string* buffer = &input;
+        size_t start = 0;
+        if (!dict.empty()) { joined.reserve(dict.size() + input.size()); joined.append(dict).append(input); buffer = &joined; start = dict.size(); }
+        const unsigned char* base = reinterpret_cast<const unsigned char*>(buffer->data());
+        const size_t end = buffer->size();
+        std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0); // position + 1, 0 = empty
+        for (size_t i = (start > MAX_OFFSET ? start - MAX_OFFSET : 0); i + MIN_MATCH <= start; ++i) table[hash4(read32(base + i))] = static_cast<uint32_t>(i + 1);
+
+        std::string out;
+        out.reserve(input.size() / 2 + 16);
+        size_t anchor = start, pos = start;
+        const size_t match_limit = end > 12 ? end - 5 : 0; // the tail is always emitted as literals
+        while (pos < match_limit) {
+            uint32_t sequence = read32(base + pos);
+            uint32_t h = hash4(sequence);
+            size_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(pos + 1);
+            if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET || read32(base + candidate - 1) != sequence) {
+                pos += 1 + ((pos - anchor) >> 6); // skip faster through incompressible stretches
+                continue;
             }
-            try {
-                long long count = std::stoll(args[3]);
-                if (count <= 0) {
-                     return {400, "-ERR MAX count must be a positive integer"};
-                }
-                max_results = static_cast<size_t>(count);
-            } catch (...) {
-                return {400, "-ERR invalid number for MAX count"};
+            candidate -= 1;
+            size_t len = MIN_MATCH;
+            while (pos + len < end && base[candidate + len] == base[pos + len]) len++;
+            write_sequence(out, base + anchor, pos - anchor, pos - candidate, len);
+            pos += len;
+            anchor = pos;
+            if (pos + MIN_MATCH <= end) table[hash4(read32(base + pos - 2))] = static_cast<uint32_t>(pos - 1);
+        }
+        write_sequence(out, base + anchor, end - anchor, 0, 0);
+        return out;
+    }
+
+    inline bool decompress(const std::string& input, size_t raw_size, std::string& out, const std::string& dict = std::string()) {
+        out.resize(raw_size);
+        char* op = raw_size ? &out[0] : nullptr;
+        const unsigned char* ip = reinterpret_cast<const unsigned char*>(input.data());
+        const size_t n = input.size();
+        size_t i = 0, o = 0;
+        auto read_length = [&](size_t& len) { unsigned char b; do { if (i >= n) return false; b = ip[i++]; len += b; } while (b == 255); return true; };
+        while (true) {
+            if (i >= n) return false;
+            unsigned char token = ip[i++];
+            size_t literal_len = token >> 4;
+            if (literal_len == 15 && !read_length(literal_len)) return false;
+            if (literal_len > n - i || literal_len > raw_size - o) return false;
+            if (literal_len) std::memcpy(op + o, ip + i, literal_len);
+            i += literal_len; o += literal_len;
+            if (i == n) break;
+            if (n - i < 2) return false;
+            size_t offset = ip[i] | (static_cast<size_t>(ip[i + 1]) << 8);
+            i += 2;
+            size_t match_len = token & 15;
+            if (match_len == 15 && !read_length(match_len)) return false;
+            match_len += MIN_MATCH;
+            if (offset == 0 || offset > o + dict.size() || match_len > raw_size - o) return false;
+            if (offset > o) { // the match starts inside the dictionary
+                size_t from_dict = std::min(offset - o, match_len);
+                std::memcpy(op + o, dict.data() + dict.size() - (offset - o), from_dict);
+                o += from_dict; match_len -= from_dict;
             }
+            if (offset >= match_len) { std::memcpy(op + o, op + o - offset, match_len); o += match_len; }
+            else { for (size_t k = 0; k < match_len; ++k, ++o) op[o] = op[o - offset]; }
         }
+        return o == raw_size;
+    }
 
-        std::string result_dump;
-        {
-            std::shared_lock<std::shared_mutex> lock(data_mutex_);
-            if (!kv_store_.count(key)) return {404, "(nil)"};
+    // Builds a dictionary from sample values: 64-byte windows are scored by how many samples share the
+    // 8-byte grams inside them, and the best non-redundant windows are concatenated (best last, nearest the data).
+    inline std::string train_dictionary(const std::vector<std::string>& samples, size_t dict_size) {
+        constexpr size_t GRAM = 8, WINDOW = 64, STEP = 16;
+        auto gram_hash = [](const char* p) { uint64_t v; std::memcpy(&v, p, sizeof(v)); return v * 0x9E3779B97F4A7C15ULL; };
+        std::unordered_map<uint64_t, uint32_t> sample_freq;
+        for (const auto& sample : samples) {
+            std::unordered_set<uint64_t> seen;
+            for (size_t i = 0; i + GRAM <= sample.size(); ++i) seen.insert(gram_hash(sample.data() + i));
+            for (uint64_t g : seen) sample_freq[g]++;
+        }
+        auto window_score = [&](const std::string& sample, size_t pos) {
+            uint64_t score = 0;
+            for (size_t i = pos; i + GRAM <= pos + WINDOW; ++i) { auto it = sample_freq.find(gram_hash(sample.data() + i)); if (it != sample_freq.end() && it->second > 1) score += it->second; }
+            return score;
+        };
+        std::vector<std::tuple<uint64_t, size_t, size_t>> candidates; // score, sample, offset
+        for (size_t s = 0; s < samples.size(); ++s)
+            for (size_t pos = 0; pos + WINDOW <= samples[s].size(); pos += STEP) { uint64_t score = window_score(samples[s], pos); if (score > 0) candidates.emplace_back(score, s, pos); }
+        std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return std::get<0>(a) > std::get<0>(b); });
+        std::vector<std::string> picked;
+        size_t total = 0;
+        for (const auto& c : candidates) {
+            if (total + WINDOW > dict_size) break;
+            const std::string& sample = samples[std::get<1>(c)];
+            size_t pos = std::get<2>(c);
+            // Re-score against what is already picked: grams already in the dictionary are worth nothing now.
+            if (window_score(sample, pos) * 2 < std::get<0>(c)) continue;
+            picked.push_back(sample.substr(pos, WINDOW));
+            total += WINDOW;
+            for (size_t i = pos; i + GRAM <= pos + WINDOW; ++i) sample_freq.erase(gram_hash(sample.data() + i));
+        }
+        std::string dict;
+        dict.reserve(total);
+        for (auto it = picked.rbegin(); it != picked.rend(); ++it) dict += *it;
+        return dict;
+    }
+}
 
-            json doc;
-            try {
-                doc = json::parse(kv_store_.at(key));
-            } catch (...) {
-                return {500, "-ERR not a valid JSON document"};
-            }
-            
-            json results = json::array();
-            
-            if (doc.is_array()) {
-                for (const auto& item : doc) {
-                    if (results.size() >= max_results) {
-                        break;
-                    }
-                    if (json_contains_word(item, term)) {
-                        results.push_back(item);
-                    }
-                }
-            } else {
-                // If the doc is a single object or value
-                if (max_results > 0 && json_contains_word(doc, term)) {
-                    results.push_back(doc);
-                }
-            }
+// --- Binary JSON (NKB) ---
+// A compact, navigable encoding for JSON values. A document is "NKB1", a table of the distinct object keys
+// (<varint count> then <varint len><bytes> each) and the root value. Values are a tag byte followed by:
+//   null/false/true: nothing    int: zigzag varint    uint: varint    double: 8 bytes    string: <varint len><bytes>
+//   array/object: <varint count><varint body size><width><count offsets of `width` bytes, relative to the body><body>
+// Object members are <varint key id><value>. The offset tables let a reader jump to the n-th element or scan
+// an object's keys without decoding any values, so a path lookup costs O(depth * fan-out), not O(document).
+namespace nkb {
+    enum Tag : uint8_t { Null = 0, False = 1, True = 2, Int = 3, UInt = 4, Double = 5, String = 6, Array = 7, Object = 8 };
+    constexpr char MAGIC[4] = {'N', 'K', 'B', '1'};
+
+    inline void put_varint(std::string& out, uint64_t v) { while (v >= 0x80) { out.push_back(static_cast<char>(v | 0x80)); v >>= 7; } out.push_back(static_cast<char>(v)); }
+    inline uint64_t get_varint(const unsigned char*& p, const unsigned char* end) {
+        uint64_t v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) { unsigned char b = *p++; v |= static_cast<uint64_t>(b & 0x7F) << shift; if (!(b & 0x80)) return v; }
+        throw std::runtime_error("corrupt binary JSON");
+    }
 
-            if (results.empty()) {
-                return {404, "(nil)"};
+    class Encoder {
+    public:
+        Encoder() = default;
+        // Continues the key table of an existing document, so values it writes can be spliced into that document.
+        explicit Encoder(const std::vector<std::string_view>& keys) { for (auto key : keys) key_id(std::string(key)); }
+        std::string encode(const json& j) {
+            std::string body;
+            write(body, j);
+            return header() + body;
+        }
+        // The magic and the key table for every key seen so far.
+        std::string header() const {
+            std::string out(MAGIC, sizeof(MAGIC));
+            put_varint(out, keys_.size());
+            for (const auto* key : keys_) { put_varint(out, key->size()); out += *key; }
+            return out;
+        }
+        void write(std::string& out, const json& j) {
+            switch (j.type()) {
+                case json::value_t::null: out.push_back(static_cast<char>(Null)); break;
+                case json::value_t::boolean: out.push_back(static_cast<char>(j.get<bool>() ? True : False)); break;
+                case json::value_t::number_integer: { int64_t v = j.get<int64_t>(); out.push_back(static_cast<char>(Int)); put_varint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63)); break; }
+                case json::value_t::number_unsigned: out.push_back(static_cast<char>(UInt)); put_varint(out, j.get<uint64_t>()); break;
+                case json::value_t::number_float: { double d = j.get<double>(); char buf[sizeof(double)]; std::memcpy(buf, &d, sizeof(d)); out.push_back(static_cast<char>(Double)); out.append(buf, sizeof(buf)); break; }
+                case json::value_t::string: { const auto& s = j.get_ref<const std::string&>(); out.push_back(static_cast<char>(String)); put_varint(out, s.size()); out += s; break; }
+                case json::value_t::array: write_container(out, Array, j.get_ref<const json::array_t&>(), [this](std::string& body, const json& el) { write(body, el); }); break;
+                case json::value_t::object: write_container(out, Object, j.get_ref<const json::object_t&>(), [this](std::string& body, const auto& member) { put_varint(body, key_id(member.first)); write(body, member.second); }); break;
+                default: throw std::runtime_error("value cannot be stored as binary JSON");
             }
-            
-            // For client-side consistency, the result is always a JSON array of matches
-            result_dump = results.dump(2);
         }
-        
-        // Update LRU cache
-        {
-            std::unique_lock<std::shared_mutex> lock(data_mutex_);
-            if (!kv_store_.count(key)) return {404, "(nil)"}; // Check again in case it was evicted
-            _update_lru(key);
+        static unsigned offset_width(size_t body_size) { return body_size <= 0xFF ? 1 : body_size <= 0xFFFF ? 2 : 4; }
+        static void put_offset(std::string& out, size_t off, unsigned width) { for (unsigned b = 0; b < width; ++b) out.push_back(static_cast<char>(off >> (8 * b))); }
+    private:
+        std::unordered_map<std::string, uint32_t> key_ids_;
+        std::vector<const std::string*> keys_;
+        uint32_t key_id(const std::string& key) {
+            auto it = key_ids_.find(key);
+            if (it != key_ids_.end()) return it->second;
+            it = key_ids_.emplace(key, static_cast<uint32_t>(keys_.size())).first;
+            keys_.push_back(&it->first);
+            return it->second;
         }
-        
-        return {200, result_dump};
-    }
-    HandlerResult _handle_json_append(const std::vector<std::string>& args) { if (args.size() != 2) return {400, "-ERR wrong number of arguments. Syntax: JSON.APPEND <key> '<json_to_append>'"}; const auto& key = args[0]; std::unique_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(key)) return {404, "(nil)"}; unsigned long long old_size = key.size() + kv_store_.at(key).size(); json doc; try { doc = json::parse(kv_store_.at(key)); } catch (...) { return {500, "-ERR value at key is not a valid JSON document"}; } if (!doc.is_array()) return {400, "-ERR APPEND requires the value at key to be a JSON array"}; json new_json; try { new_json = json::parse(args[1]); } catch(const json::parse_error& e) { return {400, std::string("-ERR invalid JSON for append: ") + e.what()}; } if (new_json.is_object()) { doc.push_back(new_json); } else if (new_json.is_array()) { doc.insert(doc.end(), new_json.begin(), new_json.end()); } else { return {400, "-ERR append value must be a JSON object or array"}; } std::string new_dump = doc.dump(); kv_store_[key] = new_dump; estimated_memory_usage_ += (key.size() + new_dump.size()) - old_size; _update_lru(key); dirty_operations_++; _enforce_memory_limit(); if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, std::to_string(doc.size())}; }
-    HandlerResult _handle_ttl(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR wrong number of arguments"}; std::shared_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(args[0])) return {404, "(nil)"}; if (!ttl_map_.count(args[0])) return {200, "-1"}; auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count(); long long expiry_ms = ttl_map_.at(args[0]); if (now_ms > expiry_ms) return {404, "(nil)"}; return {200, std::to_string((expiry_ms - now_ms) / 1000)}; }
-    HandlerResult _handle_expire(const std::vector<std::string>& args) { if (args.size() != 2) return {400, "-ERR wrong number of arguments"}; std::unique_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(args[0])) return {404, "(nil)"}; try { long long ttl_s = std::stoll(args[1]); if (ttl_s <= 0) { ttl_map_.erase(args[0]); } else { ttl_map_[args[0]] = std::chrono::duration_cast<std::chrono::milliseconds>((std::chrono::system_clock::now() + std::chrono::seconds(ttl_s)).time_since_epoch()).count(); } } catch (...) { return {400, "-ERR invalid TTL value"}; } dirty_operations_++; if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, "+OK"}; }
-    HandlerResult _handle_stats() { std::shared_lock<std::shared_mutex> lock(data_mutex_); int num_threads = (WORKERS_THREAD_COUNT <= 0) ? std::max(1u, std::thread::hardware_concurrency() - 1) : WORKERS_THREAD_COUNT; std::stringstream ss; ss << "Version: NukeKV v2.5-Stable ☢️\n"; ss << "Protocol: Nuke-Wire (CUSTOM RAW TCP)\n"; ss << "Debug Mode: " << (DEBUG_MODE.load() ? "ON" : "OFF") << "\n"; ss << "Worker Threads: " << num_threads << "\n"; ss << "-------------------------\n"; ss << "Persistence Disk: " << (PERSISTENCE_ENABLED ? "Enabled" : "Disabled") << "\n"; if (PERSISTENCE_ENABLED) { ss << "  - Batch Size: " << BATCH_PROCESSING_SIZE.load() << "\n"; ss << "  - Unsaved Ops: " << dirty_operations_.load() << "\n"; long long file_size = get_file_size(DATABASE_FILENAME); ss << "  - Disk Size: " << (file_size >= 0 ? format_memory_size(file_size) : "N/A") << "\n"; } ss << "-------------------------\n"; ss << "Caching: " << (CACHING_ENABLED ? "Enabled" : "Disabled") << "\n"; if (CACHING_ENABLED) { ss << "  - Memory Limit: " << (max_memory_bytes_ > 0 ? format_memory_size(max_memory_bytes_) : "Unlimited") << "\n"; ss << "  - Memory Used: " << format_memory_size(get_current_ram_usage()) << "\n"; } ss << "-------------------------\n"; ss << "Total Keys: " << kv_store_.size() << "\n"; ss << "Keys with TTL: " << ttl_map_.size() << "\n"; ss << "-------------------------\n"; return {200, ss.str()}; }
-    HandlerResult _handle_batch(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR BATCH requires one argument"}; int new_size; try { new_size = std::stoi(args[0]); } catch(...) { return {400, "-ERR value is not an integer"}; } if (new_size < 0) return {400, "-ERR batch size cannot be negative"}; BATCH_PROCESSING_SIZE.store(new_size); return {200, "+OK"}; }
-    HandlerResult _handle_debug(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR DEBUG requires one argument"}; std::string mode = args[0]; std::transform(mode.begin(), mode.end(), mode.begin(), [](unsigned char c){ return ::tolower(c); }); if (mode == "true") { DEBUG_MODE.store(true); return {200, "+OK Debug mode enabled."}; } else if (mode == "false") { DEBUG_MODE.store(false); return {200, "+OK Debug mode disabled."}; } return {400, "-ERR Invalid argument. Use 'true' or 'false'."}; }
-    HandlerResult _handle_stress(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR STRESS requires one argument"}; int count; try { count = std::stoi(args[0]); } catch (...) { return {400, "-ERR invalid number"}; } if (count <= 0) return {400, "-ERR count must be positive"}; std::cout << "\n[INFO] Starting stress test" << std::endl; auto overall_start = high_res_clock::now(); std::stringstream ss; ss << "Stress Test running for " << count << " ops ...\n" << "-------------------------------------------"; { std::vector<std::string> keys(count); for(int i=0; i<count; ++i) keys[i] = "stress:" + std::to_string(i); std::unordered_map<std::string, std::string> stress_store; stress_store.reserve(count); auto run_benchmark = [&](auto op){ auto start = high_res_clock::now(); for(int i=0; i<count; ++i) op(stress_store, i); return std::chrono::duration<double>(high_res_clock::now() - start).count(); }; auto set_op = [&](auto& store, int i){ store[keys[i]] = "svalue"; }; double set_dur = run_benchmark(set_op); ss << "\n" << std::left << std::setw(8) << "SET:" << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (count/set_dur) << " ops/sec (" << format_duration(set_dur) << " total)"; auto update_op = [&](auto& store, int i){ store[keys[i]] = "nvalue"; }; double update_dur = run_benchmark(update_op); ss << "\n" << std::left << std::setw(8) << "UPDATE:" << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (count/update_dur) << " ops/sec (" << format_duration(update_dur) << " total)"; auto get_op = [&](auto& store, int i){ (void)store.at(keys[i]); }; double get_dur = run_benchmark(get_op); ss << "\n" << std::left << std::setw(8) << "GET:" << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (count/get_dur) << " ops/sec (" << format_duration(get_dur) << " total)"; auto del_op = [&](auto& store, int i){ store.erase(keys[i]); }; double del_dur = run_benchmark(del_op); ss << "\n" << std::left << std::setw(8) << "DEL:" << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (count/del_dur) << " ops/sec (" << format_duration(del_dur) << " total)"; } double total_time = std::chrono::duration<double>(high_res_clock::now() - overall_start).count(); ss << "\n-------------------------------------------\n" << "MAX RAM USAGE: " << format_memory_size(get_current_ram_usage()) << "\nTotal Stress Test Time: " << format_duration(total_time); std::cout << "[INFO] Stress test complete. All test data disposed from memory." << std::endl; return {200, ss.str()}; }
-    HandlerResult _handle_clrdb() { std::unique_lock<std::shared_mutex> lock(data_mutex_); size_t keys_cleared = kv_store_.size(); kv_store_.clear(); ttl_map_.clear(); lru_list_.clear(); lru_map_.clear(); estimated_memory_usage_ = 0; dirty_operations_++; if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, "+OK " + std::to_string(keys_cleared) + " keys cleared."}; }
-    HandlerResult _handle_similar(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR wrong number of arguments, expected: SIMILAR <prefix>"}; const auto& prefix = args[0]; if (prefix.empty()) return {400, "-ERR prefix cannot be empty"}; std::shared_lock<std::shared_mutex> lock(data_mutex_); size_t count = 0; for (const auto& pair : kv_store_) { if (pair.first.rfind(prefix, 0) == 0) count++; } return {200, std::to_string(count)}; }
+        template <typename Items, typename WriteItem> void write_container(std::string& out, Tag tag, const Items& items, WriteItem write_item) {
+            std::string body;
+            std::vector<size_t> offsets;
+            offsets.reserve(items.size());
+            for (const auto& item : items) { offsets.push_back(body.size()); write_item(body, item); }
+            unsigned width = offset_width(body.size());
+            out.push_back(static_cast<char>(tag));
+            put_varint(out, items.size());
+            put_varint(out, body.size());
+            out.push_back(static_cast<char>(width));
+            for (size_t off : offsets) put_offset(out, off, width);
+            out += body;
+        }
+    };
+    inline std::string encode(const json& j) { return Encoder().encode(j); }
 
-public:
-    NukeKV() { if (MAX_RAM_GB > 0) max_memory_bytes_ = MAX_RAM_GB * 1024 * 1024 * 1024; int num_threads = (WORKERS_THREAD_COUNT <= 0) ? std::max(1u, std::thread::hardware_concurrency() - 1) : WORKERS_THREAD_COUNT; for (int i = 0; i < num_threads; ++i) workers_.emplace_back(&NukeKV::_worker_function, this); background_manager_thread_ = std::thread(&NukeKV::_background_manager, this); }
-    ~NukeKV() { stop_all_ = true; condition_.notify_all(); for (auto& worker : workers_) if (worker.joinable()) worker.join(); if (background_manager_thread_.joinable()) background_manager_thread_.join(); if (dirty_operations_ > 0) { std::cout << "\nPerforming final save of " << dirty_operations_.load() << " operations..." << std::endl; std::unique_lock<std::shared_mutex> lock(data_mutex_); _save_to_file_unlocked(DATABASE_FILENAME); } }
-    void load_from_file();
-    std::future<HandlerResult> dispatch_command(const std::string& cmd, const std::vector<std::string>& args) { Task task; task.command_str = cmd; task.args = args; auto future = task.promise.get_future(); { std::lock_guard<std::mutex> lock(queue_mutex_); task_queue_.push(std::move(task)); } condition_.notify_one(); return future; }
-};
+    class Document;
+    // A cursor on one encoded value. Cheap to copy; only valid while the underlying bytes are.
+    class Value {
+    public:
+        Value() = default;
+        Value(const Document* doc, const unsigned char* p) : doc_(doc), p_(p) {}
+        explicit operator bool() const { return p_ != nullptr; }
+        Tag tag() const { return static_cast<Tag>(*p_); }
+        bool is_array() const { return p_ && tag() == Array; }
+        bool is_object() const { return p_ && tag() == Object; }
+        bool is_string() const { return p_ && tag() == String; }
+        std::string_view str() const { const unsigned char* q = p_ + 1; size_t len = get_varint(q, end()); return {reinterpret_cast<const char*>(q), len}; }
+        bool is_number() const { return p_ && (tag() == Int || tag() == UInt || tag() == Double); }
+        // The value of a number as a double (a long integer may round); 0 for anything else.
+        double number() const {
+            const unsigned char* q = p_ + 1;
+            switch (is_number() ? tag() : Null) {
+                case Int: { uint64_t z = get_varint(q, end()); return static_cast<double>(static_cast<int64_t>((z >> 1) ^ (~(z & 1) + 1))); }
+                case UInt: return static_cast<double>(get_varint(q, end()));
+                case Double: { double d; if (end() - q < static_cast<long>(sizeof(d))) throw std::runtime_error("corrupt binary JSON"); std::memcpy(&d, q, sizeof(d)); return d; }
+                default: return 0;
+            }
+        }
+        size_t size() const { if (!is_array() && !is_object()) return 0; const unsigned char* q = p_ + 1; return get_varint(q, end()); }
+        // The i-th element of an array, or the value of the i-th member of an object.
+        Value at(size_t i) const { Container c = container(); if (i >= c.count) return {}; const unsigned char* q = c.body + c.offset(i); if (tag() == Object) get_varint(q, end()); return {doc_, q}; }
+        uint32_t key_at(size_t i) const { Container c = container(); const unsigned char* q = c.body + c.offset(i); return static_cast<uint32_t>(get_varint(q, end())); }
+        Value find(uint32_t key_id) const {
+            if (!is_object()) return {};
+            Container c = container();
+            for (size_t i = 0; i < c.count; ++i) { const unsigned char* q = c.body + c.offset(i); if (get_varint(q, end()) == key_id) return {doc_, q}; }
+            return {};
+        }
+        Value find(std::string_view key) const;
+        json to_json() const;
+    private:
+        friend std::string append_to_array(std::string_view bytes, const std::vector<json>& items);
+        struct Container {
+            size_t count; size_t body_size; const unsigned char* body; const unsigned char* table; unsigned width;
+            size_t offset(size_t i) const { const unsigned char* t = table + i * width; size_t off = 0; for (unsigned b = 0; b < width; ++b) off |= static_cast<size_t>(t[b]) << (8 * b); return off; }
+        };
+        Container container() const {
+            const unsigned char* q = p_ + 1;
+            Container c; c.count = get_varint(q, end()); c.body_size = get_varint(q, end()); c.width = *q++; c.table = q; c.body = q + c.count * c.width;
+            return c;
+        }
+        const unsigned char* end() const;
+        const Document* doc_ = nullptr;
+        const unsigned char* p_ = nullptr;
+    };
 
-void NukeKV::_worker_function() {
-    const std::unordered_map<std::string, std::function<HandlerResult(const std::vector<std::string>&)>> command_map = {
-        {"SET", [this](const auto&a){return _handle_set(a);}}, {"GET", [this](const auto&a){return _handle_get(a);}}, {"DEL", [this](const auto&a){return _handle_del(a);}}, {"UPDATE", [this](const auto&a){return _handle_update(a);}}, {"INCR", [this](const auto&a){return _handle_incr_decr(a,true);}}, {"DECR", [this](const auto&a){return _handle_incr_decr(a,false);}}, {"TTL", [this](const auto&a){return _handle_ttl(a);}}, {"EXPIRE", [this](const auto&a){return _handle_expire(a);}}, {"JSON.SET", [this](const auto&a){return _handle_json_set(a);}}, {"JSON.GET", [this](const auto&a){return _handle_json_get(a);}}, {"JSON.UPDATE", [this](const auto&a){return _handle_json_update(a);}}, {"JSON.SEARCH", [this](const auto&a){return _handle_json_search(a);}}, {"JSON.DEL", [this](const auto&a){return _handle_json_del(a);}}, {"JSON.APPEND", [this](const auto&a){return _handle_json_append(a);}}, {"STATS", [this](const auto&a){return _handle_stats();}}, {"STRESS", [this](const auto&a){return _handle_stress(a);}}, {"BATCH", [this](const auto&a){return _handle_batch(a);}}, {"DEBUG", [this](const auto&a){return _handle_debug(a);}}, {"CLRDB", [this](const auto&a){return _handle_clrdb();}}, {"SIMILAR", [this](const auto&a){return _handle_similar(a);}},
+    // Read-only view over an encoded document. Parses only the key table; values are decoded on demand.
+    class Document {
+    public:
+        explicit Document(std::string_view bytes) : begin_(reinterpret_cast<const unsigned char*>(bytes.data())), end_(begin_ + bytes.size()) {
+            if (bytes.size() < sizeof(MAGIC) || std::memcmp(bytes.data(), MAGIC, sizeof(MAGIC)) != 0) throw std::runtime_error("not a binary JSON document");
+            const unsigned char* q = begin_ + sizeof(MAGIC);
+            size_t count = get_varint(q, end_);
+            keys_.reserve(count);
+            for (size_t i = 0; i < count; ++i) { size_t len = get_varint(q, end_); if (len > static_cast<size_t>(end_ - q)) throw std::runtime_error("corrupt binary JSON"); keys_.emplace_back(reinterpret_cast<const char*>(q), len); q += len; }
+            root_ = q;
+        }
+        Value root() const { return {this, root_}; }
+        std::string_view key(uint32_t id) const { return keys_.at(id); }
+        const std::vector<std::string_view>& keys() const { return keys_; }
+        // Returns the id of `key`, or -1 if no object in the document has it.
+        long long key_id(std::string_view key) const { for (size_t i = 0; i < keys_.size(); ++i) if (keys_[i] == key) return static_cast<long long>(i); return -1; }
+        const unsigned char* end() const { return end_; }
+        // Follows a JSON pointer ("/a/0/b"); returns an empty Value if any step is missing.
+        Value at_pointer(const std::string& pointer) const {
+            Value v = root();
+            size_t pos = 0;
+            while (v && pos < pointer.size()) {
+                size_t next = pointer.find('/', pos + 1);
+                std::string token = pointer.substr(pos + 1, next == std::string::npos ? std::string::npos : next - pos - 1);
+                for (size_t i; (i = token.find("~1")) != std::string::npos;) token.replace(i, 2, "/");
+                for (size_t i; (i = token.find("~0")) != std::string::npos;) token.replace(i, 2, "~");
+                if (v.is_array()) { if (token.empty() || !std::all_of(token.begin(), token.end(), ::isdigit)) return {}; v = v.at(std::stoull(token)); }
+                else v = v.find(token);
+                if (next == std::string::npos) break;
+                pos = next;
+            }
+            return v;
+        }
+    private:
+        const unsigned char* begin_;
+        const unsigned char* end_;
+        const unsigned char* root_;
+        std::vector<std::string_view> keys_;
     };
-    while (!stop_all_) { Task task; { std::unique_lock<std::mutex> lock(queue_mutex_); condition_.wait(lock, [this]{return !task_queue_.empty() || stop_all_;}); if (stop_all_ && task_queue_.empty()) return; task = std::move(task_queue_.front()); task_queue_.pop(); } try { auto it = command_map.find(task.command_str); task.promise.set_value(it != command_map.end() ? it->second(task.args) : HandlerResult{400, "-ERR unknown command '" + task.command_str + "'"}); } catch (const std::exception& e) { task.promise.set_value(HandlerResult{500, std::string("-ERR worker exception: ") + e.what()}); } catch (...) { task.promise.set_value(HandlerResult{500, "-ERR unknown worker exception"}); } }
-}
-void NukeKV::load_from_file() { if (!PERSISTENCE_ENABLED) return; std::ifstream ifs(DATABASE_FILENAME); if (!ifs.is_open()) { std::cout << "[INFO] Database file not found." << std::endl; return; } std::unique_lock<std::shared_mutex> lock(data_mutex_); try { json db_json; ifs >> db_json; if (db_json.count("store")) kv_store_ = db_json["store"].get<std::unordered_map<std::string, std::string>>(); if (db_json.count("ttl")) ttl_map_ = db_json["ttl"].get<std::unordered_map<std::string, long long>>(); for(const auto& pair : kv_store_){ estimated_memory_usage_ += (pair.first.size() + pair.second.size()); _update_lru(pair.first); } _enforce_memory_limit(); std::cout << "[INFO] Loaded " << kv_store_.size() << " keys." << std::endl; } catch (...) { std::cerr << "[ERROR] Could not parse database file." << std::endl; } }
 
-// --- Command Line Parser ---
-inline std::vector<std::string> parse_command_line(const std::string& line) {
-    std::vector<std::string> args; if (line.empty()) return args;
-    size_t cmd_end = line.find(' ');
-    std::string command = (cmd_end == std::string::npos) ? line : line.substr(0, cmd_end);
-    args.push_back(command);
-    std::string command_upper = command;
-    std::transform(command_upper.begin(), command_upper.end(), command_upper.begin(), ::toupper);
-    char required_quote = 0;
-    if (command_upper == "SET" || command_upper == "UPDATE") required_quote = '"';
-    else if (command_upper == "JSON.SET" || command_upper == "JSON.APPEND") required_quote = '\'';
-    if (required_quote != 0) {
-        if (cmd_end == std::string::npos) return args;
-        size_t key_start = cmd_end + 1;
-        size_t value_divider_pos = line.find(' ', key_start);
-        if (value_divider_pos == std::string::npos) { args.push_back(line.substr(key_start)); return args; }
-        std::string key = line.substr(key_start, value_divider_pos - key_start);
-        size_t value_start = line.find_first_not_of(" \t", value_divider_pos);
-        size_t ex_pos = line.rfind(" EX ");
-        if (ex_pos != std::string::npos && ex_pos > value_divider_pos) {
-            if (line[value_start] != required_quote || ex_pos < value_start || line[ex_pos - 1] != required_quote) return args;
-            args.push_back(key); args.push_back(line.substr(value_start + 1, ex_pos - value_start - 2)); args.push_back("EX"); args.push_back(line.substr(ex_pos + 4));
-        } else {
-             if (value_start == std::string::npos || line[value_start] != required_quote || line.back() != required_quote) return args;
-             args.push_back(key); args.push_back(line.substr(value_start + 1, line.length() - value_start - 2));
+    inline const unsigned char* Value::end() const { return doc_->end(); }
+    inline Value Value::find(std::string_view key) const { long long id = doc_->key_id(key); return id < 0 ? Value() : find(static_cast<uint32_t>(id)); }
+    inline json Value::to_json() const {
+        const unsigned char* q = p_ + 1;
+        switch (tag()) {
+            case Null: return nullptr;
+            case False: return false;
+            case True: return true;
+            case Int: { uint64_t z = get_varint(q, end()); return static_cast<int64_t>((z >> 1) ^ (~(z & 1) + 1)); }
+            case UInt: return get_varint(q, end());
+            case Double: { double d; if (end() - q < static_cast<long>(sizeof(d))) throw std::runtime_error("corrupt binary JSON"); std::memcpy(&d, q, sizeof(d)); return d; }
+            case String: return std::string(str());
+            case Array: { json arr = json::array(); size_t n = size(); arr.get_ref<json::array_t&>().reserve(n); for (size_t i = 0; i < n; ++i) arr.push_back(at(i).to_json()); return arr; }
+            case Object: { json obj = json::object(); size_t n = size(); for (size_t i = 0; i < n; ++i) obj[std::string(doc_->key(key_at(i)))] = at(i).to_json(); return obj; }
         }
-    } else {
-        std::string current_arg; char quote_type=0; for (size_t i=cmd_end+1; i<line.length(); ++i) { char c=line[i]; if(quote_type==0 && (c=='\''||c=='"')) {if(!current_arg.empty()){args.push_back(current_arg);current_arg.clear();} quote_type=c;} else if(c==quote_type){quote_type=0;} else if(quote_type==0&&isspace(c)){if(!current_arg.empty()){args.push_back(current_arg);current_arg.clear();}} else{current_arg+=c;}} if(!current_arg.empty())args.push_back(current_arg);
-        if (command_upper == "JSON.UPDATE" || command_upper == "JSON.GET") { auto transform_keywords = [](std::string& s) { std::string lower_s = s; std::transform(lower_s.begin(), lower_s.end(), lower_s.begin(), [](unsigned char c){ return ::tolower(c); }); if (lower_s == "where") s = "WHERE"; else if (lower_s == "set") s = "SET"; }; for(size_t i = 1; i < args.size(); ++i) { transform_keywords(args[i]); } }
+        throw std::runtime_error("corrupt binary JSON");
+    }
+    inline json decode(std::string_view bytes) { Document doc(bytes); return doc.root().to_json(); }
+    // Re-encodes a document whose root is an array with `items` added at the end. Existing elements are copied
+    // byte for byte; only the key table, the array header and its offset table are rebuilt.
+    inline std::string append_to_array(std::string_view bytes, const std::vector<json>& items) {
+        Document doc(bytes);
+        Value root = doc.root();
+        if (!root.is_array()) throw std::invalid_argument("root is not an array");
+        Value::Container c = root.container();
+        size_t old_body = c.body_size;
+        if (old_body > static_cast<size_t>(doc.end() - c.body)) throw std::runtime_error("corrupt binary JSON");
+        Encoder encoder(doc.keys());
+        std::string extra;
+        std::vector<size_t> offsets;
+        offsets.reserve(items.size());
+        for (const auto& item : items) { offsets.push_back(old_body + extra.size()); encoder.write(extra, item); }
+        unsigned width = Encoder::offset_width(old_body + extra.size());
+        std::string out = encoder.header();
+        out.reserve(out.size() + 24 + (c.count + items.size()) * width + old_body + extra.size());
+        out.push_back(static_cast<char>(Array));
+        put_varint(out, c.count + items.size());
+        put_varint(out, old_body + extra.size());
+        out.push_back(static_cast<char>(width));
+        if (width == c.width) out.append(reinterpret_cast<const char*>(c.table), c.count * c.width);
+        else for (size_t i = 0; i < c.count; ++i) Encoder::put_offset(out, c.offset(i), width);
+        for (size_t off : offsets) Encoder::put_offset(out, off, width);
+        out.append(reinterpret_cast<const char*>(c.body), old_body);
+        out += extra;
+        return out;
+    }
+    // Same semantics as json_contains_word, walking the encoding instead of a tree.
+    inline bool contains_word(const Value& v, const std::string& term) {
+        if (v.is_string()) return text_contains_word(v.str(), term);
+        if (v.is_array() || v.is_object()) { for (size_t i = 0, n = v.size(); i < n; ++i) if (contains_word(v.at(i), term)) return true; }
+        return false;
     }
-    return args;
 }
 
-// --- nuke-wire Protocol Implementation ---
-inline bool send_all(socket_t sock, const char* buf, size_t len) { size_t sent=0; while(sent<len){int n=send(sock,buf+sent,len-sent,0); if(n<=0)return false; sent+=n;} return true; }
-inline bool send_message(socket_t sock, const std::string& msg) { uint64_t len=msg.length(), net_len=nuke_htonll(len); if(!send_all(sock,reinterpret_cast<const char*>(&net_len),sizeof(net_len)))return false; if(len>0&&!send_all(sock,msg.c_str(),len))return false; return true; }
-inline bool recv_all(socket_t sock, char* buf, size_t len) { size_t recvd=0; while(recvd<len){int n=recv(sock,buf+recvd,len-recvd,0); if(n<=0)return false; recvd+=n;} return true; }
+class NukeKV;
+enum class ValueEncoding : uint8_t { Raw = 0, Compressed = 1 };
+// A stored value. While `on_disk` is set the bytes live in the value file and only the locator stays in RAM.
+// `data` holds the encoded bytes; `raw_size` and `dict_id` describe how to decode them.
+// JSON values may also carry their parsed `doc`. Once a JSON.* write mutates it, `data_stale` is set and the
+// document is the only copy until it is serialized again (on read of the text, persistence or cache trimming).
+// With `nkb` set the decoded bytes are binary JSON rather than text. `array_length` is the element count of a text
+// value known to be a well-formed JSON array (-1 when unknown), which lets JSON.APPEND splice into the text.
+struct ValueEntry {
+    std::string data;
+    uint64_t disk_offset = 0;
+    uint64_t disk_length = 0;
+    uint64_t raw_size = 0;
+    uint64_t revision = 0;
+    int64_t array_length = -1;
+    std::shared_ptr<json> doc;
+    uint64_t doc_bytes = 0;
+    std::list<std::string>::iterator doc_lru_it;
+    uint16_t dict_id = 0;
+    ValueEncoding encoding = ValueEncoding::Raw;
+    bool on_disk = false;
+    bool data_stale = false;
+    bool nkb = false;
+};
+// What a reader saw under the shared lock, handed to `_touch_after_read` to finish the read under the exclusive one.
+struct ReadTicket {
+    uint64_t revision = 0;
+    bool was_on_disk = false;
+    uint64_t disk_offset = 0;
+    std::string spilled_bytes;
+    std::shared_ptr<json> parsed_doc;
+};
+// Hash index over one field of the objects in a JSON array: canonical field value -> ascending array positions.
+struct JsonFieldIndex {
+    std::unordered_map<std::string, std::vector<uint32_t>> positions;
+    unsigned long long bytes = 0;
 
-// --- BUG FIX & ENHANCEMENT: Hardened against internet scanners and bots ---
-inline bool recv_message(socket_t sock, std::string& msg) {
-    uint64_t net_len;
-    // If a scanner connects and disconnects, or sends garbage that isn't 8 bytes,
-    // this will fail. We return false to silently close the connection without logging errors.
-    if (!recv_all(sock, reinterpret_cast<char*>(&net_len), sizeof(net_len))) {
-        return false;
+    // Values that compare equal must share a bucket, so integral floats are keyed like integers (1.0 == 1).
+    static std::string key_for(const json& value) {
+        if (value.is_number_float()) { double d = value.get<double>(); if (std::floor(d) == d && std::fabs(d) < 9.2e18) return std::to_string(static_cast<long long>(d)); }
+        return value.dump();
+    }
+    static size_t bucket_bytes(const std::string& key) { return sizeof(std::string) + sizeof(std::vector<uint32_t>) + 4 * sizeof(void*) + string_heap_bytes(key); }
+    void add(const json& value, uint32_t pos) {
+        std::string k = key_for(value);
+        auto it = positions.find(k);
+        if (it == positions.end()) { it = positions.emplace(std::move(k), std::vector<uint32_t>()).first; bytes += bucket_bytes(it->first); }
+        auto& list = it->second;
+        list.insert(std::lower_bound(list.begin(), list.end(), pos), pos);
+        bytes += sizeof(uint32_t);
+    }
+    void remove(const json& value, uint32_t pos) {
+        auto it = positions.find(key_for(value));
+        if (it == positions.end()) return;
+        auto& list = it->second;
+        auto p = std::lower_bound(list.begin(), list.end(), pos);
+        if (p == list.end() || *p != pos) return;
+        list.erase(p);
+        bytes -= sizeof(uint32_t);
+        if (list.empty()) { bytes -= bucket_bytes(it->first); positions.erase(it); }
+    }
+    const std::vector<uint32_t>* find(const json& value) const { auto it = positions.find(key_for(value)); return it == positions.end() ? nullptr : &it->second; }
+    void clear() { positions.clear(); bytes = 0; }
+    void rebuild(const std::string& field, const json& doc) {
+        clear();
+        if (!doc.is_array()) return;
+        for (size_t i = 0; i < doc.size(); ++i) { const json& item = doc[i]; if (item.is_object()) { auto f = item.find(field); if (f != item.end()) add(*f, static_cast<uint32_t>(i)); } }
     }
+    void rebuild(const std::string& field, const nkb::Document& doc) {
+        clear();
+        nkb::Value root = doc.root();
+        long long field_id = doc.key_id(field);
+        if (!root.is_array() || field_id < 0) return;
+        for (size_t i = 0, n = root.size(); i < n; ++i) { nkb::Value f = root.at(i).find(static_cast<uint32_t>(field_id)); if (f) add(f.to_json(), static_cast<uint32_t>(i)); }
+    }
+};
+// Inverted index over the words of the elements of a JSON array: lowercased word -> ascending array positions.
+// Words are split exactly where json_contains_word puts word boundaries, so every whole-word match of a term
+// is among the positions listed under all of the term's own words. `vocabulary` keeps the words in order for
+// prefix and fuzzy lookups; occurrence counts and element lengths are what BM25 ranks by.
+struct JsonTextIndex {
+    struct Postings { std::vector<uint32_t> positions, counts; }; // ascending positions, occurrences at each
+    std::unordered_map<std::string, Postings> postings;
+    std::set<std::string_view> vocabulary; // views of the keys of `postings`
+    std::vector<uint32_t> lengths;         // words in the element at each position
+    size_t items = 0;
+    unsigned long long words = 0;
+    unsigned long long bytes = 0;
 
-    uint64_t msg_len = nuke_ntohll(net_len);
+    JsonTextIndex() = default;
+    JsonTextIndex(JsonTextIndex&&) = default;
+    JsonTextIndex& operator=(JsonTextIndex&&) = default;
+    JsonTextIndex(const JsonTextIndex&) = delete; // a copy's vocabulary would point into the original
 
-    // This is the CRITICAL security check. If a bot sends junk (like an HTTP request),
-    // the first 8 bytes will be interpreted as a massive number. This check prevents
-    // the server from crashing by trying to allocate that memory.
-    if (msg_len > MAX_PAYLOAD_SIZE) { 
-        // We now ONLY log this if DEBUG_MODE is on, to keep production logs clean.
-        if (DEBUG_MODE.load(std::memory_order_relaxed)) {
-            std::cout << "[INFO] A client sent a malformed header with payload size " 
-                      << format_memory_size(msg_len) << ", exceeding the " 
-                      << format_memory_size(MAX_PAYLOAD_SIZE) << " limit. Connection closed." << std::endl;
+    using WordCounts = std::unordered_map<std::string, uint32_t>; // word -> occurrences
+    static void tokenize(std::string_view text, WordCounts& words) {
+        size_t i = 0;
+        while (i < text.size()) {
+            while (i < text.size() && is_word_delimiter(text[i])) ++i;
+            size_t start = i;
+            while (i < text.size() && !is_word_delimiter(text[i])) ++i;
+            if (i > start) { std::string word(text.substr(start, i - start)); for (auto& c : word) if (c >= 'A' && c <= 'Z') c += 'a' - 'A'; words[std::move(word)]++; }
+        }
+    }
+    static void collect(const json& j, WordCounts& words) {
+        if (j.is_string()) tokenize(j.get_ref<const std::string&>(), words);
+        else if (j.is_object()) { for (const auto& el : j.items()) collect(el.value(), words); }
+        else if (j.is_array()) { for (const auto& el : j) collect(el, words); }
+    }
+    static void collect(const nkb::Value& v, WordCounts& words) {
+        if (v.is_string()) tokenize(v.str(), words);
+        else if (v.is_array() || v.is_object()) { for (size_t i = 0, n = v.size(); i < n; ++i) collect(v.at(i), words); }
+    }
+    static size_t word_bytes(const std::string& word) { return JsonFieldIndex::bucket_bytes(word) + sizeof(std::vector<uint32_t>) + sizeof(std::string_view) + 4 * sizeof(void*); }
+    void add(const WordCounts& counts, uint32_t pos) {
+        if (lengths.size() <= pos) { bytes += (pos + 1 - lengths.size()) * sizeof(uint32_t); lengths.resize(pos + 1); }
+        for (const auto& pair : counts) {
+            auto it = postings.find(pair.first);
+            if (it == postings.end()) { it = postings.emplace(pair.first, Postings()).first; vocabulary.insert(it->first); bytes += word_bytes(it->first); }
+            auto& list = it->second;
+            if (list.positions.empty() || list.positions.back() < pos) { list.positions.push_back(pos); list.counts.push_back(pair.second); }
+            else {
+                size_t at = std::lower_bound(list.positions.begin(), list.positions.end(), pos) - list.positions.begin();
+                list.positions.insert(list.positions.begin() + at, pos);
+                list.counts.insert(list.counts.begin() + at, pair.second);
+            }
+            bytes += 2 * sizeof(uint32_t);
+            words += pair.second;
+            lengths[pos] += pair.second;
+        }
+    }
+    void remove(const WordCounts& counts, uint32_t pos) {
+        for (const auto& pair : counts) {
+            auto it = postings.find(pair.first);
+            if (it == postings.end()) continue;
+            auto& list = it->second;
+            auto p = std::lower_bound(list.positions.begin(), list.positions.end(), pos);
+            if (p == list.positions.end() || *p != pos) continue;
+            size_t at = p - list.positions.begin();
+            words -= list.counts[at];
+            lengths[pos] -= list.counts[at];
+            list.positions.erase(p);
+            list.counts.erase(list.counts.begin() + at);
+            bytes -= 2 * sizeof(uint32_t);
+            if (list.positions.empty()) { bytes -= word_bytes(it->first); vocabulary.erase(it->first); postings.erase(it); }
         }
-        return false; // Silently and safely close the connection.
     }
+    template <typename Item> void add_item(const Item& item, uint32_t pos) { WordCounts counts; collect(item, counts); add(counts, pos); items++; }
+    void clear() { vocabulary.clear(); postings.clear(); lengths.clear(); items = 0; words = 0; bytes = 0; }
+    void rebuild(const json& doc) { clear(); if (doc.is_array()) for (size_t i = 0; i < doc.size(); ++i) add_item(doc[i], static_cast<uint32_t>(i)); }
+    void rebuild(const nkb::Document& doc) { clear(); nkb::Value root = doc.root(); if (root.is_array()) for (size_t i = 0, n = root.size(); i < n; ++i) add_item(root.at(i), static_cast<uint32_t>(i)); }
+    bool holds(const std::string& word, uint32_t pos) const {
+        auto it = postings.find(word);
+        return it != postings.end() && std::binary_search(it->second.positions.begin(), it->second.positions.end(), pos);
+    }
+    // Positions holding every one of `terms`, ascending.
+    template <typename Terms> std::vector<uint32_t> holding_all(const Terms& terms) const {
+        std::vector<const std::vector<uint32_t>*> lists;
+        for (const auto& term : terms) { auto it = postings.find(term); if (it == postings.end()) return {}; lists.push_back(&it->second.positions); }
+        if (lists.empty()) return {};
+        std::sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+        std::vector<uint32_t> out = *lists[0];
+        for (size_t i = 1; i < lists.size() && !out.empty(); ++i) {
+            std::vector<uint32_t> next;
+            std::set_intersection(out.begin(), out.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(next));
+            out.swap(next);
+        }
+        return out;
+    }
+    // Positions that may contain `term` as a whole word, ascending. Returns false if the term has no words to
+    // look up (it is all delimiters), in which case the caller has to scan.
+    bool candidates(const std::string& term, std::vector<uint32_t>& out) const {
+        WordCounts counts;
+        tokenize(term, counts);
+        out.clear();
+        if (counts.empty()) return false;
+        std::vector<std::string> terms;
+        for (const auto& pair : counts) terms.push_back(pair.first);
+        out = holding_all(terms);
+        return true;
+    }
+};
+// A JSON.SEARCH term read as a query (RANK, PREFIX or FUZZY): words that must all occur, OR between alternatives
+// (AND binds tighter), and 'single-quoted' phrases that must occur verbatim. Against a text index, every word is
+// expanded into the indexed words it stands for (itself, longer words it begins with under PREFIX, words within
+// FUZZY edits), and an element matches the word when it holds any of them.
+struct TextQuery {
+    struct Clause {
+        std::string phrase;                           // empty for a single word
+        std::vector<std::string> words;               // the phrase's words, or the one word
+        std::unordered_map<std::string, double> terms; // indexed words the clause matches -> BM25 weight
+    };
+    std::vector<std::vector<Clause>> groups;
+    struct Term { std::string word; double weight, idf; };
+    std::vector<Term> scored; // every expanded term once, with its best weight
 
-    if (msg_len == 0) { 
-        msg.clear(); 
+    static bool parse(const std::string& text, TextQuery& query) {
+        query.groups.emplace_back();
+        for (size_t i = 0; i < text.size();) {
+            if (std::isspace(static_cast<unsigned char>(text[i]))) { ++i; continue; }
+            size_t end = text[i] == '\'' ? text.find('\'', i + 1) : std::min(text.size(), static_cast<size_t>(std::find_if(text.begin() + i, text.end(), [](unsigned char c) { return std::isspace(c); }) - text.begin()));
+            if (end == std::string::npos) end = text.size();
+            bool quoted = text[i] == '\'';
+            std::string token = text.substr(quoted ? i + 1 : i, end - (quoted ? i + 1 : i));
+            i = quoted ? end + 1 : end;
+            if (!quoted && token == "OR") { if (!query.groups.back().empty()) query.groups.emplace_back(); continue; }
+            JsonTextIndex::WordCounts counts;
+            JsonTextIndex::tokenize(token, counts);
+            if (counts.empty()) continue;
+            Clause clause;
+            for (const auto& pair : counts) clause.words.push_back(pair.first);
+            // Anything that is not one plain word ("e-mail", a quoted phrase) has to match verbatim.
+            if (quoted || clause.words.size() > 1 || clause.words[0].size() != token.size()) clause.phrase = token;
+            query.groups.back().push_back(std::move(clause));
+        }
+        if (query.groups.back().empty()) query.groups.pop_back();
+        return !query.groups.empty();
+    }
+    // Calls visit(word, edits) for every vocabulary word within `max_edits` edits of `target`. The sorted vocabulary
+    // is walked as a trie by a Levenshtein automaton: one state (a row of edit distances) per prefix, shared by all
+    // words that start with it, and a prefix whose state can no longer reach `max_edits` skips every word below it.
+    template <typename Visit> static void fuzzy_matches(const std::set<std::string_view>& vocabulary, const std::string& target, int max_edits, Visit visit) {
+        const size_t m = target.size();
+        std::vector<std::vector<int>> rows(1, std::vector<int>(m + 1));
+        for (size_t j = 0; j <= m; ++j) rows[0][j] = static_cast<int>(j);
+        std::string_view previous;
+        size_t valid = 0; // rows[0, valid] hold the states of previous[0, valid)
+        for (auto it = vocabulary.begin(); it != vocabulary.end();) {
+            std::string_view word = *it;
+            size_t depth = 0;
+            while (depth < valid && depth < word.size() && previous[depth] == word[depth]) ++depth;
+            bool dead = false;
+            for (size_t k = depth + 1; k <= word.size(); ++k) {
+                if (rows.size() <= k) rows.emplace_back(m + 1);
+                std::vector<int>& row = rows[k];
+                const std::vector<int>& above = rows[k - 1];
+                row[0] = static_cast<int>(k);
+                int best = row[0];
+                for (size_t j = 1; j <= m; ++j) { row[j] = std::min({above[j] + 1, row[j - 1] + 1, above[j - 1] + (word[k - 1] != target[j - 1])}); best = std::min(best, row[j]); }
+                depth = k;
+                if (best > max_edits) { dead = true; break; }
+            }
+            previous = word;
+            valid = depth;
+            if (!dead) { if (rows[word.size()][m] <= max_edits) visit(word, rows[word.size()][m]); ++it; continue; }
+            // Words are ASCII letters and digits, so bumping the last byte of the prefix gives the first word past it.
+            std::string next(word.substr(0, depth));
+            next.back()++;
+            it = vocabulary.lower_bound(next);
+        }
+    }
+    // Expands every clause against the index and computes the BM25 idf of each term.
+    void expand(const JsonTextIndex& index, bool prefix, int fuzzy) {
+        std::map<std::string, double> best;
+        for (auto& group : groups) {
+            for (auto& clause : group) {
+                auto add = [&](std::string word, double weight) { auto& w = clause.terms[word]; w = std::max(w, weight); auto& b = best[word]; b = std::max(b, weight); };
+                if (!clause.phrase.empty()) { for (const auto& word : clause.words) if (index.postings.count(word)) add(word, 1.0); continue; }
+                const std::string& word = clause.words[0];
+                if (index.postings.count(word)) add(word, 1.0);
+                if (prefix) for (auto it = index.vocabulary.lower_bound(word); it != index.vocabulary.end() && it->compare(0, word.size(), word) == 0; ++it) add(std::string(*it), 1.0);
+                if (fuzzy > 0) fuzzy_matches(index.vocabulary, word, fuzzy, [&](std::string_view match, int edits) { add(std::string(match), 1.0 / (1 + edits)); });
+            }
+        }
+        double n = static_cast<double>(index.items);
+        for (const auto& pair : best) {
+            double df = static_cast<double>(index.postings.at(pair.first).positions.size());
+            scored.push_back({pair.first, pair.second, std::log(1.0 + (n - df + 0.5) / (df + 0.5))});
+        }
+    }
+    // Positions that may match, ascending: those holding a term of every word clause (and every word of every
+    // phrase) of some group. Phrases still have to be verified on the element.
+    std::vector<uint32_t> candidates(const JsonTextIndex& index) const {
+        std::vector<uint32_t> out;
+        for (const auto& group : groups) {
+            std::vector<uint32_t> matched;
+            for (size_t c = 0; c < group.size(); ++c) {
+                const Clause& clause = group[c];
+                std::vector<uint32_t> positions;
+                if (!clause.phrase.empty()) positions = index.holding_all(clause.words);
+                else {
+                    for (const auto& term : clause.terms) { const auto& list = index.postings.at(term.first).positions; positions.insert(positions.end(), list.begin(), list.end()); }
+                    if (clause.terms.size() > 1) { std::sort(positions.begin(), positions.end()); positions.erase(std::unique(positions.begin(), positions.end()), positions.end()); }
+                }
+                if (c == 0) matched.swap(positions);
+                else { std::vector<uint32_t> both; std::set_intersection(matched.begin(), matched.end(), positions.begin(), positions.end(), std::back_inserter(both)); matched.swap(both); }
+                if (matched.empty()) break;
+            }
+            out.insert(out.end(), matched.begin(), matched.end());
+        }
+        if (groups.size() > 1) { std::sort(out.begin(), out.end()); out.erase(std::unique(out.begin(), out.end()), out.end()); }
+        return out;
+    }
+    // Without phrases the index alone decides a match: candidates() is exact.
+    bool exact() const {
+        for (const auto& group : groups) for (const auto& clause : group) if (!clause.phrase.empty()) return false;
+        return true;
+    }
+    static bool contains(const json& item, const std::string& phrase) { return json_contains_word(item, phrase); }
+    static bool contains(const nkb::Value& item, const std::string& phrase) { return nkb::contains_word(item, phrase); }
+    // Whether the element `item` at `pos` matches. Words are looked up in the index, which always describes the
+    // document as it is; only phrases are read from the element.
+    template <typename Item> bool matches(const JsonTextIndex& index, uint32_t pos, const Item& item) const {
+        for (const auto& group : groups) {
+            bool all = true;
+            for (const auto& clause : group) {
+                bool hit = false;
+                if (!clause.phrase.empty()) hit = contains(item, clause.phrase);
+                else for (const auto& term : clause.terms) if (index.holds(term.first, pos)) { hit = true; break; }
+                if (!hit) { all = false; break; }
+            }
+            if (all) return true;
+        }
+        return false;
+    }
+    // BM25 (k1 = 1.2, b = 0.75) over every expanded term, each counting with its weight (1 for the word itself and
+    // its prefix extensions, 1 / (1 + edits) for fuzzy matches). `scores` accumulates it term by term across whole
+    // posting lists; `score` looks one position up in each list, cheaper when the candidates are few.
+    static double bm25(const JsonTextIndex& index, const Term& term, double tf, uint32_t pos) {
+        const double k1 = 1.2, b = 0.75;
+        double average = index.items && index.words ? static_cast<double>(index.words) / static_cast<double>(index.items) : 1.0;
+        return term.weight * term.idf * tf * (k1 + 1) / (tf + k1 * (1 - b + b * index.lengths[pos] / average));
+    }
+    std::vector<double> scores(const JsonTextIndex& index) const {
+        std::vector<double> out(index.lengths.size());
+        for (const auto& term : scored) {
+            const auto& list = index.postings.at(term.word);
+            for (size_t i = 0; i < list.positions.size(); ++i) out[list.positions[i]] += bm25(index, term, list.counts[i], list.positions[i]);
+        }
+        return out;
+    }
+    double score(const JsonTextIndex& index, uint32_t pos) const {
+        double total = 0;
+        for (const auto& term : scored) {
+            const auto& list = index.postings.at(term.word);
+            auto p = std::lower_bound(list.positions.begin(), list.positions.end(), pos);
+            if (p != list.positions.end() && *p == pos) total += bm25(index, term, list.counts[p - list.positions.begin()], pos);
+        }
+        return total;
+    }
+    size_t postings_size(const JsonTextIndex& index) const { size_t n = 0; for (const auto& term : scored) n += index.postings.at(term.word).positions.size(); return n; }
+};
+// --- JSON Query Plans ---
+// WHERE literals are JSON when they parse as JSON and plain strings otherwise.
+inline json parse_query_literal(const std::string& text) { try { return json::parse(text); } catch (...) { return text; } }
+// Orders two scalars: numbers numerically, strings bytewise. Returns false if they are not comparable.
+inline bool compare_scalars(const json& a, const json& b, int& order) {
+    if (a.is_number() && b.is_number()) {
+        if (a.is_number_integer() && b.is_number_integer() && !a.is_number_unsigned() && !b.is_number_unsigned()) { long long x = a.get<long long>(), y = b.get<long long>(); order = (x > y) - (x < y); return true; }
+        if (a.is_number_unsigned() && b.is_number_unsigned()) { unsigned long long x = a.get<unsigned long long>(), y = b.get<unsigned long long>(); order = (x > y) - (x < y); return true; }
+        double x = a.get<double>(), y = b.get<double>();
+        if (std::isnan(x) || std::isnan(y)) return false;
+        order = (x > y) - (x < y); return true;
+    }
+    if (a.is_string() && b.is_string()) { int c = a.get_ref<const std::string&>().compare(b.get_ref<const std::string&>()); order = (c > 0) - (c < 0); return true; }
+    return false;
+}
+// A field of an array element: a plain name is a top-level member, anything with '.', '[' or a leading '$' is a
+// path below the element ("$.user.city", "tags[0]").
+struct JsonFieldPath {
+    std::string text;
+    std::vector<std::string> tokens;
+    std::vector<long long> indexes; // tokens[i] as an array index, or -1
+    size_t slot = 0;                // position of this path's key ids in a binary document binding
+
+    static JsonFieldPath parse(const std::string& text) {
+        JsonFieldPath path; path.text = text;
+        if (text.find_first_of(".[") == std::string::npos && text[0] != '$') { path.tokens.push_back(text); path.indexes.push_back(-1); return path; }
+        else {
+            std::string pointer = to_json_pointer(text).to_string();
+            for (size_t pos = 0; pos < pointer.size();) {
+                size_t next = pointer.find('/', pos + 1);
+                std::string token = pointer.substr(pos + 1, next == std::string::npos ? std::string::npos : next - pos - 1);
+                for (size_t i; (i = token.find("~1")) != std::string::npos;) token.replace(i, 2, "/");
+                for (size_t i; (i = token.find("~0")) != std::string::npos;) token.replace(i, 2, "~");
+                path.tokens.push_back(std::move(token));
+                if (next == std::string::npos) break;
+                pos = next;
+            }
+        }
+        for (const auto& token : path.tokens) path.indexes.push_back(!token.empty() && token.size() < 10 && std::all_of(token.begin(), token.end(), ::isdigit) ? std::stoll(token) : -1);
+        return path;
+    }
+    // The top-level member a field index could serve, or empty for nested paths.
+    const std::string* index_field() const { return tokens.size() == 1 ? &tokens[0] : nullptr; }
+    const json* resolve(const json& item) const {
+        const json* cur = &item;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (cur->is_object()) { auto f = cur->find(tokens[i]); if (f == cur->end()) return nullptr; cur = &*f; }
+            else if (cur->is_array() && indexes[i] >= 0 && static_cast<size_t>(indexes[i]) < cur->size()) cur = &(*cur)[static_cast<size_t>(indexes[i])];
+            else return nullptr;
+        }
+        return cur;
+    }
+    // `ids` holds the document's key id for each token (-1 if absent), see JsonQuery::bind.
+    nkb::Value resolve(const nkb::Value& item, const std::vector<long long>& ids) const {
+        nkb::Value cur = item;
+        for (size_t i = 0; i < tokens.size() && cur; ++i) {
+            if (cur.is_object()) cur = ids[i] < 0 ? nkb::Value() : cur.find(static_cast<uint32_t>(ids[i]));
+            else if (cur.is_array() && indexes[i] >= 0) cur = cur.at(static_cast<size_t>(indexes[i]));
+            else return {};
+        }
+        return cur;
+    }
+};
+// One comparison in a WHERE clause. Literals are parsed once; string literals are compared without building JSON.
+struct JsonCondition {
+    enum class Op { Eq, Ne, Lt, Le, Gt, Ge, Between, In };
+    JsonFieldPath field;
+    Op op = Op::Eq;
+    std::vector<json> values;           // the operand; low and high for BETWEEN; the list for IN
+    std::vector<std::string> index_keys; // JsonFieldIndex::key_for of each value, for Eq and In
+
+    static bool equal(const json& v, const json& literal) {
+        if (literal.is_string()) return v.is_string() && v.get_ref<const std::string&>() == literal.get_ref<const std::string&>();
+        return v == literal;
+    }
+    bool test(const json& v) const {
+        int order;
+        switch (op) {
+            case Op::Eq: return equal(v, values[0]);
+            case Op::Ne: return !equal(v, values[0]);
+            case Op::Lt: return compare_scalars(v, values[0], order) && order < 0;
+            case Op::Le: return compare_scalars(v, values[0], order) && order <= 0;
+            case Op::Gt: return compare_scalars(v, values[0], order) && order > 0;
+            case Op::Ge: return compare_scalars(v, values[0], order) && order >= 0;
+            case Op::Between: { int high; return compare_scalars(v, values[0], order) && order >= 0 && compare_scalars(v, values[1], high) && high <= 0; }
+            case Op::In: for (const auto& literal : values) if (equal(v, literal)) return true; return false;
+        }
+        return false;
+    }
+    bool test(const nkb::Value& v) const {
+        if (!v.is_string()) return test(v.to_json());
+        std::string_view text = v.str();
+        auto order_of = [&](const json& literal, int& order) { if (!literal.is_string()) return false; int c = text.compare(literal.get_ref<const std::string&>()); order = (c > 0) - (c < 0); return true; };
+        auto equal_to = [&](const json& literal) { return literal.is_string() && text == literal.get_ref<const std::string&>(); };
+        int order;
+        switch (op) {
+            case Op::Eq: return equal_to(values[0]);
+            case Op::Ne: return !equal_to(values[0]);
+            case Op::Lt: return order_of(values[0], order) && order < 0;
+            case Op::Le: return order_of(values[0], order) && order <= 0;
+            case Op::Gt: return order_of(values[0], order) && order > 0;
+            case Op::Ge: return order_of(values[0], order) && order >= 0;
+            case Op::Between: { int high; return order_of(values[0], order) && order >= 0 && order_of(values[1], high) && high <= 0; }
+            case Op::In: for (const auto& literal : values) if (equal_to(literal)) return true; return false;
+        }
+        return false;
+    }
+    // A missing field never matches, not even `!=`.
+    bool matches(const json& item) const { const json* v = field.resolve(item); return v && test(*v); }
+    bool matches(const nkb::Value& item, const std::vector<std::vector<long long>>& binding) const { nkb::Value v = field.resolve(item, binding[field.slot]); return v && test(v); }
+    bool indexable() const { return (op == Op::Eq || op == Op::In) && field.index_field(); }
+};
+// A WHERE clause: OR of AND groups (AND binds tighter, there are no parentheses).
+struct JsonPredicate {
+    std::vector<std::vector<JsonCondition>> groups;
+
+    template <typename Item, typename... Binding> bool matches(const Item& item, const Binding&... binding) const {
+        for (const auto& group : groups) {
+            bool all = true;
+            for (const auto& condition : group) if (!condition.matches(item, binding...)) { all = false; break; }
+            if (all) return true;
+        }
+        return false;
+    }
+};
+// Hash index over one field of the JSON documents stored under a key prefix (JSON.FINDINDEX): canonical field
+// value -> keys holding it, in key order. `value_of` remembers each key's bucket so a rewrite can move it.
+struct JsonCollectionIndex {
+    std::string prefix;
+    JsonFieldPath field;
+    std::unordered_map<std::string, std::set<std::string>> keys;
+    std::unordered_map<std::string, std::string> value_of;
+    unsigned long long bytes = 0;
+
+    bool covers(const std::string& key) const { return key.compare(0, prefix.size(), prefix) == 0; }
+    bool serves(const JsonCondition& condition) const { return (condition.op == JsonCondition::Op::Eq || condition.op == JsonCondition::Op::In) && condition.field.tokens == field.tokens && condition.field.indexes == field.indexes; }
+    static size_t entry_bytes(const std::string& key, const std::string& value) { return 2 * (sizeof(std::string) + 4 * sizeof(void*) + string_heap_bytes(key)) + sizeof(std::string) + string_heap_bytes(value); }
+    void add(const std::string& key, std::string value) {
+        auto bucket = keys.find(value);
+        if (bucket == keys.end()) { bucket = keys.emplace(value, std::set<std::string>()).first; bytes += JsonFieldIndex::bucket_bytes(bucket->first); }
+        bucket->second.insert(key);
+        bytes += entry_bytes(key, value);
+        value_of.emplace(key, std::move(value));
+    }
+    void remove(const std::string& key) {
+        auto it = value_of.find(key);
+        if (it == value_of.end()) return;
+        auto bucket = keys.find(it->second);
+        if (bucket != keys.end()) { bucket->second.erase(key); if (bucket->second.empty()) { bytes -= JsonFieldIndex::bucket_bytes(bucket->first); keys.erase(bucket); } }
+        bytes -= entry_bytes(key, it->second);
+        value_of.erase(it);
+    }
+    void clear() { keys.clear(); value_of.clear(); bytes = 0; }
+};
+// Running state of one JSON.AGG function over the matching elements. Integer sums stay exact until they would
+// overflow; MIN and MAX prefer numbers and fall back to strings when a field holds no numbers.
+struct JsonAccumulator {
+    long long count = 0, numbers = 0, int_sum = 0;
+    double sum = 0;
+    bool integral = true;
+    json min_number, max_number, min_string, max_string;
+
+    void add(const json& v) {
+        if (v.is_null()) return;
+        ++count;
+        int order;
+        if (v.is_number()) {
+            ++numbers;
+            bool fits = v.is_number_integer() && (!v.is_number_unsigned() || v.get<unsigned long long>() <= static_cast<unsigned long long>(std::numeric_limits<long long>::max()));
+            long long x = fits ? v.get<long long>() : 0;
+            if (integral && fits && !((x > 0 && int_sum > std::numeric_limits<long long>::max() - x) || (x < 0 && int_sum < std::numeric_limits<long long>::min() - x))) int_sum += x;
+            else { if (integral) { sum = static_cast<double>(int_sum); integral = false; } sum += v.get<double>(); }
+            if (min_number.is_null() || (compare_scalars(v, min_number, order) && order < 0)) min_number = v;
+            if (max_number.is_null() || (compare_scalars(v, max_number, order) && order > 0)) max_number = v;
+        } else if (v.is_string()) {
+            if (min_string.is_null() || (compare_scalars(v, min_string, order) && order < 0)) min_string = v;
+            if (max_string.is_null() || (compare_scalars(v, max_string, order) && order > 0)) max_string = v;
+        }
+    }
+    json result(const std::string& function) const {
+        if (function == "COUNT") return count;
+        if (function == "SUM") return integral ? json(int_sum) : json(sum);
+        if (function == "AVG") return numbers ? json((integral ? static_cast<double>(int_sum) : sum) / static_cast<double>(numbers)) : json(nullptr);
+        if (function == "MIN") return numbers ? min_number : min_string;
+        return numbers ? max_number : max_string;
+    }
+};
+// A compiled JSON.GET / JSON.UPDATE / JSON.DEL / JSON.AGG / JSON.FIND request: everything that only depends on the
+// command text. Plans are immutable and shared between requests through QueryCache.
+struct JsonQuery {
+    struct Path { std::string label; json::json_pointer pointer; std::string pointer_text; bool valid = true; };
+    std::vector<Path> paths;                                // JSON.GET <key> <path>...
+    bool has_where = false;
+    JsonPredicate where;
+    std::vector<JsonFieldPath> fields;                      // FIELDS projection of WHERE results
+    size_t offset = 0;
+    size_t limit = std::numeric_limits<size_t>::max();
+    bool paged = false;                                     // CURSOR given: reply with one page and the next cursor
+    size_t cursor_arg = 0;                                  // where the CURSOR value sits in the arguments
+    std::vector<std::pair<std::string, json>> assignments;  // JSON.UPDATE ... SET
+    struct Aggregate { std::string function; JsonFieldPath field; std::string label; };
+    std::vector<Aggregate> aggregates;                      // JSON.AGG; COUNT * has an empty field path
+    bool has_group = false;
+    JsonFieldPath group_by;
+    std::vector<std::vector<std::string>> slot_tokens;      // tokens of every field path, by JsonFieldPath::slot
+
+    void assign_slots() {
+        auto assign = [&](JsonFieldPath& path) { path.slot = slot_tokens.size(); slot_tokens.push_back(path.tokens); };
+        for (auto& group : where.groups) for (auto& condition : group) assign(condition.field);
+        for (auto& field : fields) assign(field);
+        for (auto& aggregate : aggregates) assign(aggregate.field);
+        if (has_group) assign(group_by);
+    }
+    // Resolves every field path's member names to the key ids of one binary document.
+    std::vector<std::vector<long long>> bind(const nkb::Document& doc) const {
+        std::vector<std::vector<long long>> ids(slot_tokens.size());
+        for (size_t i = 0; i < slot_tokens.size(); ++i) for (const auto& token : slot_tokens[i]) ids[i].push_back(doc.key_id(token));
+        return ids;
+    }
+};
+// LRU of compiled plans keyed by command and arguments (the key itself excluded), so one plan serves every key.
+class QueryCache {
+public:
+    std::shared_ptr<const JsonQuery> get(const std::string& shape) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = plans_.find(shape);
+        if (it == plans_.end()) { misses_++; return nullptr; }
+        hits_++;
+        order_.splice(order_.begin(), order_, it->second.second);
+        return it->second.first;
+    }
+    void put(const std::string& shape, std::shared_ptr<const JsonQuery> plan, size_t capacity) {
+        if (capacity == 0) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (plans_.count(shape)) return;
+        order_.push_front(shape);
+        plans_.emplace(shape, std::make_pair(std::move(plan), order_.begin()));
+        while (plans_.size() > capacity) { plans_.erase(order_.back()); order_.pop_back(); }
+    }
+    void clear() { std::lock_guard<std::mutex> lock(mutex_); plans_.clear(); order_.clear(); }
+    size_t size() const { std::lock_guard<std::mutex> lock(mutex_); return plans_.size(); }
+    unsigned long long hits() const { return hits_; }
+    unsigned long long misses() const { return misses_; }
+private:
+    mutable std::mutex mutex_;
+    std::list<std::string> order_;
+    std::unordered_map<std::string, std::pair<std::shared_ptr<const JsonQuery>, std::list<std::string>::iterator>> plans_;
+    std::atomic<unsigned long long> hits_{0}, misses_{0};
+};
+// Rendered replies of read queries on the keys that opted in with JSON.CACHE ON, keyed by key and query shape and
+// tagged with the revision of the value they were computed from. Every write gives a value a new revision, so a
+// reply is only served while the value is exactly the one it was read from; outdated replies are dropped on sight.
+class ResultCache {
+public:
+    bool get(const std::string& key, const std::string& shape, uint64_t revision, HandlerResult& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto replies = replies_.find(key);
+        if (replies == replies_.end()) { misses_++; return false; }
+        auto it = replies->second.find(shape);
+        if (it == replies->second.end()) { misses_++; return false; }
+        if (it->second.revision != revision) { _erase(replies, it); misses_++; return false; }
+        hits_++;
+        order_.splice(order_.begin(), order_, it->second.lru_it);
+        out = it->second.reply;
+        return true;
+    }
+    void put(const std::string& key, const std::string& shape, uint64_t revision, const HandlerResult& reply, size_t capacity) {
+        size_t reply_bytes = _bytes(key, shape, reply);
+        if (capacity == 0 || reply_bytes > capacity / 8) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto replies = replies_.find(key);
+        if (replies != replies_.end()) { auto it = replies->second.find(shape); if (it != replies->second.end()) { _erase(replies, it); replies = replies_.find(key); } }
+        if (replies == replies_.end()) replies = replies_.emplace(key, std::unordered_map<std::string, Entry>()).first;
+        order_.emplace_front(key, shape);
+        replies->second.emplace(shape, Entry{revision, reply, order_.begin()});
+        bytes_ += reply_bytes;
+        while (bytes_ > capacity && !order_.empty()) { auto victim = replies_.find(order_.back().first); _erase(victim, victim->second.find(order_.back().second)); }
+    }
+    // Forgets every reply of a key (it was removed or left the cache).
+    void drop(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto replies = replies_.find(key);
+        while (replies != replies_.end()) { _erase(replies, replies->second.begin()); replies = replies_.find(key); }
+    }
+    void clear() { std::lock_guard<std::mutex> lock(mutex_); replies_.clear(); order_.clear(); bytes_ = 0; }
+    size_t size() const { std::lock_guard<std::mutex> lock(mutex_); return order_.size(); }
+    size_t bytes() const { std::lock_guard<std::mutex> lock(mutex_); return bytes_; }
+    unsigned long long hits() const { return hits_; }
+    unsigned long long misses() const { return misses_; }
+private:
+    using Order = std::list<std::pair<std::string, std::string>>; // (key, shape), most recently used first
+    struct Entry { uint64_t revision; HandlerResult reply; Order::iterator lru_it; };
+    using Replies = std::unordered_map<std::string, std::unordered_map<std::string, Entry>>;
+    static size_t _bytes(const std::string& key, const std::string& shape, const HandlerResult& reply) { return sizeof(Entry) + 2 * (key.size() + shape.size()) + reply.second.size() + 8 * sizeof(void*); }
+    void _erase(Replies::iterator replies, std::unordered_map<std::string, Entry>::iterator it) {
+        bytes_ -= _bytes(replies->first, it->first, it->second.reply);
+        order_.erase(it->second.lru_it);
+        replies->second.erase(it);
+        if (replies->second.empty()) replies_.erase(replies);
+    }
+    mutable std::mutex mutex_;
+    Order order_;
+    Replies replies_;
+    size_t bytes_ = 0;
+    std::atomic<unsigned long long> hits_{0}, misses_{0};
+};
+// --- Trigram Search ---
+// Case-sensitive substring and regular expression matching over strings, with trigram indexes to narrow down
+// what has to be checked. A trigram query is an OR of groups of trigrams that a match must all contain; a query
+// without groups constrains nothing, and then every string has to be checked.
+namespace trigram {
+    inline uint32_t gram(const char* p) { return (static_cast<uint32_t>(static_cast<unsigned char>(p[0])) << 16) | (static_cast<uint32_t>(static_cast<unsigned char>(p[1])) << 8) | static_cast<unsigned char>(p[2]); }
+    // The distinct trigrams of `text`, ascending.
+    inline std::vector<uint32_t> of(std::string_view text) {
+        std::vector<uint32_t> grams;
+        for (size_t i = 0; i + 3 <= text.size(); ++i) grams.push_back(gram(text.data() + i));
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+    struct Query {
+        std::vector<std::vector<uint32_t>> groups; // each ascending
+        bool any() const { return groups.empty(); }
+        static Query literal(std::string_view text) { Query q; if (text.size() >= 3) q.groups.push_back(of(text)); return q; }
+        // Both must hold. Dropping a side only widens the candidates, so an oversized product keeps the smaller one.
+        static Query both(Query a, Query b) {
+            if (a.any()) return b;
+            if (b.any()) return a;
+            if (a.groups.size() * b.groups.size() > 16) return a.groups.size() <= b.groups.size() ? a : b;
+            Query q;
+            for (const auto& x : a.groups) for (const auto& y : b.groups) { std::vector<uint32_t> g; std::set_union(x.begin(), x.end(), y.begin(), y.end(), std::back_inserter(g)); q.groups.push_back(std::move(g)); }
+            return q;
+        }
+        static Query either(Query a, Query b) {
+            if (a.any() || b.any() || a.groups.size() + b.groups.size() > 64) return Query();
+            for (auto& g : b.groups) a.groups.push_back(std::move(g));
+            return a;
+        }
+    };
+    using Postings = std::unordered_map<uint32_t, std::vector<uint32_t>>; // trigram -> ascending ids
+    inline size_t bucket_bytes() { return sizeof(uint32_t) + sizeof(std::vector<uint32_t>) + 4 * sizeof(void*); }
+    // Ids holding every trigram of some group of `query`, ascending. Returns false if the query constrains nothing.
+    inline bool lookup(const Postings& postings, const Query& query, std::vector<uint32_t>& out) {
+        out.clear();
+        if (query.any()) return false;
+        for (const auto& group : query.groups) {
+            std::vector<const std::vector<uint32_t>*> lists;
+            for (uint32_t g : group) { auto it = postings.find(g); if (it == postings.end()) { lists.clear(); break; } lists.push_back(&it->second); }
+            if (lists.empty()) continue;
+            std::sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+            std::vector<uint32_t> ids = *lists[0];
+            for (size_t i = 1; i < lists.size() && !ids.empty(); ++i) {
+                std::vector<uint32_t> next;
+                std::set_intersection(ids.begin(), ids.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(next));
+                ids.swap(next);
+            }
+            std::vector<uint32_t> merged;
+            std::set_union(out.begin(), out.end(), ids.begin(), ids.end(), std::back_inserter(merged));
+            out.swap(merged);
+        }
+        return true;
+    }
+}
+
+// A compiled regular expression. The pattern is parsed into a tree (which also yields the trigrams any match must
+// contain), compiled to a Thompson NFA, and run as a DFA whose states are built on first use: once warm, matching
+// costs one table lookup per byte with no backtracking. Supported: literals, ., [classes] with ranges and ^,
+// \d \w \s \D \W \S, escaped characters, ^ and $, (groups), (?:groups), |, and *, +, ?, {m}, {m,}, {m,n}. A match
+// may start anywhere unless the pattern is anchored with ^ or $.
+class Regex {
+public:
+    static bool compile(const std::string& pattern, Regex& out, std::string& error) {
+        Parser parser{pattern, 0, {}};
+        Node root;
+        if (!parser.alternation(root, 0) || parser.pos < pattern.size()) { error = parser.error.empty() ? "unexpected '" + std::string(1, pattern[parser.pos]) + "' at offset " + std::to_string(parser.pos) : parser.error; return false; }
+        out = Regex();
+        out.states_.push_back({State::Match, {}, -1, -1});
+        out.start_ = out._build(root, 0);
+        if (out.states_.size() > MAX_STATES) { error = "pattern is too large"; return false; }
+        out.required_ = _required(root);
+        static std::atomic<uint64_t> compiled{0};
+        out.id_ = ++compiled;
+        return true;
+    }
+    // Trigrams every matching string contains.
+    const trigram::Query& required() const { return required_; }
+    bool search(std::string_view text) const {
+        // The DFA is private to each thread (parallel scans share one Regex) and rebuilt when it grows too large.
+        thread_local Dfa dfa;
+        if (dfa.owner != id_ || dfa.states.size() > MAX_DFA_STATES) { dfa = Dfa(); dfa.owner = id_; }
+        if (dfa.initial < 0) dfa.initial = _dfa_state(dfa, _closure({start_}, true, false));
+        int state = dfa.initial;
+        if (dfa.states[state].match) return true;
+        for (unsigned char c : text) {
+            int next = dfa.states[state].next[c];
+            if (next < 0) {
+                if (dfa.states.size() > MAX_DFA_STATES) { std::vector<int> current = dfa.states[state].nfa; dfa = Dfa(); dfa.owner = id_; state = _dfa_state(dfa, current); }
+                std::vector<int> moved;
+                for (int s : dfa.states[state].nfa) if (states_[s].op == State::Byte && states_[s].bytes.test(c)) moved.push_back(states_[s].out);
+                moved.push_back(start_);
+                next = _dfa_state(dfa, _closure(moved, false, false));
+                dfa.states[state].next[c] = next;
+            }
+            state = next;
+            if (dfa.states[state].match) return true;
+        }
+        // A $ only passes at the end of the text.
+        std::vector<int> ends;
+        for (int s : dfa.states[state].nfa) if (states_[s].op == State::Eol) ends.push_back(s);
+        for (int s : _closure(ends, false, true)) if (states_[s].op == State::Match) return true;
+        return false;
+    }
+
+private:
+    static constexpr size_t MAX_STATES = 20000, MAX_DFA_STATES = 1024, MAX_DEPTH = 100;
+    struct Node {
+        enum Kind { Bytes, Concat, Alt, Repeat, Bol, Eol } kind = Concat;
+        std::bitset<256> bytes;
+        std::vector<Node> kids;
+        int min = 1, max = 1; // Repeat bounds, max -1 for unbounded
+    };
+    struct Parser {
+        const std::string& p;
+        size_t pos = 0;
+        std::string error;
+        bool fail(const std::string& message) { if (error.empty()) error = message; return false; }
+        bool alternation(Node& out, size_t depth) {
+            if (depth > MAX_DEPTH) return fail("pattern nests too deeply");
+            Node branch;
+            if (!concatenation(branch, depth)) return false;
+            if (pos >= p.size() || p[pos] != '|') { out = std::move(branch); return true; }
+            out = Node(); out.kind = Node::Alt; out.kids.push_back(std::move(branch));
+            while (pos < p.size() && p[pos] == '|') { ++pos; Node next; if (!concatenation(next, depth)) return false; out.kids.push_back(std::move(next)); }
+            return true;
+        }
+        bool concatenation(Node& out, size_t depth) {
+            out = Node(); out.kind = Node::Concat;
+            while (pos < p.size() && p[pos] != '|' && p[pos] != ')') {
+                Node atom;
+                if (!this->atom(atom, depth)) return false;
+                while (pos < p.size() && (p[pos] == '*' || p[pos] == '+' || p[pos] == '?' || p[pos] == '{')) {
+                    int min = 0, max = -1;
+                    if (p[pos] == '{') { if (!bounds(min, max)) return false; }
+                    else { min = p[pos] == '+' ? 1 : 0; max = p[pos] == '?' ? 1 : -1; ++pos; }
+                    if (pos < p.size() && p[pos] == '?') ++pos; // lazy and greedy find the same strings
+                    if (atom.kind == Node::Bol || atom.kind == Node::Eol) return fail("nothing to repeat before offset " + std::to_string(pos));
+                    Node repeat; repeat.kind = Node::Repeat; repeat.min = min; repeat.max = max; repeat.kids.push_back(std::move(atom));
+                    atom = std::move(repeat);
+                }
+                out.kids.push_back(std::move(atom));
+            }
+            return true;
+        }
+        bool bounds(int& min, int& max) {
+            size_t close = p.find('}', pos);
+            if (close == std::string::npos) return fail("unterminated {");
+            std::string inside = p.substr(pos + 1, close - pos - 1);
+            size_t comma = inside.find(',');
+            auto number = [](const std::string& s, int& v) { if (s.empty() || s.size() > 4 || !std::all_of(s.begin(), s.end(), ::isdigit)) return false; v = std::stoi(s); return true; };
+            if (!number(inside.substr(0, comma), min)) return fail("bad repetition {" + inside + "}");
+            if (comma == std::string::npos) max = min;
+            else if (comma + 1 == inside.size()) max = -1;
+            else if (!number(inside.substr(comma + 1), max) || max < min) return fail("bad repetition {" + inside + "}");
+            if (min > 1000 || max > 1000) return fail("repetition count is over 1000");
+            pos = close + 1;
+            return true;
+        }
+        static void shorthand(char c, std::bitset<256>& set) {
+            for (int b = 0; b < 256; ++b) {
+                bool in = (c == 'd' || c == 'D') ? (b >= '0' && b <= '9') : (c == 's' || c == 'S') ? (b == ' ' || (b >= '\t' && b <= '\r')) : ((b >= '0' && b <= '9') || (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || b == '_');
+                if (in != static_cast<bool>(std::isupper(static_cast<unsigned char>(c)))) set.set(b);
+            }
+        }
+        static char escaped(char c) { return c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c == 'f' ? '\f' : c == 'v' ? '\v' : c == '0' ? '\0' : c; }
+        bool atom(Node& out, size_t depth) {
+            char c = p[pos++];
+            out.kind = Node::Bytes;
+            switch (c) {
+                case '(':
+                    if (p.compare(pos, 2, "?:") == 0) pos += 2;
+                    else if (pos < p.size() && p[pos] == '?') return fail("unsupported group syntax at offset " + std::to_string(pos - 1));
+                    if (!alternation(out, depth + 1)) return false;
+                    if (pos >= p.size() || p[pos] != ')') return fail("missing )");
+                    ++pos;
+                    return true;
+                case '[': return char_class(out.bytes);
+                case '.': out.bytes.set(); out.bytes.reset('\n'); return true;
+                case '^': out.kind = Node::Bol; return true;
+                case '$': out.kind = Node::Eol; return true;
+                case '*': case '+': case '?': case '{': return fail("nothing to repeat at offset " + std::to_string(pos - 1));
+                case '\\':
+                    if (pos >= p.size()) return fail("trailing backslash");
+                    c = p[pos++];
+                    if (std::strchr("dDwWsS", c)) { shorthand(c, out.bytes); return true; }
+                    if (std::isalnum(static_cast<unsigned char>(c)) && !std::strchr("ntrfv0", c)) return fail(std::string("unsupported escape \\") + c);
+                    out.bytes.set(static_cast<unsigned char>(escaped(c)));
+                    return true;
+                default: out.bytes.set(static_cast<unsigned char>(c)); return true;
+            }
+        }
+        bool char_class(std::bitset<256>& set) {
+            bool negate = pos < p.size() && p[pos] == '^';
+            if (negate) ++pos;
+            bool first = true;
+            while (pos < p.size() && (p[pos] != ']' || first)) {
+                first = false;
+                unsigned char lo = static_cast<unsigned char>(p[pos++]);
+                if (lo == '\\') {
+                    if (pos >= p.size()) break;
+                    char c = p[pos++];
+                    if (std::strchr("dDwWsS", c)) { shorthand(c, set); continue; }
+                    lo = static_cast<unsigned char>(escaped(c));
+                }
+                unsigned char hi = lo;
+                if (pos + 1 < p.size() && p[pos] == '-' && p[pos + 1] != ']') {
+                    hi = static_cast<unsigned char>(p[pos + 1]);
+                    pos += 2;
+                    if (hi == '\\' && pos < p.size()) hi = static_cast<unsigned char>(escaped(p[pos++]));
+                    if (hi < lo) return fail("bad range in [...]");
+                }
+                for (int b = lo; b <= hi; ++b) set.set(b);
+            }
+            if (pos >= p.size()) return fail("missing ]");
+            ++pos;
+            if (negate) set.flip();
+            return true;
+        }
+    };
+    struct State {
+        enum Op { Match, Byte, Split, Bol, Eol } op;
+        std::bitset<256> bytes;
+        int out, out1;
+    };
+    struct DfaState { std::vector<int> nfa; bool match = false; std::array<int, 256> next; };
+    struct Dfa { uint64_t owner = 0; int initial = -1; std::vector<DfaState> states; std::map<std::vector<int>, int> ids; };
+
+    // Compiles `node` so that it continues to state `next`, returning its entry state.
+    int _build(const Node& node, int next) {
+        if (states_.size() > MAX_STATES) return next;
+        auto add = [&](State::Op op, int out, int out1) { states_.push_back({op, {}, out, out1}); return static_cast<int>(states_.size() - 1); };
+        switch (node.kind) {
+            case Node::Bytes: { int s = add(State::Byte, next, -1); states_[s].bytes = node.bytes; return s; }
+            case Node::Bol: return add(State::Bol, next, -1);
+            case Node::Eol: return add(State::Eol, next, -1);
+            case Node::Concat: for (auto it = node.kids.rbegin(); it != node.kids.rend(); ++it) next = _build(*it, next); return next;
+            case Node::Alt: {
+                std::vector<int> entries;
+                for (const auto& kid : node.kids) entries.push_back(_build(kid, next));
+                int entry = entries.back();
+                for (size_t i = entries.size() - 1; i-- > 0;) entry = add(State::Split, entries[i], entry);
+                return entry;
+            }
+            case Node::Repeat: {
+                const Node& kid = node.kids[0];
+                if (node.max < 0) { int loop = add(State::Split, -1, next); states_[loop].out = _build(kid, loop); next = loop; }
+                else for (int i = node.min; i < node.max; ++i) { int body = _build(kid, next); next = add(State::Split, body, next); }
+                for (int i = 0; i < node.min; ++i) next = _build(kid, next);
+                return next;
+            }
+        }
+        return next;
+    }
+    // The states reachable from `from` without consuming a byte: consuming states, Match, and (unless at the end)
+    // the $ states still waiting for it. ^ only passes at the start of the text.
+    std::vector<int> _closure(const std::vector<int>& from, bool at_start, bool at_end) const {
+        std::vector<int> out, stack(from.begin(), from.end());
+        std::vector<bool> seen(states_.size());
+        while (!stack.empty()) {
+            int s = stack.back(); stack.pop_back();
+            if (s < 0 || seen[s]) continue;
+            seen[s] = true;
+            const State& state = states_[s];
+            switch (state.op) {
+                case State::Split: stack.push_back(state.out1); stack.push_back(state.out); break;
+                case State::Bol: if (at_start) stack.push_back(state.out); break;
+                case State::Eol: if (at_end) stack.push_back(state.out); else out.push_back(s); break;
+                default: out.push_back(s);
+            }
+        }
+        std::sort(out.begin(), out.end());
+        return out;
+    }
+    int _dfa_state(Dfa& dfa, const std::vector<int>& nfa) const {
+        auto found = dfa.ids.find(nfa);
+        if (found != dfa.ids.end()) return found->second;
+        DfaState state;
+        state.nfa = nfa;
+        state.next.fill(-1);
+        for (int s : nfa) if (states_[s].op == State::Match) state.match = true;
+        dfa.states.push_back(std::move(state));
+        int id = static_cast<int>(dfa.states.size() - 1);
+        dfa.ids.emplace(nfa, id);
+        return id;
+    }
+    // Trigrams a match of `node` must contain: runs of single characters in a concatenation, combined through
+    // alternations and mandatory repetitions.
+    static trigram::Query _required(const Node& node) {
+        auto single = [](const Node& n, char& c) { if (n.kind != Node::Bytes || n.bytes.count() != 1) return false; for (int b = 0; b < 256; ++b) if (n.bytes.test(b)) c = static_cast<char>(b); return true; };
+        switch (node.kind) {
+            case Node::Alt: { trigram::Query q = _required(node.kids[0]); for (size_t i = 1; i < node.kids.size(); ++i) q = trigram::Query::either(std::move(q), _required(node.kids[i])); return q; }
+            case Node::Repeat: return node.min == 0 ? trigram::Query() : _required(node.kids[0]);
+            case Node::Concat: {
+                trigram::Query q;
+                std::string run;
+                auto flush = [&] { q = trigram::Query::both(std::move(q), trigram::Query::literal(run)); run.clear(); };
+                for (const auto& kid : node.kids) {
+                    char c = 0;
+                    if (single(kid, c)) run.push_back(c);
+                    else if (kid.kind == Node::Repeat && kid.min > 0 && single(kid.kids[0], c)) { run.append(static_cast<size_t>(kid.min), c); if (kid.max != kid.min) flush(); }
+                    else { flush(); q = trigram::Query::both(std::move(q), _required(kid)); }
+                }
+                flush();
+                return q;
+            }
+            default: return trigram::Query();
+        }
+    }
+
+    std::vector<State> states_;
+    int start_ = 0;
+    uint64_t id_ = 0;
+    trigram::Query required_;
+};
+
+// What JSON.MATCH and KEYS.MATCH look for: a literal substring (SUBSTR) or a Regex (REGEX).
+struct StringMatcher {
+    bool regex = false;
+    std::string text;
+    Regex compiled;
+    static bool parse(const std::string& mode, const std::string& pattern, StringMatcher& out, std::string& error) {
+        std::string upper = mode;
+        std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+        if (upper != "SUBSTR" && upper != "REGEX") { error = "expected SUBSTR or REGEX"; return false; }
+        if (pattern.empty()) { error = "pattern cannot be empty"; return false; }
+        out.regex = upper == "REGEX";
+        out.text = pattern;
+        return !out.regex || Regex::compile(pattern, out.compiled, error);
+    }
+    trigram::Query required() const { return regex ? compiled.required() : trigram::Query::literal(text); }
+    bool matches(std::string_view s) const { return regex ? compiled.search(s) : s.find(text) != std::string_view::npos; }
+};
+
+// Trigram index over the strings at one field path of the elements of a JSON array: trigram -> ascending array
+// positions. Elements whose field is missing or not a string are not indexed and never match.
+struct JsonTrigramIndex {
+    JsonFieldPath field;
+    trigram::Postings postings;
+    size_t items = 0;
+    unsigned long long bytes = 0;
+
+    void add(std::string_view text, uint32_t pos) {
+        for (uint32_t g : trigram::of(text)) {
+            auto it = postings.find(g);
+            if (it == postings.end()) { it = postings.emplace(g, std::vector<uint32_t>()).first; bytes += trigram::bucket_bytes(); }
+            auto& list = it->second;
+            if (list.empty() || list.back() < pos) list.push_back(pos);
+            else list.insert(std::lower_bound(list.begin(), list.end(), pos), pos);
+            bytes += sizeof(uint32_t);
+        }
+        items++;
+    }
+    void remove(std::string_view text, uint32_t pos) {
+        for (uint32_t g : trigram::of(text)) {
+            auto it = postings.find(g);
+            if (it == postings.end()) continue;
+            auto& list = it->second;
+            auto p = std::lower_bound(list.begin(), list.end(), pos);
+            if (p == list.end() || *p != pos) continue;
+            list.erase(p);
+            bytes -= sizeof(uint32_t);
+            if (list.empty()) { bytes -= trigram::bucket_bytes(); postings.erase(it); }
+        }
+        items--;
+    }
+    const std::string* text(const json& item) const { const json* v = field.resolve(item); return v && v->is_string() ? &v->get_ref<const std::string&>() : nullptr; }
+    void add_item(const json& item, uint32_t pos) { if (const std::string* s = text(item)) add(*s, pos); }
+    void remove_item(const json& item, uint32_t pos) { if (const std::string* s = text(item)) remove(*s, pos); }
+    void clear() { postings.clear(); items = 0; bytes = 0; }
+    void rebuild(const json& doc) { clear(); if (doc.is_array()) for (size_t i = 0; i < doc.size(); ++i) add_item(doc[i], static_cast<uint32_t>(i)); }
+    void rebuild(const nkb::Document& doc) {
+        clear();
+        nkb::Value root = doc.root();
+        if (!root.is_array()) return;
+        std::vector<long long> ids;
+        for (const auto& token : field.tokens) ids.push_back(doc.key_id(token));
+        for (size_t i = 0, n = root.size(); i < n; ++i) { nkb::Value v = field.resolve(root.at(i), ids); if (v && v.is_string()) add(v.str(), static_cast<uint32_t>(i)); }
+    }
+};
+
+// Trigram index over key names for KEYS.MATCH. Keys get increasing ids, so posting lists stay sorted by appending.
+// A removed key only gives up its name; the lists are rebuilt from the live keys once most ids are dead.
+struct KeyTrigramIndex {
+    std::vector<std::string> names; // by id, empty once the key is removed
+    std::unordered_map<std::string, uint32_t> ids;
+    trigram::Postings postings;
+    size_t dead = 0;
+    unsigned long long bytes = 0;
+
+    static size_t key_bytes(const std::string& key) { return 2 * (sizeof(std::string) + string_heap_bytes(key)) + sizeof(uint32_t) + 4 * sizeof(void*); }
+    void add(const std::string& key) {
+        if (ids.count(key) || names.size() >= UINT32_MAX) return;
+        uint32_t id = static_cast<uint32_t>(names.size());
+        names.push_back(key);
+        ids.emplace(key, id);
+        bytes += key_bytes(key);
+        for (uint32_t g : trigram::of(key)) {
+            auto& list = postings[g];
+            if (list.empty()) bytes += trigram::bucket_bytes();
+            list.push_back(id);
+            bytes += sizeof(uint32_t);
+        }
+    }
+    void remove(const std::string& key) {
+        auto it = ids.find(key);
+        if (it == ids.end()) return;
+        std::string& name = names[it->second];
+        bytes -= key_bytes(name) - sizeof(std::string);
+        std::string().swap(name);
+        ids.erase(it);
+        dead++;
+    }
+    bool wants_rebuild() const { return dead > 1024 && dead > ids.size(); }
+    void clear() { names.clear(); ids.clear(); postings.clear(); dead = 0; bytes = 0; }
+};
+// --- Vector Search ---
+// Distance kernels over float vectors. Like the word search kernels, the widest the CPU supports is picked once;
+// the scalar ones stay as the reference STRESS VECTOR measures against.
+namespace vectors {
+    inline float dot_scalar(const float* a, const float* b, size_t n) { float s = 0; for (size_t i = 0; i < n; ++i) s += a[i] * b[i]; return s; }
+    inline float l2_scalar(const float* a, const float* b, size_t n) { float s = 0; for (size_t i = 0; i < n; ++i) { float d = a[i] - b[i]; s += d * d; } return s; }
+
+#if defined(__x86_64__) || defined(_M_X64)
+    inline float hsum(__m128 v) { __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)); __m128 sums = _mm_add_ps(v, shuf); return _mm_cvtss_f32(_mm_add_ss(sums, _mm_movehl_ps(shuf, sums))); }
+    inline float dot_sse2(const float* a, const float* b, size_t n) {
+        __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+        }
+        float s = hsum(_mm_add_ps(acc0, acc1));
+        for (; i < n; ++i) s += a[i] * b[i];
+        return s;
+    }
+    inline float l2_sse2(const float* a, const float* b, size_t n) {
+        __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+        }
+        float s = hsum(_mm_add_ps(acc0, acc1));
+        for (; i < n; ++i) { float d = a[i] - b[i]; s += d * d; }
+        return s;
+    }
+    // Kept apart from hsum so the whole reduction is VEX-encoded: mixing in legacy SSE after 256-bit work stalls.
+    NK_TARGET_AVX2 inline float hsum256(__m256 v) {
+        __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+        return _mm_cvtss_f32(_mm_add_ss(x, _mm_shuffle_ps(x, x, 1)));
+    }
+    NK_TARGET_AVX2 inline float dot_avx2(const float* a, const float* b, size_t n) {
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+            acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+        }
+        float s = hsum256(_mm256_add_ps(acc0, acc1));
+        for (; i < n; ++i) s += a[i] * b[i];
+        return s;
+    }
+    NK_TARGET_AVX2 inline float l2_avx2(const float* a, const float* b, size_t n) {
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)), d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+            acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(d0, d0));
+            acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(d1, d1));
+        }
+        float s = hsum256(_mm256_add_ps(acc0, acc1));
+        for (; i < n; ++i) { float d = a[i] - b[i]; s += d * d; }
+        return s;
+    }
+#endif
+
+    using Kernel = float (*)(const float*, const float*, size_t);
+    struct Dispatch { Kernel dot, l2; const char* name; };
+    inline const Dispatch& scalar() { static const Dispatch kernels{dot_scalar, l2_scalar, "scalar"}; return kernels; }
+    inline const Dispatch& best() {
+        static const Dispatch chosen = [] {
+        #if defined(__x86_64__) || defined(_M_X64)
+            if (wordsearch::cpu_has_avx2()) return Dispatch{dot_avx2, l2_avx2, "AVX2"};
+            return Dispatch{dot_sse2, l2_sse2, "SSE2"};
+        #else
+            return scalar();
+        #endif
+        }();
+        return chosen;
+    }
+
+    // L2 ranks by Euclidean distance, COSINE by 1 - cosine similarity and DOT by the negated dot product, so that
+    // smaller is always closer. COSINE vectors are normalized on the way in and then compared by dot product.
+    enum class Metric : uint8_t { L2, Cosine, Dot };
+    inline bool parse_metric(std::string name, Metric& out) {
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        if (name == "L2") out = Metric::L2;
+        else if (name == "COSINE") out = Metric::Cosine;
+        else if (name == "DOT") out = Metric::Dot;
+        else return false;
+        return true;
+    }
+    inline const char* metric_name(Metric metric) { return metric == Metric::L2 ? "L2" : metric == Metric::Cosine ? "COSINE" : "DOT"; }
+    // The kernels' distance; for L2 it is squared, which orders the same and saves the square root.
+    inline float distance(Metric metric, const Dispatch& kernels, const float* a, const float* b, size_t n) {
+        if (metric == Metric::L2) return kernels.l2(a, b, n);
+        float dot = kernels.dot(a, b, n);
+        return metric == Metric::Cosine ? 1.0f - dot : -dot;
+    }
+    // The distance shown to clients.
+    inline double reported(Metric metric, float distance) { return metric == Metric::L2 ? std::sqrt(std::max(distance, 0.0f)) : distance; }
+    // Readies a vector for `metric`; false if it cannot be compared (a zero vector has no direction for COSINE).
+    inline bool prepare(Metric metric, std::vector<float>& v) {
+        if (v.empty()) return false;
+        if (metric != Metric::Cosine) return true;
+        double norm = 0;
+        for (float x : v) norm += static_cast<double>(x) * x;
+        if (norm == 0) return false;
+        float scale = static_cast<float>(1.0 / std::sqrt(norm));
+        for (float& x : v) x *= scale;
+        return true;
+    }
+    // Reads a JSON array of numbers into `out`; false for anything else, or for a number a float cannot hold.
+    inline bool read(const json& v, std::vector<float>& out) {
+        if (!v.is_array()) return false;
+        out.clear();
+        out.reserve(v.size());
+        for (const auto& x : v) { if (!x.is_number()) return false; float f = x.get<float>(); if (!std::isfinite(f)) return false; out.push_back(f); }
+        return true;
+    }
+    inline bool read(const nkb::Value& v, std::vector<float>& out) {
+        if (!v.is_array()) return false;
+        out.clear();
+        size_t n = v.size();
+        out.reserve(n);
+        for (size_t i = 0; i < n; ++i) { nkb::Value x = v.at(i); if (!x.is_number()) return false; float f = static_cast<float>(x.number()); if (!std::isfinite(f)) return false; out.push_back(f); }
+        return true;
+    }
+
+    using Scored = std::pair<float, uint32_t>; // distance, id
+    // Keeps the `k` nearest of the ids offered to it; ties go to the lower id.
+    struct Nearest {
+        size_t k;
+        std::priority_queue<Scored> heap; // top: the farthest kept
+        explicit Nearest(size_t k) : k(k) {}
+        void offer(float distance, uint32_t id) {
+            Scored scored{distance, id};
+            if (heap.size() < k) heap.push(scored);
+            else if (k && scored < heap.top()) { heap.pop(); heap.push(scored); }
+        }
+        std::vector<Scored> sorted() { std::vector<Scored> out(heap.size()); for (size_t i = out.size(); i-- > 0; heap.pop()) out[i] = heap.top(); return out; }
+    };
+}
+
+// Approximate nearest-neighbour index over the float arrays at one field path of the elements of a JSON array: an
+// HNSW graph (layers of proximity graphs, each a sparser sample of the one below, searched greedily from the top).
+// Vectors are copied into one contiguous buffer. The first vector indexed fixes the dimension; elements whose field
+// is not a numeric array of that length are not indexed. A removed or rewritten element leaves a dead node that still
+// routes searches but is never returned, and the graph is rebuilt from the live vectors once the dead outnumber them.
+struct JsonVectorIndex {
+    static constexpr uint32_t NONE = UINT32_MAX;
+    using Scored = vectors::Scored;
+    JsonFieldPath field;
+    vectors::Metric metric = vectors::Metric::L2;
+    size_t dim = 0;
+    std::vector<float> data;                               // node -> its `dim` floats
+    std::vector<uint32_t> positions;                       // node -> array position
+    std::vector<std::vector<std::vector<uint32_t>>> links; // node -> layer -> neighbours
+    std::vector<uint32_t> node_of;                         // array position -> live node, or NONE
+    std::vector<bool> dead;
+    uint32_t entry = NONE;
+    int top = -1;
+    size_t live = 0, removed = 0, layers = 0, slots = 0;
+    std::mt19937 rng{42};
+    unsigned long long bytes = 0;
+
+    const float* vec(uint32_t node) const { return data.data() + static_cast<size_t>(node) * dim; }
+    float dist(const float* q, uint32_t node) const { return vectors::distance(metric, vectors::best(), q, vec(node), dim); }
+    static size_t max_links(int layer) { return layer == 0 ? 2 * VECTOR_INDEX_M : VECTOR_INDEX_M; }
+    void account() {
+        bytes = (data.size() * sizeof(float)) + (positions.size() + node_of.size() + slots) * sizeof(uint32_t) + dead.size() / 8
+              + links.size() * sizeof(links[0]) + layers * sizeof(std::vector<uint32_t>);
+    }
+
+    // Nodes seen by the current search, by generation so that nothing is cleared between searches. Per thread,
+    // since searches run under the shared lock.
+    struct Visited {
+        std::vector<uint32_t> marks;
+        uint32_t generation = 0;
+        void start(size_t n) { if (marks.size() < n) marks.resize(n, 0); if (++generation == 0) { std::fill(marks.begin(), marks.end(), 0); generation = 1; } }
+        bool first_visit(uint32_t node) { if (marks[node] == generation) return false; marks[node] = generation; return true; }
+    };
+    static Visited& visited() { thread_local Visited v; return v; }
+
+    Scored greedy(const float* q, Scored at, int layer) const {
+        for (bool moved = true; moved;) {
+            moved = false;
+            for (uint32_t next : links[at.second][layer]) { float d = dist(q, next); if (d < at.first) { at = {d, next}; moved = true; } }
+        }
+        return at;
+    }
+    // Best-first search of one layer keeping the `ef` nearest nodes found, returned nearest first. With `live_only`
+    // dead nodes are still walked through but not kept.
+    std::vector<Scored> search_layer(const float* q, const std::vector<Scored>& entries, size_t ef, int layer, bool live_only) const {
+        Visited& seen = visited();
+        seen.start(links.size());
+        std::priority_queue<Scored, std::vector<Scored>, std::greater<Scored>> frontier; // top: the nearest
+        std::priority_queue<Scored> kept;                                                 // top: the farthest
+        auto keep = [&](const Scored& s) { if (live_only && dead[s.second]) return; kept.push(s); if (kept.size() > ef) kept.pop(); };
+        for (const auto& e : entries) if (seen.first_visit(e.second)) { frontier.push(e); keep(e); }
+        while (!frontier.empty()) {
+            Scored nearest = frontier.top();
+            if (kept.size() >= ef && nearest.first > kept.top().first) break;
+            frontier.pop();
+            for (uint32_t next : links[nearest.second][layer]) {
+                if (!seen.first_visit(next)) continue;
+                float d = dist(q, next);
+                if (kept.size() < ef || d < kept.top().first) { frontier.push({d, next}); keep({d, next}); }
+            }
+        }
+        std::vector<Scored> out(kept.size());
+        for (size_t i = out.size(); i-- > 0; kept.pop()) out[i] = kept.top();
+        return out;
+    }
+    // Keeps up to `m` live candidates (given nearest first), skipping any that lies closer to a neighbour already kept
+    // than to the node itself: the edges then spread in different directions, which keeps the graph navigable.
+    std::vector<uint32_t> select(const std::vector<Scored>& candidates, size_t m) const {
+        std::vector<uint32_t> chosen;
+        for (const auto& c : candidates) {
+            if (chosen.size() >= m) break;
+            if (dead[c.second]) continue;
+            bool diverse = true;
+            for (uint32_t other : chosen) if (dist(vec(c.second), other) < c.first) { diverse = false; break; }
+            if (diverse) chosen.push_back(c.second);
+        }
+        return chosen;
+    }
+    void insert(const float* v, uint32_t pos) {
+        if (dim == 0) return;
+        uint32_t node = static_cast<uint32_t>(positions.size());
+        data.insert(data.end(), v, v + dim);
+        positions.push_back(pos);
+        dead.push_back(false);
+        if (node_of.size() <= pos) node_of.resize(static_cast<size_t>(pos) + 1, NONE);
+        node_of[pos] = node;
+        live++;
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        int level = std::min(16, static_cast<int>(-std::log(std::max(unit(rng), 1e-12)) / std::log(static_cast<double>(std::max<size_t>(VECTOR_INDEX_M, 2)))));
+        links.emplace_back(level + 1);
+        layers += level + 1;
+        if (entry == NONE) { entry = node; top = level; account(); return; }
+        const float* q = vec(node);
+        Scored at{dist(q, entry), entry};
+        for (int layer = top; layer > level; --layer) at = greedy(q, at, layer);
+        std::vector<Scored> entries{at};
+        for (int layer = std::min(top, level); layer >= 0; --layer) {
+            std::vector<Scored> found = search_layer(q, entries, std::max<size_t>(VECTOR_EF_CONSTRUCTION, 1), layer, false);
+            std::vector<uint32_t> neighbours = select(found, VECTOR_INDEX_M);
+            slots += neighbours.size();
+            for (uint32_t other : neighbours) {
+                auto& list = links[other][layer];
+                list.push_back(node);
+                slots++;
+                if (list.size() <= max_links(layer)) continue;
+                // Over capacity: the neighbour keeps its most useful links, which also sheds links to dead nodes.
+                std::vector<Scored> scored;
+                for (uint32_t linked : list) scored.push_back({dist(vec(other), linked), linked});
+                std::sort(scored.begin(), scored.end());
+                std::vector<uint32_t> pruned = select(scored, max_links(layer));
+                slots -= list.size() - pruned.size();
+                list = std::move(pruned);
+            }
+            links[node][layer] = std::move(neighbours);
+            entries = std::move(found);
+        }
+        if (level > top) { top = level; entry = node; }
+        account();
+    }
+    void remove(uint32_t pos) {
+        if (pos >= node_of.size() || node_of[pos] == NONE) return;
+        dead[node_of[pos]] = true;
+        node_of[pos] = NONE;
+        live--;
+        removed++;
+        if (removed > 1024 && removed > live) compact();
+        account();
+    }
+    // Rebuilds the graph from the live vectors alone.
+    void compact() {
+        std::vector<float> kept;
+        std::vector<uint32_t> owners;
+        for (uint32_t node = 0; node < positions.size(); ++node) if (!dead[node]) { kept.insert(kept.end(), vec(node), vec(node) + dim); owners.push_back(positions[node]); }
+        size_t width = dim;
+        clear();
+        dim = width;
+        for (size_t i = 0; i < owners.size(); ++i) insert(kept.data() + i * width, owners[i]);
+    }
+    void add(std::vector<float>& v, uint32_t pos) {
+        if (!vectors::prepare(metric, v) || (dim && v.size() != dim)) return;
+        if (dim == 0) dim = v.size();
+        insert(v.data(), pos);
+    }
+    void add_item(const json& item, uint32_t pos) { const json* v = field.resolve(item); std::vector<float> floats; if (v && vectors::read(*v, floats)) add(floats, pos); }
+    void clear() {
+        dim = 0; data.clear(); positions.clear(); links.clear(); node_of.clear(); dead.clear();
+        entry = NONE; top = -1; live = removed = layers = slots = 0; rng.seed(42);
+        account();
+    }
+    void rebuild(const json& doc) { clear(); if (doc.is_array()) for (size_t i = 0; i < doc.size(); ++i) add_item(doc[i], static_cast<uint32_t>(i)); }
+    void rebuild(const nkb::Document& doc) {
+        clear();
+        nkb::Value root = doc.root();
+        if (!root.is_array()) return;
+        std::vector<long long> ids;
+        for (const auto& token : field.tokens) ids.push_back(doc.key_id(token));
+        std::vector<float> floats;
+        for (size_t i = 0, n = root.size(); i < n; ++i) { nkb::Value v = field.resolve(root.at(i), ids); if (v && vectors::read(v, floats)) add(floats, static_cast<uint32_t>(i)); }
+    }
+    // The `k` live nodes nearest to `q` (already readied for the metric) as {distance, array position}, nearest
+    // first. The graph search keeps `ef` candidates on the bottom layer; more finds more of the true neighbours.
+    std::vector<Scored> search(const float* q, size_t k, size_t ef) const {
+        if (entry == NONE || live == 0) return {};
+        Scored at{dist(q, entry), entry};
+        for (int layer = top; layer > 0; --layer) at = greedy(q, at, layer);
+        std::vector<Scored> found = search_layer(q, {at}, std::max(ef, k), 0, true);
+        if (found.size() > k) found.resize(k);
+        for (auto& s : found) s.second = positions[s.second];
+        return found;
+    }
+    // The same by comparing `q` with every live vector.
+    std::vector<Scored> exact(const float* q, size_t k, const vectors::Dispatch& kernels) const {
+        vectors::Nearest nearest(k);
+        for (uint32_t node = 0; node < positions.size(); ++node) if (!dead[node]) nearest.offer(vectors::distance(metric, kernels, q, vec(node), dim), positions[node]);
+        return nearest.sorted();
+    }
+};
+// --- Geospatial Search ---
+// Points are keyed by a 52-bit geohash: 26 bits each of latitude and longitude, interleaved, so the points of one
+// cell (of any size down to about 0.6 m) form one contiguous range of hashes. A radius query covers the circle's
+// bounding box with a few cells and only reads those ranges.
+namespace geo {
+    constexpr double EARTH_RADIUS_M = 6372797.560856; // the sphere Redis GEO measures on
+    constexpr int MAX_STEP = 26;
+    constexpr double PI = 3.14159265358979323846;
+
+    inline double radians(double degrees) { return degrees * PI / 180.0; }
+    inline double degrees(double radians) { return radians * 180.0 / PI; }
+    inline bool valid(double lat, double lon) { return std::isfinite(lat) && std::isfinite(lon) && lat >= -90 && lat <= 90 && lon >= -180 && lon <= 180; }
+    // Great-circle distance in meters (haversine).
+    inline double distance(double lat1, double lon1, double lat2, double lon2) {
+        double dlat = radians(lat2 - lat1), dlon = radians(lon2 - lon1);
+        double a = std::sin(dlat / 2) * std::sin(dlat / 2) + std::cos(radians(lat1)) * std::cos(radians(lat2)) * std::sin(dlon / 2) * std::sin(dlon / 2);
+        return 2 * EARTH_RADIUS_M * std::asin(std::min(1.0, std::sqrt(a)));
+    }
+    // Spreads the low 32 bits of `v` over the even bits of the result.
+    inline uint64_t spread(uint64_t v) {
+        v &= 0xFFFFFFFFULL;
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        v = (v | (v << 2)) & 0x3333333333333333ULL;
+        v = (v | (v << 1)) & 0x5555555555555555ULL;
+        return v;
+    }
+    inline uint64_t interleave(uint64_t lat_cell, uint64_t lon_cell) { return (spread(lon_cell) << 1) | spread(lat_cell); }
+    // The row (or column) of `value` among the 2^step cells between `min` and `max`; may fall outside them.
+    inline long long cell(double value, double min, double max, int step) { return static_cast<long long>(std::floor((value - min) / (max - min) * static_cast<double>(1ULL << step))); }
+    inline long long clamp_cell(long long c, int step) { return std::max(0LL, std::min(c, static_cast<long long>((1ULL << step) - 1))); }
+    inline uint64_t hash(double lat, double lon) { return interleave(clamp_cell(cell(lat, -90, 90, MAX_STEP), MAX_STEP), clamp_cell(cell(lon, -180, 180, MAX_STEP), MAX_STEP)); }
+    // The hash ranges [first, last) of the cells that cover the bounding box of the circle around (lat, lon), at the
+    // finest step where no more than 16 cells are needed. Adjacent ranges are merged.
+    inline std::vector<std::pair<uint64_t, uint64_t>> cover(double lat, double lon, double radius_m) {
+        const double margin = 1e-9; // degrees, against rounding at the box's edges
+        double angle = radius_m / EARTH_RADIUS_M;
+        double lat_min = lat - degrees(angle) - margin, lat_max = lat + degrees(angle) + margin;
+        // The box spans every longitude when the circle holds a pole.
+        bool all_lon = lat_min <= -90 || lat_max >= 90 || angle >= PI / 2;
+        double dlon = 0;
+        if (!all_lon) { double s = std::sin(angle) / std::cos(radians(lat)); if (s >= 1) all_lon = true; else dlon = degrees(std::asin(s)) + margin; }
+        lat_min = std::max(lat_min, -90.0); lat_max = std::min(lat_max, 90.0);
+        int step = MAX_STEP;
+        long long lat_first = 0, lat_last = 0, lon_first = 0, lon_last = 0;
+        for (;; --step) {
+            long long width = static_cast<long long>(1ULL << step);
+            lat_first = clamp_cell(cell(lat_min, -90, 90, step), step); lat_last = clamp_cell(cell(lat_max, -90, 90, step), step);
+            if (all_lon) { lon_first = 0; lon_last = width - 1; }
+            else { lon_first = cell(lon - dlon, -180, 180, step); lon_last = cell(lon + dlon, -180, 180, step); if (lon_last - lon_first >= width) { lon_first = 0; lon_last = width - 1; } }
+            if (step == 0 || (lat_last - lat_first + 1) * (lon_last - lon_first + 1) <= 16) break;
+        }
+        // Columns past the antimeridian wrap around to the other side.
+        long long width = static_cast<long long>(1ULL << step);
+        int shift = 2 * (MAX_STEP - step);
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+        for (long long r = lat_first; r <= lat_last; ++r) {
+            for (long long c = lon_first; c <= lon_last; ++c) {
+                uint64_t prefix = interleave(static_cast<uint64_t>(r), static_cast<uint64_t>(((c % width) + width) % width));
+                ranges.push_back({prefix << shift, (prefix + 1) << shift});
+            }
+        }
+        std::sort(ranges.begin(), ranges.end());
+        std::vector<std::pair<uint64_t, uint64_t>> merged;
+        for (const auto& range : ranges) { if (!merged.empty() && range.first <= merged.back().second) merged.back().second = std::max(merged.back().second, range.second); else merged.push_back(range); }
+        return merged;
+    }
+    // Meters per unit of GEORADIUS distances.
+    inline bool parse_unit(std::string name, double& meters) {
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        if (name == "M") meters = 1;
+        else if (name == "KM") meters = 1000;
+        else if (name == "MI") meters = 1609.34;
+        else if (name == "FT") meters = 0.3048;
+        else return false;
+        return true;
+    }
+}
+
+// Geohash index over the points at a pair of latitude / longitude field paths of the elements of a JSON array.
+// Elements whose fields are missing, not numbers or out of range are not indexed and never match.
+struct JsonGeoIndex {
+    struct Point { double lat, lon; };
+    JsonFieldPath lat_field, lon_field;
+    std::set<std::pair<uint64_t, uint32_t>> cells; // geohash, array position
+    std::vector<Point> points;                     // array position -> point (NaN latitude if none)
+    size_t items = 0;
+    unsigned long long bytes = 0;
+
+    static constexpr size_t NODE_BYTES = sizeof(std::pair<uint64_t, uint32_t>) + 4 * sizeof(void*);
+    void account() { bytes = items * NODE_BYTES + points.size() * sizeof(Point); }
+    void add(double lat, double lon, uint32_t pos) {
+        if (!geo::valid(lat, lon)) return;
+        if (points.size() <= pos) points.resize(static_cast<size_t>(pos) + 1, Point{std::nan(""), 0});
+        if (!std::isnan(points[pos].lat)) remove(pos);
+        points[pos] = {lat, lon};
+        cells.insert({geo::hash(lat, lon), pos});
+        items++;
+        account();
+    }
+    void remove(uint32_t pos) {
+        if (pos >= points.size() || std::isnan(points[pos].lat)) return;
+        cells.erase({geo::hash(points[pos].lat, points[pos].lon), pos});
+        points[pos].lat = std::nan("");
+        items--;
+        account();
+    }
+    void add_item(const json& item, uint32_t pos) {
+        const json* lat = lat_field.resolve(item);
+        const json* lon = lon_field.resolve(item);
+        if (lat && lon && lat->is_number() && lon->is_number()) add(lat->get<double>(), lon->get<double>(), pos);
+    }
+    void clear() { cells.clear(); points.clear(); items = 0; account(); }
+    void rebuild(const json& doc) { clear(); if (doc.is_array()) for (size_t i = 0; i < doc.size(); ++i) add_item(doc[i], static_cast<uint32_t>(i)); }
+    void rebuild(const nkb::Document& doc) {
+        clear();
+        nkb::Value root = doc.root();
+        if (!root.is_array()) return;
+        std::vector<long long> lat_ids, lon_ids;
+        for (const auto& token : lat_field.tokens) lat_ids.push_back(doc.key_id(token));
+        for (const auto& token : lon_field.tokens) lon_ids.push_back(doc.key_id(token));
+        for (size_t i = 0, n = root.size(); i < n; ++i) {
+            nkb::Value item = root.at(i), lat = lat_field.resolve(item, lat_ids), lon = lon_field.resolve(item, lon_ids);
+            if (lat && lon && lat.is_number() && lon.is_number()) add(lat.number(), lon.number(), static_cast<uint32_t>(i));
+        }
+    }
+    // Calls `fn(pos, meters)` for every indexed point within `radius_m` of (lat, lon), reading only the cells that
+    // cover the circle. Returns the number of points checked.
+    template <typename Fn> size_t within(double lat, double lon, double radius_m, Fn fn) const {
+        size_t checked = 0;
+        for (const auto& range : geo::cover(lat, lon, radius_m)) {
+            for (auto it = cells.lower_bound({range.first, 0}); it != cells.end() && it->first < range.second; ++it, ++checked) {
+                const Point& p = points[it->second];
+                double d = geo::distance(lat, lon, p.lat, p.lon);
+                if (d <= radius_m) fn(it->second, d);
+            }
+        }
+        return checked;
+    }
+};
+// --- Response Formats ---
+// How JSON results are written back: indented text (the default), compact text, or CBOR / MessagePack bytes.
+// Status replies and errors ("+OK", "-ERR ...", "(nil)") are always plain text.
+enum class ResponseFormat { Pretty, Compact, Cbor, MsgPack };
+inline bool parse_response_format(std::string name, ResponseFormat& format) {
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    if (name == "PRETTY") format = ResponseFormat::Pretty;
+    else if (name == "COMPACT") format = ResponseFormat::Compact;
+    else if (name == "CBOR") format = ResponseFormat::Cbor;
+    else if (name == "MSGPACK") format = ResponseFormat::MsgPack;
+    else return false;
+    return true;
+}
+inline const char* response_format_name(ResponseFormat format) {
+    switch (format) { case ResponseFormat::Compact: return "COMPACT"; case ResponseFormat::Cbor: return "CBOR"; case ResponseFormat::MsgPack: return "MSGPACK"; default: return "PRETTY"; }
+}
+inline std::string render_json(const json& j, ResponseFormat format) {
+    std::string out;
+    switch (format) {
+        case ResponseFormat::Compact: return j.dump();
+        case ResponseFormat::Cbor: json::to_cbor(j, out); return out;
+        case ResponseFormat::MsgPack: json::to_msgpack(j, out); return out;
+        default: return j.dump(2);
+    }
+}
+// Renders a JSON array one element at a time, producing the same bytes as render_json on the whole array, so a
+// large result never has to exist as a json tree. Until take() is called nothing is committed: finish() then
+// returns the complete array. take() hands over what is buffered so it can go out as a frame, after which the
+// rest follows as more frames; CBOR switches to an indefinite-length array for that, and MessagePack, which has
+// to know the element count up front, cannot be taken.
+class ArrayWriter {
+public:
+    explicit ArrayWriter(ResponseFormat format) : format_(format) {}
+    void push(const json& item) {
+        switch (format_) {
+            case ResponseFormat::Pretty: {
+                body_ += count_ ? ",\n  " : "  ";
+                std::string text = item.dump(2); // strings never hold a raw newline, so every '\n' starts a line to indent
+                for (size_t start = 0; start < text.size();) { size_t nl = text.find('\n', start); if (nl == std::string::npos) { body_.append(text, start, std::string::npos); break; } body_.append(text, start, nl + 1 - start); body_ += "  "; start = nl + 1; }
+                break;
+            }
+            case ResponseFormat::Compact: if (count_) body_.push_back(','); body_ += item.dump(); break;
+            case ResponseFormat::Cbor: json::to_cbor(item, body_); break;
+            case ResponseFormat::MsgPack: json::to_msgpack(item, body_); break;
+        }
+        count_++;
+    }
+    size_t size() const { return count_; }
+    size_t buffered() const { return body_.size(); }
+    bool can_take() const { return format_ != ResponseFormat::MsgPack; }
+    bool taken() const { return taken_; }
+    std::string take() {
+        std::string out;
+        if (!taken_) out = format_ == ResponseFormat::Cbor ? std::string(1, '\x9f') : format_ == ResponseFormat::Pretty && count_ ? "[\n" : "[";
+        taken_ = true;
+        out += body_;
+        body_.clear();
+        return out;
+    }
+    std::string finish() {
+        if (taken_) return take() + (format_ == ResponseFormat::Cbor ? std::string(1, '\xff') : format_ == ResponseFormat::Pretty && count_ ? "\n]" : "]");
+        std::string out;
+        switch (format_) {
+            case ResponseFormat::Pretty: return count_ ? "[\n" + body_ + "\n]" : "[]";
+            case ResponseFormat::Compact: return "[" + body_ + "]";
+            case ResponseFormat::Cbor: cbor_header(out); break;
+            case ResponseFormat::MsgPack:
+                if (count_ < 16) out.push_back(static_cast<char>(0x90 | count_));
+                else if (count_ <= 0xFFFF) { out.push_back('\xdc'); put_be(out, count_, 2); }
+                else { out.push_back('\xdd'); put_be(out, count_, 4); }
+                break;
+        }
+        return out + body_;
+    }
+private:
+    static void put_be(std::string& out, uint64_t value, int bytes) { for (int i = bytes - 1; i >= 0; --i) out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF)); }
+    void cbor_header(std::string& out) const {
+        if (count_ < 24) { out.push_back(static_cast<char>(0x80 | count_)); return; }
+        int bytes = count_ <= 0xFF ? 1 : count_ <= 0xFFFF ? 2 : count_ <= 0xFFFFFFFFULL ? 4 : 8;
+        out.push_back(static_cast<char>(0x98 + (bytes == 1 ? 0 : bytes == 2 ? 1 : bytes == 4 ? 2 : 3)));
+        put_be(out, count_, bytes);
+    }
+    ResponseFormat format_;
+    std::string body_;
+    size_t count_ = 0;
+    bool taken_ = false;
+};
+// `stream`, when set, sends a non-final frame of the reply straight to the client (STREAM ON connections).
+struct Task { std::string command_str; std::vector<std::string> args; std::promise<HandlerResult> promise; std::function<void()> job; ResponseFormat format = ResponseFormat::Pretty; std::function<bool(const std::string&)> stream; };
+
+// --- Core Database Engine ---
+class NukeKV {
+private:
+    std::unordered_map<std::string, ValueEntry> kv_store_;
+    std::unordered_map<std::string, long long> ttl_map_;
+    std::list<std::string> lru_list_;
+    std::unordered_map<std::string, std::list<std::string>::iterator> lru_map_;
+    
+    mutable std::shared_mutex data_mutex_;
+    std::vector<std::thread> workers_;
+    std::queue<Task> task_queue_;
+    std::mutex queue_mutex_;
+    std::condition_variable condition_;
+    std::atomic<bool> stop_all_ = false;
+    std::thread background_manager_thread_;
+    std::atomic<int> dirty_operations_ = 0;
+    std::atomic<unsigned long long> estimated_memory_usage_ = 0;
+    unsigned long long max_memory_bytes_ = 0;
+    unsigned long long high_watermark_bytes_ = 0;
+    unsigned long long low_watermark_bytes_ = 0;
+    std::thread eviction_thread_;
+    std::mutex eviction_mutex_;
+    std::condition_variable eviction_cv_;
+    std::condition_variable eviction_progress_cv_;
+    std::atomic<unsigned long long> evicted_keys_ = 0;
+    std::thread reclaimer_thread_;
+    std::mutex reclaim_mutex_;
+    std::condition_variable reclaim_cv_;
+    std::deque<std::pair<std::shared_ptr<void>, unsigned long long>> reclaim_queue_;
+    std::atomic<unsigned long long> reclaim_pending_bytes_ = 0;
+    std::atomic<unsigned long long> lazy_freed_objects_ = 0;
+    mutable std::mutex value_file_mutex_;
+    mutable std::fstream value_file_;
+    uint64_t value_file_size_ = 0;
+    std::atomic<unsigned long long> value_file_dead_bytes_ = 0;
+    std::atomic<unsigned long long> spilled_keys_ = 0;
+    std::atomic<unsigned long long> promoted_keys_ = 0;
+    mutable std::shared_mutex dict_mutex_;
+    std::vector<std::shared_ptr<const std::string>> compression_dicts_; // dict_id N lives at index N - 1
+    std::atomic<unsigned long long> compressed_values_ = 0;
+    std::atomic<unsigned long long> compressed_raw_bytes_ = 0;
+    std::atomic<unsigned long long> compressed_stored_bytes_ = 0;
+    std::atomic<unsigned long long> queued_task_bytes_ = 0;
+    uint64_t revision_counter_ = 0;
+    std::list<std::string> doc_lru_;
+    unsigned long long doc_cache_bytes_ = 0;
+    mutable std::atomic<unsigned long long> doc_cache_hits_ = 0;
+    mutable std::atomic<unsigned long long> doc_cache_misses_ = 0;
+    std::unordered_map<std::string, std::map<std::string, JsonFieldIndex>> json_indexes_; // key -> field -> index
+    std::unordered_map<std::string, JsonTextIndex> text_indexes_;
+    std::vector<JsonCollectionIndex> collection_indexes_; // JSON.FINDINDEX, across the keys under a prefix
+    std::unordered_map<std::string, std::map<std::string, JsonTrigramIndex>> trigram_indexes_; // key -> field -> index
+    std::unique_ptr<KeyTrigramIndex> key_trigrams_; // JSON.TRIGRAM CREATE KEYS, for KEYS.MATCH
+    std::unordered_map<std::string, std::map<std::string, JsonVectorIndex>> vector_indexes_; // key -> field -> index
+    std::unordered_map<std::string, std::map<std::string, JsonGeoIndex>> geo_indexes_; // key -> "<lat field>,<lon field>" -> index
+    std::atomic<unsigned long long> json_index_bytes_ = 0; // field, text, trigram and collection indexes together
+    QueryCache query_cache_;
+    std::atomic<unsigned long long> parallel_scans_{0};
+    inline static thread_local ResponseFormat response_format_ = ResponseFormat::Pretty; // of the task this worker is running
+    inline static thread_local const std::function<bool(const std::string&)>* response_stream_ = nullptr; // its frame sender, if it may stream
+    std::atomic<unsigned long long> streamed_replies_{0}, streamed_frames_{0};
+    inline static thread_local bool reply_streamed_ = false; // the running task already sent part of its reply
+    std::unordered_set<std::string> cached_keys_; // JSON.CACHE ON
+    std::atomic<size_t> cached_key_count_{0};     // its size, so reads of other keys can skip the lookup without the lock
+    ResultCache result_cache_;
+    std::ofstream journal_;
+    uint64_t journal_seq_ = 0;   // sequence number of the last journaled write; snapshots record it
+    unsigned long long journal_bytes_ = 0;
+
+    void _update_lru(const std::string& key) { if (!CACHING_ENABLED || max_memory_bytes_ == 0) return; if (lru_map_.count(key)) lru_list_.erase(lru_map_[key]); lru_list_.push_front(key); lru_map_[key] = lru_list_.begin(); }
+    // Hands ownership of `obj` to the reclaimer thread, so its destructor runs outside the data lock.
+    template <typename T> void _free_lazily(T&& obj, unsigned long long approx_bytes) {
+        auto holder = std::make_shared<std::decay_t<T>>(std::move(obj));
+        { std::lock_guard<std::mutex> lock(reclaim_mutex_); reclaim_queue_.emplace_back(std::move(holder), approx_bytes); }
+        reclaim_pending_bytes_ += approx_bytes;
+        reclaim_cv_.notify_one();
+    }
+    void _reclaimer_loop() {
+        while (true) {
+            std::pair<std::shared_ptr<void>, unsigned long long> item;
+            {
+                std::unique_lock<std::mutex> lock(reclaim_mutex_);
+                reclaim_cv_.wait(lock, [this] { return stop_all_ || !reclaim_queue_.empty(); });
+                if (reclaim_queue_.empty()) return;
+                item = std::move(reclaim_queue_.front());
+                reclaim_queue_.pop_front();
+            }
+            item.first.reset();
+            reclaim_pending_bytes_ -= item.second;
+            lazy_freed_objects_++;
+        }
+    }
+    // Releases a value's buffer, deferring the free to the reclaimer when it is large enough to matter.
+    void _release_value_unlocked(std::string& value, bool lazy) {
+        if (lazy && value.capacity() >= LAZY_FREE_THRESHOLD_BYTES) { unsigned long long bytes = value.capacity(); _free_lazily(std::move(value), bytes); }
+        std::string().swap(value);
+    }
+    // Bytes a key counts against the memory limit. A spilled value leaves only the key and its locator behind.
+    static unsigned long long _entry_footprint(const std::string& key, const ValueEntry& entry) { return key.size() + (entry.on_disk ? sizeof(uint64_t) * 2 : entry.data.size()) + entry.doc_bytes; }
+    static uint64_t _stored_length(const ValueEntry& entry) { return entry.on_disk ? entry.disk_length : entry.data.size(); }
+    std::shared_ptr<const std::string> _dictionary(uint16_t dict_id) const {
+        if (dict_id == 0) return nullptr;
+        std::shared_lock<std::shared_mutex> lock(dict_mutex_);
+        return dict_id <= compression_dicts_.size() ? compression_dicts_[dict_id - 1] : nullptr;
+    }
+    // Returns the entry's encoded bytes, reading them back from the value file if the entry has been spilled.
+    std::string _read_stored_bytes(const ValueEntry& entry) const {
+        if (!entry.on_disk) return entry.data;
+        std::string bytes(entry.disk_length, '\0');
+        std::lock_guard<std::mutex> lock(value_file_mutex_);
+        value_file_.clear();
+        value_file_.seekg(static_cast<std::streamoff>(entry.disk_offset));
+        if (!value_file_.read(&bytes[0], static_cast<std::streamsize>(entry.disk_length))) throw std::runtime_error("could not read spilled value from " + VALUE_FILENAME);
+        return bytes;
+    }
+    std::string _decode_value(const ValueEntry& entry, const std::string& stored) const {
+        if (entry.encoding == ValueEncoding::Raw) return stored;
+        auto dict = _dictionary(entry.dict_id);
+        std::string value;
+        if (!nukelz::decompress(stored, entry.raw_size, value, dict ? *dict : std::string())) throw std::runtime_error("corrupt compressed value");
+        return value;
+    }
+    // Returns the stored bytes with compression undone. For a spilled entry, `spilled_bytes` (if given) receives
+    // the encoded bytes read from disk so the caller can promote them without a second read.
+    std::string _read_payload(const ValueEntry& entry, std::string* spilled_bytes = nullptr) const {
+        if (!entry.on_disk) return entry.encoding == ValueEncoding::Raw ? entry.data : _decode_value(entry, entry.data);
+        std::string stored = _read_stored_bytes(entry);
+        std::string value = _decode_value(entry, stored);
+        if (spilled_bytes) *spilled_bytes = std::move(stored);
+        return value;
+    }
+    // Like _read_payload, but avoids the copy for a resident, uncompressed value. `scratch` backs the view otherwise.
+    std::string_view _payload_view(const ValueEntry& entry, std::string& scratch, std::string* spilled_bytes = nullptr) const {
+        if (!entry.on_disk && entry.encoding == ValueEncoding::Raw) return entry.data;
+        scratch = _read_payload(entry, spilled_bytes);
+        return scratch;
+    }
+    // Returns the value as the client sees it.
+    std::string _read_value(const ValueEntry& entry, std::string* spilled_bytes = nullptr) const {
+        if (entry.data_stale) return entry.doc->dump();
+        if (entry.nkb) return nkb::decode(_read_payload(entry, spilled_bytes)).dump();
+        return _read_payload(entry, spilled_bytes);
+    }
+    json _parse_value(const ValueEntry& entry, std::string* spilled_bytes = nullptr) const {
+        if (entry.nkb) return nkb::decode(_read_payload(entry, spilled_bytes));
+        return json::parse(_read_payload(entry, spilled_bytes));
+    }
+    // Compresses a value when it is large enough and actually shrinks. Needs no lock.
+    ValueEntry _encode_value(std::string value) const {
+        ValueEntry entry;
+        entry.raw_size = value.size();
+        if (COMPRESSION_ENABLED.load(std::memory_order_relaxed) && value.size() >= COMPRESSION_THRESHOLD_BYTES) {
+            std::shared_ptr<const std::string> dict;
+            uint16_t dict_id = 0;
+            { std::shared_lock<std::shared_mutex> lock(dict_mutex_); if (!compression_dicts_.empty()) { dict = compression_dicts_.back(); dict_id = static_cast<uint16_t>(compression_dicts_.size()); } }
+            std::string packed = nukelz::compress(value, dict ? *dict : std::string());
+            if (packed.size() <= value.size() - value.size() / 8) {
+                entry.data = std::move(packed);
+                entry.encoding = ValueEncoding::Compressed;
+                entry.dict_id = dict_id;
+                return entry;
+            }
+        }
+        entry.data = std::move(value);
+        return entry;
+    }
+    // Binary JSON is kept uncompressed so readers can navigate it in place.
+    static ValueEntry _encode_binary_json(const json& j) { ValueEntry entry; entry.data = nkb::encode(j); entry.raw_size = entry.data.size(); entry.nkb = true; return entry; }
+    void _account_compression(const ValueEntry& entry, bool adding) {
+        if (entry.encoding != ValueEncoding::Compressed) return;
+        if (adding) { compressed_values_++; compressed_raw_bytes_ += entry.raw_size; compressed_stored_bytes_ += _stored_length(entry); }
+        else { compressed_values_--; compressed_raw_bytes_ -= entry.raw_size; compressed_stored_bytes_ -= _stored_length(entry); }
+    }
+    // Replaces (or creates) a key's value and keeps the memory estimate and LRU position in step. Caller holds the exclusive lock.
+    void _put_entry_unlocked(const std::string& key, ValueEntry new_entry) {
+        auto it = kv_store_.find(key);
+        if (it == kv_store_.end()) { it = kv_store_.emplace(key, ValueEntry{}).first; if (key_trigrams_) _update_key_trigrams_unlocked([&](KeyTrigramIndex& index) { index.add(key); }); }
+        else {
+            estimated_memory_usage_ -= _entry_footprint(it->first, it->second);
+            _account_compression(it->second, false);
+            if (it->second.on_disk) { value_file_dead_bytes_ += it->second.disk_length; spilled_keys_--; }
+            _release_value_unlocked(it->second.data, LAZY_FREE_ENABLED);
+            _release_doc_unlocked(it->second, LAZY_FREE_ENABLED);
+        }
+        it->second = std::move(new_entry);
+        it->second.revision = ++revision_counter_;
+        _account_compression(it->second, true);
+        estimated_memory_usage_ += _entry_footprint(it->first, it->second);
+        if (it->second.doc) { doc_lru_.push_front(it->first); it->second.doc_lru_it = doc_lru_.begin(); doc_cache_bytes_ += it->second.doc_bytes; _trim_doc_cache_unlocked(); }
+        if (_has_indexes(key)) _rebuild_indexes_unlocked(it);
+        _reindex_collections_unlocked(it);
+        _update_lru(key);
+    }
+    void _put_value_unlocked(const std::string& key, std::string value) { _put_entry_unlocked(key, _encode_value(std::move(value))); }
+    bool _open_value_file() {
+        std::lock_guard<std::mutex> lock(value_file_mutex_);
+        value_file_.close();
+        value_file_.open(VALUE_FILENAME, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        value_file_size_ = 0;
+        value_file_dead_bytes_ = 0;
+        return value_file_.is_open();
+    }
+    // Moves a resident value out to the value file. Caller holds the exclusive lock.
+    bool _spill_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it) {
+        ValueEntry& entry = it->second;
+        if (entry.on_disk) return true;
+        if (entry.doc) _drop_doc_unlocked(it);
+        {
+            std::lock_guard<std::mutex> lock(value_file_mutex_);
+            if (!value_file_.is_open()) return false;
+            value_file_.clear();
+            value_file_.seekp(static_cast<std::streamoff>(value_file_size_));
+            if (!value_file_.write(entry.data.data(), static_cast<std::streamsize>(entry.data.size()))) return false;
+            entry.disk_offset = value_file_size_;
+            entry.disk_length = entry.data.size();
+            value_file_size_ += entry.data.size();
+        }
+        estimated_memory_usage_ -= _entry_footprint(it->first, entry);
+        _release_value_unlocked(entry.data, LAZY_FREE_ENABLED);
+        entry.on_disk = true;
+        estimated_memory_usage_ += _entry_footprint(it->first, entry);
+        spilled_keys_++;
+        return true;
+    }
+    // Brings a spilled value back into memory after a read, provided nobody rewrote the key in between.
+    void _promote_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, uint64_t read_offset, std::string stored_bytes) {
+        ValueEntry& entry = it->second;
+        if (!entry.on_disk || entry.disk_offset != read_offset) return;
+        estimated_memory_usage_ -= _entry_footprint(it->first, entry);
+        value_file_dead_bytes_ += entry.disk_length;
+        entry.data = std::move(stored_bytes);
+        entry.on_disk = false;
+        estimated_memory_usage_ += _entry_footprint(it->first, entry);
+        spilled_keys_--;
+        promoted_keys_++;
+        _enforce_memory_limit();
+    }
+    static ReadTicket _ticket_for(const ValueEntry& entry) { ReadTicket ticket; ticket.revision = entry.revision; ticket.was_on_disk = entry.on_disk; ticket.disk_offset = entry.disk_offset; return ticket; }
+    // Second half of every read: refreshes the key's LRU position, promotes it if it was served from disk and
+    // keeps the document a JSON read had to parse, provided nobody rewrote the key in between.
+    bool _touch_after_read(const std::string& key, ReadTicket ticket) {
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        auto it = kv_store_.find(key);
+        if (it == kv_store_.end()) return false;
+        if (it->second.revision == ticket.revision) {
+            if (ticket.was_on_disk) _promote_unlocked(it, ticket.disk_offset, std::move(ticket.spilled_bytes));
+            if (ticket.parsed_doc && !it->second.doc) _install_doc_unlocked(it, std::move(ticket.parsed_doc));
+            else if (it->second.doc) doc_lru_.splice(doc_lru_.begin(), doc_lru_, it->second.doc_lru_it);
+        }
+        _update_lru(key);
+        return true;
+    }
+    // --- JSON document cache ---
+    // Returns the parsed document for a read under the shared lock. On a miss the document is parsed into
+    // `ticket` and only installed later by `_touch_after_read`. Throws json::parse_error for non-JSON values.
+    const json& _doc_for_read(const ValueEntry& entry, ReadTicket& ticket) const {
+        if (entry.doc) { doc_cache_hits_++; return *entry.doc; }
+        doc_cache_misses_++;
+        ticket.parsed_doc = std::make_shared<json>(_parse_value(entry, &ticket.spilled_bytes));
+        return *ticket.parsed_doc;
+    }
+    // Returns the key's document for modification, parsing and caching it first if needed. Caller holds the exclusive lock.
+    json& _doc_for_write_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it) {
+        if (it->second.doc) { doc_cache_hits_++; doc_lru_.splice(doc_lru_.begin(), doc_lru_, it->second.doc_lru_it); return *it->second.doc; }
+        doc_cache_misses_++;
+        _install_doc_unlocked(it, std::make_shared<json>(_parse_value(it->second)));
+        return *it->second.doc;
+    }
+    void _install_doc_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, std::shared_ptr<json> doc) {
+        ValueEntry& entry = it->second;
+        estimated_memory_usage_ -= _entry_footprint(it->first, entry);
+        entry.doc_bytes = estimate_json_bytes(*doc);
+        entry.doc = std::move(doc);
+        doc_lru_.push_front(it->first);
+        entry.doc_lru_it = doc_lru_.begin();
+        doc_cache_bytes_ += entry.doc_bytes;
+        estimated_memory_usage_ += _entry_footprint(it->first, entry);
+        _trim_doc_cache_unlocked();
+    }
+    // Called after a JSON.* write changed the cached document in place. The text copy is now outdated, so it is
+    // released rather than re-serialized; `delta_bytes` is the change in the document's estimated size.
+    void _doc_modified_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, long long delta_bytes) {
+        ValueEntry& entry = it->second;
+        estimated_memory_usage_ -= _entry_footprint(it->first, entry);
+        _account_compression(entry, false);
+        if (entry.on_disk) { value_file_dead_bytes_ += entry.disk_length; spilled_keys_--; entry.on_disk = false; }
+        _release_value_unlocked(entry.data, LAZY_FREE_ENABLED);
+        entry.encoding = ValueEncoding::Raw; entry.raw_size = 0; entry.dict_id = 0;
+        entry.data_stale = true;
+        doc_cache_bytes_ -= entry.doc_bytes;
+        entry.doc_bytes = static_cast<uint64_t>(std::max<long long>(sizeof(json), static_cast<long long>(entry.doc_bytes) + delta_bytes));
+        doc_cache_bytes_ += entry.doc_bytes;
+        entry.revision = ++revision_counter_;
+        estimated_memory_usage_ += _entry_footprint(it->first, entry);
+        _reindex_collections_unlocked(it);
+        _update_lru(it->first);
+        // Binary JSON stays authoritative: write the change straight back rather than keep the tree around.
+        if (entry.nkb) _drop_doc_unlocked(it);
+        else _trim_doc_cache_unlocked();
+    }
+    // Forgets a cached document without looking at it. Only for entries that are being overwritten or removed.
+    void _release_doc_unlocked(ValueEntry& entry, bool lazy) {
+        if (!entry.doc) return;
+        doc_lru_.erase(entry.doc_lru_it);
+        doc_cache_bytes_ -= entry.doc_bytes;
+        if (lazy && entry.doc_bytes >= LAZY_FREE_THRESHOLD_BYTES) _free_lazily(std::move(entry.doc), entry.doc_bytes);
+        entry.doc.reset();
+        entry.doc_bytes = 0;
+    }
+    // Takes the document out of the cache, serializing it back into `data` first if it is the only copy.
+    void _drop_doc_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it) {
+        ValueEntry& entry = it->second;
+        estimated_memory_usage_ -= _entry_footprint(it->first, entry);
+        if (entry.data_stale) {
+            ValueEntry encoded = entry.nkb ? _encode_binary_json(*entry.doc) : _encode_value(entry.doc->dump());
+            entry.data = std::move(encoded.data); entry.encoding = encoded.encoding; entry.raw_size = encoded.raw_size; entry.dict_id = encoded.dict_id;
+            entry.data_stale = false;
+            _account_compression(entry, true);
+        }
+        entry.array_length = entry.doc->is_array() ? static_cast<int64_t>(entry.doc->size()) : -1;
+        _release_doc_unlocked(entry, LAZY_FREE_ENABLED);
+        estimated_memory_usage_ += _entry_footprint(it->first, entry);
+    }
+    // Keeps the parsed documents within JSON_DOC_CACHE_BYTES. The most recently used one always stays.
+    void _trim_doc_cache_unlocked() {
+        while (doc_cache_bytes_ > JSON_DOC_CACHE_BYTES && doc_lru_.size() > 1) {
+            auto it = kv_store_.find(doc_lru_.back());
+            if (it == kv_store_.end()) { doc_lru_.pop_back(); continue; }
+            _drop_doc_unlocked(it);
+        }
+    }
+    // Makes a value's bytes resident and uncompressed so they can be edited in place. Caller holds the exclusive lock.
+    void _unpack_payload_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it) {
+        ValueEntry& entry = it->second;
+        if (!entry.on_disk && entry.encoding == ValueEncoding::Raw) return;
+        std::string payload = _read_payload(entry);
+        estimated_memory_usage_ -= _entry_footprint(it->first, entry);
+        _account_compression(entry, false);
+        if (entry.on_disk) { value_file_dead_bytes_ += entry.disk_length; spilled_keys_--; entry.on_disk = false; }
+        _release_value_unlocked(entry.data, LAZY_FREE_ENABLED);
+        entry.data = std::move(payload);
+        entry.encoding = ValueEncoding::Raw; entry.raw_size = entry.data.size(); entry.dict_id = 0;
+        estimated_memory_usage_ += _entry_footprint(it->first, entry);
+    }
+    // Appends to a JSON array without building its tree: binary JSON gets its array header rebuilt around the
+    // existing elements, and text known to be an array has the new elements spliced in before the closing bracket
+    // (amortized O(1), as the string grows geometrically). Returns the array's previous length, or -1 if the value
+    // has to go through the parsed document instead. Caller holds the exclusive lock.
+    long long _append_in_place_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, const std::vector<json>& items) {
+        ValueEntry& entry = it->second;
+        if (!entry.nkb) {
+            std::string text;
+            for (const auto& item : items) { if (!text.empty()) text.push_back(','); text += item.dump(); }
+            return _append_text_unlocked(it, text, items.size());
+        }
+        // A cached tree of binary JSON is only a read copy; appending to the encoding beats re-encoding the tree.
+        if (entry.doc && !entry.data_stale) _drop_doc_unlocked(it);
+        if (entry.doc || entry.data_stale) return -1;
+        _unpack_payload_unlocked(it);
+        long long old_length;
+        unsigned long long old_footprint = _entry_footprint(it->first, entry);
+        std::string appended;
+        try { old_length = static_cast<long long>(nkb::Document(entry.data).root().size()); appended = nkb::append_to_array(entry.data, items); } catch (...) { return -1; }
+        _release_value_unlocked(entry.data, LAZY_FREE_ENABLED);
+        entry.data = std::move(appended);
+        _finish_append_unlocked(it, old_footprint);
+        return old_length;
+    }
+    // The text half of _append_in_place_unlocked: splices `count` already serialized, comma-separated elements in
+    // before the closing bracket of a text array whose length is known.
+    long long _append_text_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, std::string_view elements, size_t count) {
+        ValueEntry& entry = it->second;
+        if (entry.nkb || entry.doc || entry.data_stale || entry.array_length < 0) return -1;
+        _unpack_payload_unlocked(it);
+        unsigned long long old_footprint = _entry_footprint(it->first, entry);
+        size_t close = entry.data.find_last_not_of(" \t\r\n");
+        if (close == std::string::npos || entry.data[close] != ']') { entry.array_length = -1; return -1; }
+        long long old_length = entry.array_length;
+        if (count > 0) {
+            entry.data.insert(close, elements.data(), elements.size());
+            if (old_length > 0) entry.data.insert(close, 1, ',');
+            entry.array_length += static_cast<int64_t>(count);
+        }
+        _finish_append_unlocked(it, old_footprint);
+        return old_length;
+    }
+    void _finish_append_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, unsigned long long old_footprint) {
+        ValueEntry& entry = it->second;
+        entry.raw_size = entry.data.size();
+        entry.revision = ++revision_counter_;
+        estimated_memory_usage_ -= old_footprint;
+        estimated_memory_usage_ += _entry_footprint(it->first, entry);
+        _reindex_collections_unlocked(it);
+        _update_lru(it->first);
+    }
+    // --- JSON field indexes ---
+    const JsonFieldIndex* _find_index(const std::string& key, const std::string& field) const {
+        auto it = json_indexes_.find(key);
+        if (it == json_indexes_.end()) return nullptr;
+        auto f = it->second.find(field);
+        return f == it->second.end() ? nullptr : &f->second;
+    }
+    static unsigned long long _index_bytes(const std::map<std::string, JsonFieldIndex>& indexes) { unsigned long long bytes = 0; for (const auto& pair : indexes) bytes += sizeof(JsonFieldIndex) + pair.first.size() + pair.second.bytes; return bytes; }
+    // Runs `fn` on the key's indexes (if it has any) and keeps the memory estimate in step with them. Caller holds the exclusive lock.
+    template <typename Fn> void _update_indexes_unlocked(const std::string& key, Fn fn) {
+        auto it = json_indexes_.find(key);
+        if (it == json_indexes_.end()) return;
+        unsigned long long before = _index_bytes(it->second);
+        fn(it->second);
+        unsigned long long after = _index_bytes(it->second);
+        estimated_memory_usage_ += after; estimated_memory_usage_ -= before;
+        json_index_bytes_ += after; json_index_bytes_ -= before;
+    }
+    static unsigned long long _trigram_bytes(const std::map<std::string, JsonTrigramIndex>& indexes) { unsigned long long bytes = 0; for (const auto& pair : indexes) bytes += sizeof(JsonTrigramIndex) + 2 * pair.first.size() + pair.second.bytes; return bytes; }
+    template <typename Fn> void _update_trigram_indexes_unlocked(const std::string& key, Fn fn) {
+        auto it = trigram_indexes_.find(key);
+        if (it == trigram_indexes_.end()) return;
+        unsigned long long before = _trigram_bytes(it->second);
+        fn(it->second);
+        unsigned long long after = _trigram_bytes(it->second);
+        estimated_memory_usage_ += after; estimated_memory_usage_ -= before;
+        json_index_bytes_ += after; json_index_bytes_ -= before;
+    }
+    static unsigned long long _vector_bytes(const std::map<std::string, JsonVectorIndex>& indexes) { unsigned long long bytes = 0; for (const auto& pair : indexes) bytes += sizeof(JsonVectorIndex) + 2 * pair.first.size() + pair.second.bytes; return bytes; }
+    template <typename Fn> void _update_vector_indexes_unlocked(const std::string& key, Fn fn) {
+        auto it = vector_indexes_.find(key);
+        if (it == vector_indexes_.end()) return;
+        unsigned long long before = _vector_bytes(it->second);
+        fn(it->second);
+        unsigned long long after = _vector_bytes(it->second);
+        estimated_memory_usage_ += after; estimated_memory_usage_ -= before;
+        json_index_bytes_ += after; json_index_bytes_ -= before;
+    }
+    static unsigned long long _geo_bytes(const std::map<std::string, JsonGeoIndex>& indexes) { unsigned long long bytes = 0; for (const auto& pair : indexes) bytes += sizeof(JsonGeoIndex) + 2 * pair.first.size() + pair.second.bytes; return bytes; }
+    template <typename Fn> void _update_geo_indexes_unlocked(const std::string& key, Fn fn) {
+        auto it = geo_indexes_.find(key);
+        if (it == geo_indexes_.end()) return;
+        unsigned long long before = _geo_bytes(it->second);
+        fn(it->second);
+        unsigned long long after = _geo_bytes(it->second);
+        estimated_memory_usage_ += after; estimated_memory_usage_ -= before;
+        json_index_bytes_ += after; json_index_bytes_ -= before;
+    }
+    bool _has_indexes(const std::string& key) const { return json_indexes_.count(key) || text_indexes_.count(key) || trigram_indexes_.count(key) || vector_indexes_.count(key) || geo_indexes_.count(key); }
+    // Keeps one element's trigram, vector and geo indexes in step with a write that turned `old_item` into `new_item`.
+    void _reindex_item_unlocked(const std::string& key, const json& old_item, const json& new_item, uint32_t pos) {
+        _update_trigram_indexes_unlocked(key, [&](std::map<std::string, JsonTrigramIndex>& indexes) { for (auto& pair : indexes) { pair.second.remove_item(old_item, pos); pair.second.add_item(new_item, pos); } });
+        _update_vector_indexes_unlocked(key, [&](std::map<std::string, JsonVectorIndex>& indexes) { for (auto& pair : indexes) { pair.second.remove(pos); pair.second.add_item(new_item, pos); } });
+        _update_geo_indexes_unlocked(key, [&](std::map<std::string, JsonGeoIndex>& indexes) { for (auto& pair : indexes) { pair.second.remove(pos); pair.second.add_item(new_item, pos); } });
+    }
+    template <typename Fn> void _update_text_index_unlocked(const std::string& key, Fn fn) {
+        auto it = text_indexes_.find(key);
+        if (it == text_indexes_.end()) return;
+        unsigned long long before = it->second.bytes;
+        fn(it->second);
+        estimated_memory_usage_ += it->second.bytes; estimated_memory_usage_ -= before;
+        json_index_bytes_ += it->second.bytes; json_index_bytes_ -= before;
+    }
+    // Rebuilds every index on a key from its current value; a value that is not a JSON array leaves them empty.
+    void _rebuild_indexes_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it) {
+        auto rebuild_from = [&](const auto& doc) {
+            _update_indexes_unlocked(it->first, [&](std::map<std::string, JsonFieldIndex>& indexes) { for (auto& pair : indexes) pair.second.rebuild(pair.first, doc); });
+            _update_text_index_unlocked(it->first, [&](JsonTextIndex& index) { index.rebuild(doc); });
+            _update_trigram_indexes_unlocked(it->first, [&](std::map<std::string, JsonTrigramIndex>& indexes) { for (auto& pair : indexes) pair.second.rebuild(doc); });
+            _update_vector_indexes_unlocked(it->first, [&](std::map<std::string, JsonVectorIndex>& indexes) { for (auto& pair : indexes) pair.second.rebuild(doc); });
+            _update_geo_indexes_unlocked(it->first, [&](std::map<std::string, JsonGeoIndex>& indexes) { for (auto& pair : indexes) pair.second.rebuild(doc); });
+        };
+        const ValueEntry& entry = it->second;
+        try {
+            if (entry.doc) rebuild_from(*entry.doc);
+            else if (entry.nkb) { std::string scratch; nkb::Document doc(_payload_view(entry, scratch)); rebuild_from(doc); }
+            else { json doc = json::parse(_read_payload(entry)); rebuild_from(doc); }
+        } catch (...) {
+            _update_indexes_unlocked(it->first, [](std::map<std::string, JsonFieldIndex>& indexes) { for (auto& pair : indexes) pair.second.clear(); });
+            _update_text_index_unlocked(it->first, [](JsonTextIndex& index) { index.clear(); });
+            _update_trigram_indexes_unlocked(it->first, [](std::map<std::string, JsonTrigramIndex>& indexes) { for (auto& pair : indexes) pair.second.clear(); });
+            _update_vector_indexes_unlocked(it->first, [](std::map<std::string, JsonVectorIndex>& indexes) { for (auto& pair : indexes) pair.second.clear(); });
+            _update_geo_indexes_unlocked(it->first, [](std::map<std::string, JsonGeoIndex>& indexes) { for (auto& pair : indexes) pair.second.clear(); });
+        }
+    }
+    void _create_index_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, const std::string& field) {
+        auto& indexes = json_indexes_[it->first];
+        unsigned long long before = _index_bytes(indexes);
+        indexes[field];
+        unsigned long long added = _index_bytes(indexes) - before;
+        estimated_memory_usage_ += added;
+        json_index_bytes_ += added;
+        _rebuild_indexes_unlocked(it);
+    }
+    void _drop_indexes_unlocked(const std::string& key) {
+        unsigned long long bytes = 0;
+        auto it = json_indexes_.find(key);
+        if (it != json_indexes_.end()) { bytes += _index_bytes(it->second); json_indexes_.erase(it); }
+        auto text = text_indexes_.find(key);
+        if (text != text_indexes_.end()) { bytes += sizeof(JsonTextIndex) + text->second.bytes; text_indexes_.erase(text); }
+        auto trigrams = trigram_indexes_.find(key);
+        if (trigrams != trigram_indexes_.end()) { bytes += _trigram_bytes(trigrams->second); trigram_indexes_.erase(trigrams); }
+        auto vector_fields = vector_indexes_.find(key);
+        if (vector_fields != vector_indexes_.end()) { bytes += _vector_bytes(vector_fields->second); vector_indexes_.erase(vector_fields); }
+        auto geo_fields = geo_indexes_.find(key);
+        if (geo_fields != geo_indexes_.end()) { bytes += _geo_bytes(geo_fields->second); geo_indexes_.erase(geo_fields); }
+        estimated_memory_usage_ -= bytes;
+        json_index_bytes_ -= bytes;
+    }
+    // --- Trigram indexes ---
+    void _create_trigram_index_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, const std::string& field) {
+        auto& indexes = trigram_indexes_[it->first];
+        unsigned long long before = _trigram_bytes(indexes);
+        indexes[field].field = JsonFieldPath::parse(field);
+        unsigned long long added = _trigram_bytes(indexes) - before;
+        estimated_memory_usage_ += added;
+        json_index_bytes_ += added;
+        _rebuild_indexes_unlocked(it);
+    }
+    template <typename Fn> void _update_key_trigrams_unlocked(Fn fn) {
+        unsigned long long before = key_trigrams_->bytes;
+        fn(*key_trigrams_);
+        estimated_memory_usage_ += key_trigrams_->bytes; estimated_memory_usage_ -= before;
+        json_index_bytes_ += key_trigrams_->bytes; json_index_bytes_ -= before;
+    }
+    // Starts the key index over from the live keys, dropping the ids of removed ones.
+    void _fill_key_trigrams_unlocked(KeyTrigramIndex& index) { index.clear(); for (const auto& pair : kv_store_) index.add(pair.first); }
+    // --- Vector indexes ---
+    void _create_vector_index_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, const std::string& field, vectors::Metric metric) {
+        auto& indexes = vector_indexes_[it->first];
+        unsigned long long before = _vector_bytes(indexes);
+        JsonVectorIndex& index = indexes[field];
+        index.field = JsonFieldPath::parse(field);
+        index.metric = metric;
+        unsigned long long added = _vector_bytes(indexes) - before;
+        estimated_memory_usage_ += added;
+        json_index_bytes_ += added;
+        _rebuild_indexes_unlocked(it);
+    }
+    // --- Geo indexes ---
+    static std::string _geo_name(const std::string& lat_field, const std::string& lon_field) { return lat_field + "," + lon_field; }
+    void _create_geo_index_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, const std::string& lat_field, const std::string& lon_field) {
+        auto& indexes = geo_indexes_[it->first];
+        unsigned long long before = _geo_bytes(indexes);
+        JsonGeoIndex& index = indexes[_geo_name(lat_field, lon_field)];
+        index.lat_field = JsonFieldPath::parse(lat_field);
+        index.lon_field = JsonFieldPath::parse(lon_field);
+        unsigned long long added = _geo_bytes(indexes) - before;
+        estimated_memory_usage_ += added;
+        json_index_bytes_ += added;
+        _rebuild_indexes_unlocked(it);
+    }
+    // --- JSON collection indexes ---
+    static unsigned long long _collection_index_bytes(const JsonCollectionIndex& index) { return sizeof(JsonCollectionIndex) + index.prefix.size() + index.field.text.size() + index.bytes; }
+    // Runs `fn` on the collection indexes whose prefix covers `key` (only on `only`, if given) and keeps the memory
+    // estimate in step with them. Caller holds the exclusive lock.
+    template <typename Fn> void _update_collections_unlocked(const std::string& key, JsonCollectionIndex* only, Fn fn) {
+        for (auto& index : collection_indexes_) {
+            if ((only && &index != only) || !index.covers(key)) continue;
+            unsigned long long before = index.bytes;
+            fn(index);
+            estimated_memory_usage_ += index.bytes; estimated_memory_usage_ -= before;
+            json_index_bytes_ += index.bytes; json_index_bytes_ -= before;
+        }
+    }
+    // Files a key under the current value of each covering index's field. A value that is not JSON, or a document
+    // without the field, is left out of the index.
+    void _reindex_collections_unlocked(std::unordered_map<std::string, ValueEntry>::iterator it, JsonCollectionIndex* only = nullptr) {
+        if (std::none_of(collection_indexes_.begin(), collection_indexes_.end(), [&](const JsonCollectionIndex& index) { return (!only || &index == only) && index.covers(it->first); })) return;
+        const ValueEntry& entry = it->second;
+        std::string scratch;
+        std::unique_ptr<nkb::Document> binary;
+        json parsed;
+        const json* doc = nullptr;
+        try {
+            if (entry.doc) doc = entry.doc.get();
+            else if (entry.nkb) binary = std::make_unique<nkb::Document>(_payload_view(entry, scratch));
+            else { parsed = _parse_value(entry); doc = &parsed; }
+        } catch (...) {}
+        _update_collections_unlocked(it->first, only, [&](JsonCollectionIndex& index) {
+            index.remove(it->first);
+            if (doc) { if (const json* v = index.field.resolve(*doc)) index.add(it->first, JsonFieldIndex::key_for(*v)); }
+            else if (binary) {
+                std::vector<long long> ids;
+                for (const auto& token : index.field.tokens) ids.push_back(binary->key_id(token));
+                if (nkb::Value v = index.field.resolve(binary->root(), ids)) index.add(it->first, JsonFieldIndex::key_for(v.to_json()));
+            }
+        });
+    }
+    // Adds a collection index and files every key already under its prefix. Caller holds the exclusive lock.
+    JsonCollectionIndex& _create_collection_index_unlocked(const std::string& prefix, JsonFieldPath field) {
+        collection_indexes_.emplace_back();
+        JsonCollectionIndex& index = collection_indexes_.back();
+        index.prefix = prefix;
+        index.field = std::move(field);
+        unsigned long long fixed = _collection_index_bytes(index);
+        estimated_memory_usage_ += fixed; json_index_bytes_ += fixed;
+        for (auto it = kv_store_.begin(); it != kv_store_.end(); ++it) if (index.covers(it->first)) _reindex_collections_unlocked(it, &index);
+        return index;
+    }
+    // Rewrites the value file with only the live spilled values once dead space dominates it. Caller holds the exclusive lock.
+    void _compact_value_file_unlocked() {
+        unsigned long long dead = value_file_dead_bytes_.load();
+        if (dead < VALUE_FILE_COMPACT_MIN_BYTES || dead * 2 < value_file_size_) return;
+        std::string tmp_name = VALUE_FILENAME + ".compact";
+        std::ofstream out(tmp_name, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return;
+        std::vector<std::pair<ValueEntry*, uint64_t>> moved;
+        uint64_t new_size = 0;
+        for (auto& pair : kv_store_) {
+            if (!pair.second.on_disk) continue;
+            std::string bytes = _read_stored_bytes(pair.second);
+            out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+            moved.emplace_back(&pair.second, new_size);
+            new_size += bytes.size();
+        }
+        out.close();
+        if (!out) { std::remove(tmp_name.c_str()); return; }
+        std::lock_guard<std::mutex> lock(value_file_mutex_);
+        value_file_.close();
+        std::remove(VALUE_FILENAME.c_str());
+        bool renamed = std::rename(tmp_name.c_str(), VALUE_FILENAME.c_str()) == 0;
+        if (!renamed) std::cerr << "[ERROR] Could not replace " << VALUE_FILENAME << " after compaction, continuing on " << tmp_name << "." << std::endl;
+        value_file_.open(renamed ? VALUE_FILENAME : tmp_name, std::ios::in | std::ios::out | std::ios::binary);
+        for (auto& m : moved) m.first->disk_offset = m.second;
+        value_file_size_ = new_size;
+        value_file_dead_bytes_ = 0;
+        if (DEBUG_MODE.load()) std::cout << "\n[TIER] Compacted value file, reclaimed " << format_memory_size(dead) << "." << std::endl;
+    }
+    // Removes a key with all of its bookkeeping. Returns false if the key did not exist. Caller holds the exclusive lock.
+    bool _remove_key_unlocked(const std::string& key, bool lazy) {
+        auto it = kv_store_.find(key);
+        if (it == kv_store_.end()) return false;
+        estimated_memory_usage_ -= _entry_footprint(it->first, it->second);
+        _account_compression(it->second, false);
+        if (it->second.on_disk) { value_file_dead_bytes_ += it->second.disk_length; spilled_keys_--; }
+        _release_value_unlocked(it->second.data, lazy);
+        _release_doc_unlocked(it->second, lazy);
+        _drop_indexes_unlocked(key);
+        _update_collections_unlocked(key, nullptr, [&](JsonCollectionIndex& index) { index.remove(key); });
+        if (key_trigrams_) _update_key_trigrams_unlocked([&](KeyTrigramIndex& index) { index.remove(key); });
+        if (cached_keys_.erase(key)) { cached_key_count_ = cached_keys_.size(); result_cache_.drop(key); }
+        ttl_map_.erase(key);
+        if (CACHING_ENABLED) { auto lru_it = lru_map_.find(key); if (lru_it != lru_map_.end()) { lru_list_.erase(lru_it->second); lru_map_.erase(lru_it); } }
+        kv_store_.erase(it);
+        if (key_trigrams_ && key_trigrams_->wants_rebuild()) _update_key_trigrams_unlocked([&](KeyTrigramIndex& index) { _fill_key_trigrams_unlocked(index); });
+        return true;
+    }
+    // Evicts least-recently-used keys until usage drops to `target_bytes` or `max_keys` have gone. Caller holds the exclusive lock.
+    size_t _evict_lru_unlocked(size_t max_keys, unsigned long long target_bytes) {
+        size_t evicted = 0;
+        while (evicted < max_keys && estimated_memory_usage_ > target_bytes && !lru_list_.empty()) {
+            std::string key_to_evict = lru_list_.back();
+            auto it = kv_store_.find(key_to_evict);
+            if (TIERED_STORAGE_ENABLED && it != kv_store_.end() && _spill_unlocked(it)) {
+                // Spilled keys leave the LRU: they no longer hold memory worth reclaiming.
+                lru_list_.pop_back(); lru_map_.erase(key_to_evict);
+                if (DEBUG_MODE.load()) { std::cout << "\n[TIER] Spilled key '" << key_to_evict << "' to " << VALUE_FILENAME << "." << std::endl; }
+                evicted++;
+                continue;
+            }
+            // Only deletions count as evicted keys; spills are counted by _spill_unlocked.
+            if (_remove_key_unlocked(key_to_evict, LAZY_FREE_ENABLED)) evicted_keys_++;
+            else { lru_list_.pop_back(); lru_map_.erase(key_to_evict); }
+            evicted++;
+            if (DEBUG_MODE.load()) { std::cout << "\n[CACHE] Evicted key '" << key_to_evict << "' to stay within memory limits." << std::endl; }
+        }
+        return evicted;
+    }
+    // Called at the end of every write. Eviction proper is the background evictor's job; a writer only
+    // wakes it up, and does a small bounded amount of work itself if the hard limit has already been crossed.
+    void _enforce_memory_limit() {
+        if (!CACHING_ENABLED || max_memory_bytes_ == 0) return;
+        unsigned long long usage = estimated_memory_usage_.load();
+        if (usage > high_watermark_bytes_) eviction_cv_.notify_one();
+        if (usage > max_memory_bytes_) _evict_lru_unlocked(static_cast<size_t>(std::max(0, EVICTION_INLINE_BUDGET)), max_memory_bytes_);
+    }
+    void _eviction_loop() {
+        while (!stop_all_) {
+            {
+                std::unique_lock<std::mutex> lock(eviction_mutex_);
+                eviction_cv_.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            if (estimated_memory_usage_ <= high_watermark_bytes_) continue;
+            // Free memory in small batches so writers can interleave between lock acquisitions.
+            while (!stop_all_ && estimated_memory_usage_ > low_watermark_bytes_) {
+                size_t evicted;
+                {
+                    std::unique_lock<std::shared_mutex> lock(data_mutex_);
+                    evicted = _evict_lru_unlocked(static_cast<size_t>(std::max(1, EVICTION_BATCH_SIZE)), low_watermark_bytes_);
+                }
+                eviction_progress_cv_.notify_all();
+                if (evicted == 0) break;
+                std::this_thread::yield();
+            }
+            eviction_progress_cv_.notify_all();
+        }
+    }
+    // Writes arriving while usage is above the hard limit wait (briefly) for the evictor to catch up.
+    void _throttle_writes() {
+        if (!CACHING_ENABLED || max_memory_bytes_ == 0 || estimated_memory_usage_ <= max_memory_bytes_) return;
+        eviction_cv_.notify_one();
+        std::unique_lock<std::mutex> lock(eviction_mutex_);
+        eviction_progress_cv_.wait_for(lock, std::chrono::milliseconds(std::max(0, EVICTION_THROTTLE_MAX_MS)), [this] { return stop_all_ || estimated_memory_usage_ <= max_memory_bytes_; });
+    }
+    void _save_to_file_unlocked(const std::string& filename) { if (!PERSISTENCE_ENABLED) return; json db_json; json& store = db_json["store"] = json::object(); json binary_keys = json::array(); for (const auto& pair : kv_store_) { store[pair.first] = _read_value(pair.second); if (pair.second.nkb) binary_keys.push_back(pair.first); } db_json["ttl"] = ttl_map_; if (!binary_keys.empty()) db_json["binary_json"] = std::move(binary_keys); if (!json_indexes_.empty()) { json& indexes = db_json["json_indexes"] = json::object(); for (const auto& pair : json_indexes_) for (const auto& field : pair.second) indexes[pair.first].push_back(field.first); } if (!text_indexes_.empty()) { json& text = db_json["text_indexes"] = json::array(); for (const auto& pair : text_indexes_) text.push_back(pair.first); } if (!collection_indexes_.empty()) { json& collections = db_json["collection_indexes"] = json::array(); for (const auto& index : collection_indexes_) collections.push_back({{"prefix", index.prefix}, {"field", index.field.text}}); } if (!trigram_indexes_.empty()) { json& trigrams = db_json["trigram_indexes"] = json::object(); for (const auto& pair : trigram_indexes_) for (const auto& field : pair.second) trigrams[pair.first].push_back(field.first); } if (key_trigrams_) db_json["key_trigrams"] = true; if (!vector_indexes_.empty()) { json& vector_list = db_json["vector_indexes"] = json::object(); for (const auto& pair : vector_indexes_) for (const auto& field : pair.second) vector_list[pair.first].push_back({{"field", field.first}, {"metric", vectors::metric_name(field.second.metric)}}); } if (!geo_indexes_.empty()) { json& geo_list = db_json["geo_indexes"] = json::object(); for (const auto& pair : geo_indexes_) for (const auto& index : pair.second) geo_list[pair.first].push_back({{"lat", index.second.lat_field.text}, {"lon", index.second.lon_field.text}}); } if (!cached_keys_.empty()) db_json["cached_keys"] = cached_keys_; db_json["journal_seq"] = journal_seq_; std::ofstream db_file(filename); if (db_file.is_open()) db_file << db_json.dump(4); if (filename == DATABASE_FILENAME) { dirty_operations_ = 0; if (db_file) _reset_journal_unlocked(); } }
+    // --- Journal ---
+    // The snapshot now covers every journaled write, so the journal starts over.
+    void _reset_journal_unlocked() { journal_.close(); journal_.clear(); journal_.open(JOURNAL_FILENAME, std::ios::out | std::ios::trunc); journal_bytes_ = 0; }
+    // Path writes only touch a small part of a document, so while the snapshot is otherwise up to date they are
+    // appended to the journal instead of rewriting the database file. Anything else counts as a dirty operation.
+    void _persist_patch_unlocked(json record) {
+        if (PERSISTENCE_ENABLED && dirty_operations_ == 0 && journal_.is_open()) {
+            record["seq"] = ++journal_seq_;
+            std::string line = record.dump();
+            line.push_back('\n');
+            journal_.write(line.data(), static_cast<std::streamsize>(line.size()));
+            journal_.flush();
+            journal_bytes_ += line.size();
+            if (journal_ && journal_bytes_ < JOURNAL_COMPACT_BYTES) return;
+        }
+        dirty_operations_++;
+        if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME);
+    }
+    // Re-applies the journaled writes newer than the snapshot. If any were found they are folded into a fresh
+    // snapshot right away, so the journal never carries records (or a torn tail) across restarts.
+    void _replay_journal_unlocked(uint64_t snapshot_seq) {
+        journal_seq_ = snapshot_seq;
+        size_t replayed = 0, skipped = 0;
+        unsigned long long bytes = 0;
+        {
+            std::ifstream in(JOURNAL_FILENAME);
+            std::string line;
+            while (std::getline(in, line)) {
+                bytes += line.size() + 1;
+                json record;
+                try { record = json::parse(line); } catch (...) { skipped++; continue; }
+                uint64_t seq;
+                // A line that parses but is not a well-formed record (not an object, or missing a field) is skipped too.
+                try {
+                    seq = record.value("seq", uint64_t(0));
+                    if (seq <= journal_seq_) continue;
+                    if (_apply_patch_unlocked(record).first != 200) skipped++;
+                } catch (...) { skipped++; continue; }
+                journal_seq_ = seq;
+                replayed++;
+            }
+        }
+        if (replayed || skipped) {
+            std::cout << "[INFO] Replayed " << replayed << " journaled write(s)" << (skipped ? " (" + std::to_string(skipped) + " skipped)" : std::string()) << "." << std::endl;
+            _save_to_file_unlocked(DATABASE_FILENAME);
+        }
+        if (!journal_.is_open()) { journal_.open(JOURNAL_FILENAME, std::ios::out | std::ios::app); journal_bytes_ = bytes; }
+    }
+    void _worker_function();
+    void _background_manager() { while (!stop_all_) { std::this_thread::sleep_for(std::chrono::seconds(1)); std::unique_lock<std::shared_mutex> lock(data_mutex_, std::try_to_lock); if (!lock.owns_lock()) continue; auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count(); std::vector<std::string> expired_keys; for (const auto& pair : ttl_map_) if (now_ms > pair.second) expired_keys.push_back(pair.first); if (!expired_keys.empty()) { for (const auto& key : expired_keys) { if (!_remove_key_unlocked(key, LAZY_FREE_ENABLED)) { ttl_map_.erase(key); continue; } dirty_operations_++; } if (DEBUG_MODE.load()) std::cout << "\n[BG] Expired " << expired_keys.size() << " key(s)." << std::endl; } if (TIERED_STORAGE_ENABLED) _compact_value_file_unlocked(); int batch_size = BATCH_PROCESSING_SIZE.load(); if (batch_size > 0 && dirty_operations_ >= batch_size) { int ops = dirty_operations_.load(); _save_to_file_unlocked(DATABASE_FILENAME); if (DEBUG_MODE.load()) std::cout << "\n[BG] Batch saved " << ops << " operations to disk." << std::endl; } } }
+    HandlerResult _handle_set(const std::vector<std::string>& args, bool mark_dirty = true) { if (args.size() != 2 && args.size() != 4) return {400, "-ERR wrong number of arguments for 'SET'. Expected: SET <key> \"<value>\" [EX <seconds>]"}; return _store_entry(args, _encode_value(args[1]), mark_dirty); }
+    // Shared tail of SET and JSON.SET: stores a prepared entry under args[0] and applies the optional EX args[2..3].
+    HandlerResult _store_entry(const std::vector<std::string>& args, ValueEntry entry, bool mark_dirty) { const auto& key = args[0]; std::unique_lock<std::shared_mutex> lock(data_mutex_); _put_entry_unlocked(key, std::move(entry)); if (args.size() == 4) { std::string mode = args[2]; std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper); if (mode == "EX") { try { ttl_map_[key] = std::chrono::duration_cast<std::chrono::milliseconds>((std::chrono::system_clock::now() + std::chrono::seconds(std::stoll(args[3]))).time_since_epoch()).count(); } catch (...) { return {400, "-ERR value is not an integer"}; } } } else { ttl_map_.erase(key); } if (mark_dirty) { dirty_operations_++; if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); } _enforce_memory_limit(); return {200, "+OK"}; }
+    HandlerResult _handle_get(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR wrong number of arguments"}; const auto& key = args[0]; std::string result_value; ReadTicket ticket; { std::shared_lock<std::shared_mutex> lock(data_mutex_); auto it = kv_store_.find(key); if (it == kv_store_.end()) return {404, "(nil)"}; ticket = _ticket_for(it->second); result_value = _read_value(it->second, &ticket.spilled_bytes); } if (!_touch_after_read(key, std::move(ticket))) return {404, "(nil)"}; return {200, result_value}; }
+    HandlerResult _handle_update(const std::vector<std::string>& args) { if (args.size() != 2) return {400, "-ERR wrong number of arguments for 'UPDATE'. Expected: UPDATE <key> \"<value>\""}; ValueEntry entry = _encode_value(args[1]); std::unique_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(args[0])) return {404, "(nil)"}; _put_entry_unlocked(args[0], std::move(entry)); dirty_operations_++; _enforce_memory_limit(); if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, "+OK"}; }
+    HandlerResult _handle_del(const std::vector<std::string>& args, bool mark_dirty = true, bool lazy = LAZY_FREE_ENABLED) { if (args.empty()) return {400, "-ERR wrong number of arguments"}; std::unique_lock<std::shared_mutex> lock(data_mutex_); int deleted_count = 0; for (const auto& key : args) { if (_remove_key_unlocked(key, lazy)) deleted_count++; } if (deleted_count == 0) return {200, "0"}; if (mark_dirty) { dirty_operations_ += deleted_count; if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); } return {200, std::to_string(deleted_count)}; }
+    HandlerResult _handle_incr_decr(const std::vector<std::string>& args, bool is_incr) { if (args.empty() || args.size() > 2) return {400, "-ERR wrong number of arguments"}; std::unique_lock<std::shared_mutex> lock(data_mutex_); const auto& key = args[0]; long long amount = 1; if (args.size() == 2) { try { amount = std::stoll(args[1]); } catch (...) { return {400, "-ERR not an integer"}; } } if (!is_incr) amount = -amount; long long current_val = 0; if (kv_store_.count(key)) { try { current_val = std::stoll(_read_value(kv_store_.at(key))); } catch (...) { return {400, "-ERR value is not an integer"}; } } std::string new_val_str = std::to_string(current_val + amount); _put_value_unlocked(key, new_val_str); dirty_operations_++; _enforce_memory_limit(); if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, new_val_str}; }
+    ValueEntry _json_entry(json parsed) const { if (JSON_BINARY_STORAGE) return _encode_binary_json(parsed); ValueEntry entry; entry.doc = std::make_shared<json>(std::move(parsed)); entry.doc_bytes = estimate_json_bytes(*entry.doc); entry.data_stale = true; return entry; }
+    // A JSON result in the format the client asked for (see FORMAT).
+    static std::string _render(const json& j) { return render_json(j, response_format_); }
+    // The DOM parser's message for text the scanner rejected.
+    static std::string _json_error(const std::string& text) { try { json checked = json::parse(text); (void)checked; } catch (const json::parse_error& e) { return e.what(); } return "malformed JSON"; }
+    HandlerResult _handle_json_set(const std::vector<std::string>& args) {
+        if (args.size() == 3 && !args[1].empty() && args[1][0] == '$') return _handle_json_patch("set", args[0], args[1], args[2]);
+        if (args.size() != 2 && args.size() != 4) return {400, "-ERR wrong number of arguments for 'JSON.SET'. Expected: JSON.SET <key> [$.path] '<value>' [EX <seconds>]"};
+        if (JSON_BINARY_STORAGE) { json parsed; try { parsed = json::parse(args[1]); } catch (const json::parse_error& e) { return {400, std::string("-ERR invalid JSON: ") + e.what()}; } return _store_entry(args, _json_entry(std::move(parsed)), true); }
+        // Text storage only needs the value checked and compacted; the tree is built by the first read that wants it.
+        std::string minified;
+        jsonscan::Info info;
+        if (!jsonscan::minify(args[1], minified, &info)) return {400, "-ERR invalid JSON: " + _json_error(args[1])};
+        ValueEntry entry = _encode_value(std::move(minified));
+        entry.array_length = info.root == '[' ? static_cast<int64_t>(info.items) : -1;
+        return _store_entry(args, std::move(entry), true);
+    }
+    HandlerResult _handle_json_merge(const std::vector<std::string>& args) {
+        if (args.size() == 2) return _handle_json_patch("merge", args[0], "$", args[1]);
+        if (args.size() == 3) return _handle_json_patch("merge", args[0], args[1], args[2]);
+        return {400, "-ERR wrong number of arguments. Syntax: JSON.MERGE <key> [$.path] '<patch>'"};
+    }
+    HandlerResult _handle_json_numincrby(const std::vector<std::string>& args) {
+        if (args.size() != 3) return {400, "-ERR wrong number of arguments. Syntax: JSON.NUMINCRBY <key> <$.path> <number>"};
+        return _handle_json_patch("incr", args[0], args[1], args[2]);
+    }
+    // Shared by JSON.SET <path>, JSON.MERGE and JSON.NUMINCRBY: the write is described by a record that is applied
+    // here and, on success, journaled as is, so replaying the journal goes through exactly the same code.
+    HandlerResult _handle_json_patch(const std::string& op, const std::string& key, const std::string& path, const std::string& value) {
+        json record = {{"op", op}, {"key", key}, {"path", path}};
+        try { record["value"] = json::parse(value); } catch (const json::parse_error& e) { return {400, std::string("-ERR invalid JSON: ") + e.what()}; }
+        if (op == "incr" && !record["value"].is_number()) return {400, "-ERR increment must be a number"};
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        HandlerResult result = _apply_patch_unlocked(record);
+        if (result.first != 200) return result;
+        _persist_patch_unlocked(std::move(record));
+        _enforce_memory_limit();
+        return result;
+    }
+    // Applies one path write in place: "set" replaces or adds the value at `path`, "merge" applies an RFC 7386 merge
+    // patch to it and "incr" adds to the number there. Caller holds the exclusive lock.
+    HandlerResult _apply_patch_unlocked(const json& record) {
+        const std::string& op = record.at("op").get_ref<const std::string&>();
+        const std::string& key = record.at("key").get_ref<const std::string&>();
+        const json& value = record.at("value");
+        json::json_pointer ptr;
+        try { ptr = to_json_pointer(record.at("path").get<std::string>()); } catch (...) { return {400, "-ERR invalid path"}; }
+        auto entry_it = kv_store_.find(key);
+        if (op == "set" && ptr.empty()) { _put_entry_unlocked(key, _json_entry(value)); return {200, "+OK"}; }
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        json* doc;
+        try { doc = &_doc_for_write_unlocked(entry_it); } catch (...) { return {500, "-ERR value at key is not a valid JSON document"}; }
+        // A write below one element of an indexed top-level array only re-indexes that element.
+        bool indexed = _has_indexes(key);
+        long long item_pos = -1;
+        json old_item;
+        if (indexed && doc->is_array() && !ptr.empty()) {
+            std::string first = ptr.to_string().substr(1);
+            first = first.substr(0, first.find('/'));
+            if (!first.empty() && first.size() < 10 && std::all_of(first.begin(), first.end(), ::isdigit) && std::stoull(first) < doc->size()) { item_pos = static_cast<long long>(std::stoull(first)); old_item = (*doc)[item_pos]; }
+        }
+        long long delta_bytes = 0;
+        std::string reply = "+OK";
+        try {
+            if (op == "set") {
+                json& parent = doc->at(ptr.parent_pointer());
+                const std::string& last = ptr.back();
+                if (parent.is_object()) {
+                    auto found = parent.find(last);
+                    if (found != parent.end()) delta_bytes -= estimate_json_bytes(*found);
+                    delta_bytes += estimate_json_bytes(value);
+                    parent[last] = value;
+                } else if (parent.is_array()) {
+                    if (last.empty() || last.size() >= 10 || !std::all_of(last.begin(), last.end(), ::isdigit) || std::stoull(last) >= parent.size()) return {400, "-ERR array index out of range"};
+                    json& slot = parent[std::stoull(last)];
+                    delta_bytes += static_cast<long long>(estimate_json_bytes(value)) - static_cast<long long>(estimate_json_bytes(slot));
+                    slot = value;
+                } else return {400, "-ERR path's parent is not an object or array"};
+            } else if (op == "merge") {
+                json& target = doc->at(ptr);
+                delta_bytes -= estimate_json_bytes(target);
+                target.merge_patch(value);
+                delta_bytes += estimate_json_bytes(target);
+            } else if (op == "incr") {
+                json& target = doc->at(ptr);
+                if (!target.is_number()) return {400, "-ERR value at path is not a number"};
+                if (target.is_number_integer() && value.is_number_integer()) {
+                    long long current = target.get<long long>(), by = value.get<long long>();
+                    if ((by > 0 && current > std::numeric_limits<long long>::max() - by) || (by < 0 && current < std::numeric_limits<long long>::min() - by)) return {400, "-ERR increment would overflow"};
+                    target = current + by;
+                } else {
+                    double result = target.get<double>() + value.get<double>();
+                    if (!std::isfinite(result)) return {400, "-ERR increment would produce an infinite number"};
+                    target = result;
+                }
+                reply = target.dump();
+            } else return {400, "-ERR unknown JSON write"};
+        } catch (const json::out_of_range&) { return {400, "-ERR path does not exist"}; }
+        catch (const json::exception& e) { return {400, std::string("-ERR ") + e.what()}; }
+        if (item_pos >= 0) {
+            const json& new_item = (*doc)[item_pos];
+            uint32_t pos = static_cast<uint32_t>(item_pos);
+            _update_indexes_unlocked(key, [&](std::map<std::string, JsonFieldIndex>& indexes) {
+                for (auto& pair : indexes) {
+                    if (old_item.is_object()) { auto f = old_item.find(pair.first); if (f != old_item.end()) pair.second.remove(*f, pos); }
+                    if (new_item.is_object()) { auto f = new_item.find(pair.first); if (f != new_item.end()) pair.second.add(*f, pos); }
+                }
+            });
+            _update_text_index_unlocked(key, [&](JsonTextIndex& index) { JsonTextIndex::WordCounts old_words, new_words; JsonTextIndex::collect(old_item, old_words); JsonTextIndex::collect(new_item, new_words); index.remove(old_words, pos); index.add(new_words, pos); });
+            _reindex_item_unlocked(key, old_item, new_item, pos);
+        }
+        _doc_modified_unlocked(entry_it, delta_bytes);
+        if (indexed && item_pos < 0) _rebuild_indexes_unlocked(entry_it);
+        return {200, reply};
+    }
+    static std::string _clean_path_key(const std::string& path_key) { if (path_key.rfind("$.", 0) == 0) return path_key.substr(2); if (path_key.rfind("$[", 0) == 0) return path_key.substr(1); return path_key; }
+    // --- JSON query compiler ---
+    // Turns the arguments of JSON.GET / JSON.UPDATE / JSON.DEL / JSON.AGG / JSON.FIND (after the key or prefix) into a
+    // plan, reusing a cached one when the same shape was seen before. Returns nullptr and fills `error` on a syntax error.
+    std::shared_ptr<const JsonQuery> _query_plan(const std::string& command, const std::vector<std::string>& args, HandlerResult& error) {
+        std::string shape = command;
+        for (size_t i = 1; i < args.size(); ++i) {
+            shape.push_back('\x1f');
+            // A CURSOR value changes with every page, not the plan; the handler reads it from the arguments.
+            size_t unused;
+            if (i > 1 && _upper(args[i - 1]) == "CURSOR" && _parse_count(args[i], unused)) shape.push_back('#');
+            else shape += args[i];
+        }
+        if (auto plan = query_cache_.get(shape)) return plan;
+        auto plan = std::make_shared<JsonQuery>();
+        if (!_compile_query(command, args, *plan, error)) return nullptr;
+        query_cache_.put(shape, plan, QUERY_CACHE_SIZE);
+        return plan;
+    }
+    static std::string _upper(std::string text) { std::transform(text.begin(), text.end(), text.begin(), ::toupper); return text; }
+    // Parses `<condition> [AND|OR <condition>]...` from args[i, end) and leaves `i` after the last condition. A condition
+    // is `<field> <value>` (equality), `<field> =|!=|<|<=|>|>= <value>`, `<field> BETWEEN <low> AND <high>` or
+    // `<field> IN <v1,v2,...>` (or a JSON array).
+    static bool _parse_predicate(const std::vector<std::string>& args, size_t& i, size_t end, JsonPredicate& where, HandlerResult& error) {
+        using Op = JsonCondition::Op;
+        static const std::map<std::string, Op> symbols = {{"=", Op::Eq}, {"==", Op::Eq}, {"!=", Op::Ne}, {"<>", Op::Ne}, {"<", Op::Lt}, {"<=", Op::Le}, {">", Op::Gt}, {">=", Op::Ge}};
+        const HandlerResult syntax = {400, "-ERR syntax: WHERE <field> [=|!=|<|<=|>|>=] <value> | <field> BETWEEN <low> AND <high> | <field> IN <v1,v2,...> [AND|OR ...]"};
+        where.groups.emplace_back();
+        while (true) {
+            if (i + 2 > end || args[i].empty()) { error = syntax; return false; }
+            JsonCondition condition;
+            try { condition.field = JsonFieldPath::parse(args[i]); } catch (...) { error = {400, "-ERR invalid field path '" + args[i] + "'"}; return false; }
+            std::string op = _upper(args[i + 1]);
+            i += 2;
+            auto symbol = symbols.find(op);
+            if (symbol != symbols.end()) {
+                if (i >= end) { error = syntax; return false; }
+                condition.op = symbol->second;
+                condition.values.push_back(parse_query_literal(args[i++]));
+            } else if (op == "BETWEEN") {
+                if (i + 3 > end || _upper(args[i + 1]) != "AND") { error = syntax; return false; }
+                condition.op = Op::Between;
+                condition.values.push_back(parse_query_literal(args[i]));
+                condition.values.push_back(parse_query_literal(args[i + 2]));
+                i += 3;
+            } else if (op == "IN") {
+                if (i >= end) { error = syntax; return false; }
+                condition.op = Op::In;
+                const std::string& list = args[i++];
+                json parsed = list.empty() || list[0] != '[' ? json() : parse_query_literal(list);
+                if (parsed.is_array()) { for (auto& item : parsed) condition.values.push_back(std::move(item)); }
+                else for (size_t start = 0; start <= list.size();) { size_t comma = std::min(list.find(',', start), list.size()); if (comma > start) condition.values.push_back(parse_query_literal(list.substr(start, comma - start))); start = comma + 1; }
+                if (condition.values.empty()) { error = {400, "-ERR IN needs at least one value"}; return false; }
+            } else {
+                condition.values.push_back(parse_query_literal(args[i - 1])); // `<field> <value>`
+            }
+            if (condition.op == Op::Eq || condition.op == Op::In) for (const auto& value : condition.values) condition.index_keys.push_back(JsonFieldIndex::key_for(value));
+            where.groups.back().push_back(std::move(condition));
+            if (i >= end) return true;
+            std::string joiner = _upper(args[i]);
+            if (joiner == "AND") { ++i; continue; }
+            if (joiner == "OR") { ++i; where.groups.emplace_back(); continue; }
+            return true;
+        }
+    }
+    static bool _parse_count(const std::string& text, size_t& out) { if (text.empty() || text.size() > 18 || !std::all_of(text.begin(), text.end(), ::isdigit)) return false; out = static_cast<size_t>(std::stoull(text)); return true; }
+    // Parses `[FIELDS <field>...] [LIMIT <n>] [OFFSET <n>]` and, for JSON.GET, `[CURSOR <cursor>]` from args[i, end).
+    static bool _parse_result_clauses(const std::vector<std::string>& args, size_t i, bool cursor_allowed, JsonQuery& plan, HandlerResult& error) {
+        auto ends_fields = [&](const std::string& word) { std::string clause = _upper(word); return clause == "LIMIT" || clause == "OFFSET" || (cursor_allowed && clause == "CURSOR"); };
+        while (i < args.size()) {
+            std::string clause = _upper(args[i]);
+            if (ends_fields(clause) && i + 1 < args.size()) {
+                size_t cursor;
+                if (!_parse_count(args[i + 1], clause == "LIMIT" ? plan.limit : clause == "OFFSET" ? plan.offset : cursor)) { error = {400, "-ERR " + clause + " must be a non-negative integer"}; return false; }
+                if (clause == "CURSOR") { plan.paged = true; plan.cursor_arg = i + 1; }
+                i += 2;
+            } else if (clause == "FIELDS" && i + 1 < args.size()) {
+                for (++i; i < args.size() && !ends_fields(args[i]); ++i) {
+                    try { plan.fields.push_back(JsonFieldPath::parse(args[i])); } catch (...) { error = {400, "-ERR invalid field path '" + args[i] + "'"}; return false; }
+                }
+            } else if (cursor_allowed) { error = {400, "-ERR syntax: unexpected '" + args[i] + "' after WHERE clause. Expected FIELDS, LIMIT, OFFSET or CURSOR"}; return false; }
+            else { error = {400, "-ERR syntax: JSON.FIND <prefix> [WHERE <predicate>] [FIELDS <field>...] [LIMIT <n>] [OFFSET <n>]"}; return false; }
+        }
+        return true;
+    }
+    static bool _compile_query(const std::string& command, const std::vector<std::string>& args, JsonQuery& plan, HandlerResult& error) {
+        if (command == "FIND") {
+            // JSON.FIND <prefix> [WHERE <predicate>] [FIELDS <field>...] [LIMIT <n>] [OFFSET <n>]
+            size_t i = 1;
+            if (i < args.size() && _upper(args[i]) == "WHERE") { plan.has_where = true; ++i; if (!_parse_predicate(args, i, args.size(), plan.where, error)) return false; }
+            if (!_parse_result_clauses(args, i, false, plan, error)) return false;
+            plan.assign_slots();
+            return true;
+        }
+        auto where_it = std::find(args.begin(), args.end(), "WHERE");
+        if (command == "GET") {
+            if (where_it != args.end()) {
+                // JSON.GET <key> WHERE <predicate> [FIELDS <field>...] [LIMIT <n>] [OFFSET <n>] [CURSOR <cursor>]
+                plan.has_where = true;
+                size_t i = static_cast<size_t>(std::distance(args.begin(), where_it)) + 1;
+                if (!_parse_predicate(args, i, args.size(), plan.where, error) || !_parse_result_clauses(args, i, true, plan, error)) return false;
+                if (plan.paged && plan.limit == 0) { error = {400, "-ERR LIMIT must be positive with CURSOR"}; return false; }
+                plan.assign_slots();
+                return true;
+            }
+            // JSON.GET <key> [LIMIT <n>] CURSOR <cursor> pages through a root array. Anything else after the key is paths.
+            bool paging = args.size() >= 3 && args.size() % 2 == 1;
+            for (size_t i = 1; paging && i < args.size(); i += 2) { std::string word = _upper(args[i]); size_t unused; paging = (word == "LIMIT" || word == "CURSOR") && _parse_count(args[i + 1], unused); if (word == "CURSOR") plan.cursor_arg = i + 1; }
+            if (paging && plan.cursor_arg) {
+                for (size_t i = 1; i < args.size(); i += 2) if (_upper(args[i]) == "LIMIT") _parse_count(args[i + 1], plan.limit);
+                if (plan.limit == 0) { error = {400, "-ERR LIMIT must be positive with CURSOR"}; return false; }
+                plan.paged = true;
+                return true;
+            }
+            plan.cursor_arg = 0;
+            for (size_t i = 1; i < args.size(); ++i) {
+                JsonQuery::Path path;
+                path.label = _clean_path_key(args[i]);
+                try { path.pointer = to_json_pointer(args[i]); path.pointer_text = path.pointer.to_string(); } catch (...) { path.valid = false; }
+                plan.paths.push_back(std::move(path));
+            }
+            return true;
+        }
+        if (command == "UPDATE") {
+            if (args.size() < 4) { error = {400, "-ERR invalid syntax for JSON.UPDATE"}; return false; }
+            auto set_it = std::find(args.begin(), args.end(), "SET");
+            if (where_it == args.end() || set_it == args.end() || where_it > set_it) { error = {400, "-ERR syntax error. Expected: ... WHERE <predicate> SET ..."}; return false; }
+            if (std::distance(set_it, args.end()) < 3 || (std::distance(set_it, args.end()) - 1) % 2 != 0) { error = {400, "-ERR syntax error. Expected: ... SET <field1> <value1> ..."}; return false; }
+            plan.has_where = true;
+            size_t i = static_cast<size_t>(std::distance(args.begin(), where_it)) + 1, set_pos = static_cast<size_t>(std::distance(args.begin(), set_it));
+            if (!_parse_predicate(args, i, set_pos, plan.where, error)) return false;
+            if (i != set_pos) { error = {400, "-ERR syntax: unexpected '" + args[i] + "' in WHERE clause"}; return false; }
+            for (auto it = set_it + 1; it != args.end() && it + 1 != args.end(); it += 2) plan.assignments.emplace_back(*it, parse_query_literal(*(it + 1)));
+            plan.assign_slots();
+            return true;
+        }
+        if (command == "AGG") {
+            // JSON.AGG <key> [WHERE <predicate>] <function> <field> [<function> <field>...] [GROUP BY <field>]
+            static const std::set<std::string> functions = {"COUNT", "SUM", "MIN", "MAX", "AVG"};
+            const HandlerResult syntax = {400, "-ERR syntax: JSON.AGG <key> [WHERE <predicate>] COUNT|SUM|MIN|MAX|AVG <field> [...] [GROUP BY <field>]"};
+            size_t i = 1;
+            if (i < args.size() && _upper(args[i]) == "WHERE") { plan.has_where = true; ++i; if (!_parse_predicate(args, i, args.size(), plan.where, error)) return false; }
+            while (i < args.size()) {
+                std::string word = _upper(args[i]);
+                if (word == "GROUP") {
+                    if (i + 3 != args.size() || _upper(args[i + 1]) != "BY") { error = syntax; return false; }
+                    try { plan.group_by = JsonFieldPath::parse(args[i + 2]); } catch (...) { error = {400, "-ERR invalid field path '" + args[i + 2] + "'"}; return false; }
+                    plan.has_group = true;
+                    break;
+                }
+                if (!functions.count(word) || i + 1 >= args.size() || args[i + 1].empty()) { error = syntax; return false; }
+                JsonQuery::Aggregate aggregate;
+                aggregate.function = word;
+                aggregate.label = word + "(" + args[i + 1] + ")";
+                if (args[i + 1] == "*") { if (word != "COUNT") { error = {400, "-ERR only COUNT accepts *"}; return false; } aggregate.field.text = "*"; }
+                else try { aggregate.field = JsonFieldPath::parse(args[i + 1]); } catch (...) { error = {400, "-ERR invalid field path '" + args[i + 1] + "'"}; return false; }
+                plan.aggregates.push_back(std::move(aggregate));
+                i += 2;
+            }
+            if (plan.aggregates.empty()) { error = syntax; return false; }
+            plan.assign_slots();
+            return true;
+        }
+        // DEL
+        if (args.size() < 4 || _upper(args[1]) != "WHERE") { error = {400, "-ERR syntax: JSON.DEL <key> [WHERE <predicate>]"}; return false; }
+        plan.has_where = true;
+        size_t i = 2;
+        if (!_parse_predicate(args, i, args.size(), plan.where, error)) return false;
+        if (i != args.size()) { error = {400, "-ERR syntax: unexpected '" + args[i] + "' in WHERE clause"}; return false; }
+        plan.assign_slots();
+        return true;
+    }
+    // Shared by the workers taking part in one _scan_ordered call. Chunks are claimed from `next`, so whoever is free
+    // takes the next range; `cutoff` is the last chunk that can still contribute once MAX results are known.
+    struct ScanState {
+        size_t chunks = 0, chunk_items = 0, max_results = 0;
+        std::function<void(size_t, size_t, size_t, json&)> scan; // (begin, end, chunk, out)
+        std::atomic<size_t> next{0}, cutoff{std::numeric_limits<size_t>::max()};
+        std::vector<json> parts;
+        std::vector<char> done;
+        size_t finished = 0, prefix = 0, prefix_matches = 0;
+        std::mutex mutex;
+        std::condition_variable finished_cv;
+
+        void work() {
+            for (size_t chunk; (chunk = next++) < chunks;) {
+                if (chunk <= cutoff.load()) scan(chunk * chunk_items, chunk * chunk_items + chunk_items, chunk, parts[chunk]);
+                std::lock_guard<std::mutex> lock(mutex);
+                done[chunk] = 1;
+                for (; prefix < chunks && done[prefix]; ++prefix) if ((prefix_matches += parts[prefix].size()) >= max_results && prefix < cutoff.load()) cutoff = prefix;
+                if (++finished == chunks) finished_cv.notify_all();
+            }
+        }
+    };
+    // Appends the matching elements of [0, size) to an array in order, stopping at `max_results`. `emit(pos, out)` pushes
+    // the element at `pos` onto `out` if it matches. Large arrays are split into chunks that the calling worker and
+    // idle pool workers claim in turn (fork/join). The caller only ever waits for chunks that are already running, so
+    // a busy pool degrades to a serial scan rather than a deadlock. A chunk stops as soon as the chunks before it hold
+    // `max_results` matches. `emit` runs concurrently and may only read.
+    template <typename Emit> json _scan_ordered(size_t size, size_t max_results, Emit emit) {
+        json results = json::array();
+        size_t chunk_items = std::max<size_t>(PARALLEL_SCAN_CHUNK_ITEMS, 1);
+        if (PARALLEL_SCAN_MIN_ITEMS == 0 || size < PARALLEL_SCAN_MIN_ITEMS || workers_.size() < 2 || size <= chunk_items) {
+            for (size_t pos = 0; pos < size && results.size() < max_results; ++pos) emit(pos, results);
+            return results;
+        }
+        // About four chunks per worker, so a slow range does not hold up the others.
+        chunk_items = std::max(chunk_items, (size + workers_.size() * 4 - 1) / (workers_.size() * 4));
+        auto state = std::make_shared<ScanState>();
+        state->chunks = (size + chunk_items - 1) / chunk_items;
+        state->chunk_items = chunk_items;
+        state->max_results = max_results;
+        state->parts.assign(state->chunks, json::array());
+        state->done.assign(state->chunks, 0);
+        ScanState* raw = state.get();
+        state->scan = [raw, size, max_results, &emit](size_t begin, size_t end, size_t chunk, json& out) {
+            for (size_t pos = begin; pos < std::min(end, size) && out.size() < max_results; ++pos) {
+                if ((pos & 255) == 0 && chunk > raw->cutoff.load(std::memory_order_relaxed)) return;
+                emit(pos, out);
+            }
+        };
+        for (size_t i = 1, helpers = std::min(workers_.size() - 1, state->chunks - 1); i <= helpers; ++i) {
+            Task task;
+            task.job = [state] { state->work(); };
+            queued_task_bytes_ += _task_bytes(task);
+            { std::lock_guard<std::mutex> lock(queue_mutex_); task_queue_.push(std::move(task)); }
+            condition_.notify_one();
+        }
+        state->work();
+        {
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->finished_cv.wait(lock, [&] { return state->finished == state->chunks; });
+        }
+        for (size_t chunk = 0; chunk < state->chunks && results.size() < max_results; ++chunk)
+            for (auto& item : state->parts[chunk]) { if (results.size() >= max_results) break; results.push_back(std::move(item)); }
+        parallel_scans_++;
+        return results;
+    }
+    // Chooses how to find the elements matching `where` in an array of `size` elements. Every AND group must
+    // contribute its cheapest indexed equality or IN condition (fewest positions); if some group has none, or the
+    // candidates would be no fewer than the elements, returns false and the caller does one scan evaluating the
+    // whole predicate. Otherwise `out` receives the sorted union of the candidates, still to be checked in full.
+    bool _index_candidates(const std::string& key, const JsonPredicate& where, size_t size, std::vector<uint32_t>& out) const {
+        auto indexes = json_indexes_.find(key);
+        if (indexes == json_indexes_.end() || where.groups.empty()) return false;
+        std::vector<const std::vector<uint32_t>*> lists;
+        size_t total = 0;
+        for (const auto& group : where.groups) {
+            size_t best_cost = std::numeric_limits<size_t>::max();
+            std::vector<const std::vector<uint32_t>*> best;
+            for (const auto& condition : group) {
+                if (!condition.indexable()) continue;
+                auto index = indexes->second.find(*condition.field.index_field());
+                if (index == indexes->second.end()) continue;
+                std::vector<const std::vector<uint32_t>*> buckets;
+                size_t cost = 0;
+                for (const auto& index_key : condition.index_keys) { auto bucket = index->second.positions.find(index_key); if (bucket != index->second.positions.end()) { buckets.push_back(&bucket->second); cost += bucket->second.size(); } }
+                if (cost < best_cost) { best_cost = cost; best = std::move(buckets); }
+            }
+            if (best_cost == std::numeric_limits<size_t>::max()) return false;
+            total += best_cost;
+            lists.insert(lists.end(), best.begin(), best.end());
+        }
+        if (size > 0 && total >= size) return false;
+        out.clear();
+        out.reserve(total);
+        for (const auto* list : lists) out.insert(out.end(), list->begin(), list->end());
+        if (lists.size() > 1) { std::sort(out.begin(), out.end()); out.erase(std::unique(out.begin(), out.end()), out.end()); }
+        return true;
+    }
+    // Runs a WHERE plan over one array: the index candidates when the planner picks them, otherwise a single scan that
+    // evaluates the whole predicate per element. OFFSET and LIMIT apply in array order and end the walk early.
+    template <typename At, typename Match, typename Visit>
+    void _for_each_match(const JsonQuery& plan, const std::string& key, size_t size, At at, Match match, Visit visit) const {
+        auto step = [&](size_t pos) { const auto& item = at(pos); return !match(item) || visit(item); };
+        std::vector<uint32_t> candidates;
+        if (_index_candidates(key, plan.where, size, candidates)) { for (uint32_t pos : candidates) if (pos < size && !step(pos)) break; }
+        else for (size_t pos = 0; pos < size; ++pos) if (!step(pos)) break;
+    }
+    // --- Element walks (CURSOR pages and streamed replies) ---
+    // Where a reply over the elements of an array stands between lock holds. The matches are found in the first
+    // hold; later holds (one per streamed frame) only render them, checking each again because the array may have
+    // changed while the lock was released.
+    struct ElementWalk {
+        json positions = json::array(); // matching positions in array order; unused when `every`
+        bool every = false;              // every element of [next, end) is returned
+        size_t next = 0, end = 0;        // indexes into `positions`, or array positions when `every`
+        size_t cursor = 0;               // CURSOR to reply with: where the next page starts, 0 after the last page
+        size_t holds = 0;
+    };
+    // Finds up to OFFSET + `limit` matches from array position `begin`: from the sorted `candidates` when an index
+    // narrowed them down, otherwise by a scan (in parallel for large arrays). A CURSOR page looks for one match
+    // more, to tell whether another page follows.
+    template <typename Match>
+    void _start_walk(ElementWalk& walk, size_t size, size_t begin, size_t offset, size_t limit, bool paged, const std::vector<uint32_t>* candidates, Match match) {
+        if (walk.every) {
+            walk.next = begin >= size ? size : begin + std::min(offset, size - begin);
+            walk.end = walk.next + std::min(limit, size - walk.next);
+            walk.cursor = paged && walk.end < size ? walk.end : 0;
+            return;
+        }
+        if (limit == 0 || begin >= size) return;
+        size_t wanted = limit > std::numeric_limits<size_t>::max() - offset - 1 ? std::numeric_limits<size_t>::max() : offset + limit + (paged ? 1 : 0);
+        if (candidates) { for (auto it = std::lower_bound(candidates->begin(), candidates->end(), static_cast<uint32_t>(std::min<size_t>(begin, UINT32_MAX))); it != candidates->end() && walk.positions.size() < wanted; ++it) if (*it < size && match(*it)) walk.positions.push_back(*it); }
+        else walk.positions = _scan_ordered(size - begin, wanted, [&](size_t i, json& out) { if (match(begin + i)) out.push_back(begin + i); });
+        if (paged && walk.positions.size() > offset + limit) {
+            walk.cursor = walk.positions[offset + limit - 1].get<size_t>() + 1;
+            walk.positions.erase(walk.positions.size() - 1);
+        }
+        walk.next = std::min(offset, walk.positions.size());
+        walk.end = walk.positions.size();
+    }
+    // Renders the walk's remaining matches through `emit(pos)`. Returns false, leaving the rest for the next hold,
+    // as soon as `full()` reports a frame's worth of output.
+    template <typename Match, typename Emit, typename Full>
+    bool _continue_walk(ElementWalk& walk, size_t size, Match match, Emit emit, Full full) {
+        bool recheck = walk.holds++ > 0;
+        while (walk.next < walk.end) {
+            if (full()) return false;
+            size_t pos = walk.every ? walk.next : walk.positions[walk.next].get<size_t>();
+            walk.next++;
+            if (pos < size && (!recheck || match(pos))) emit(pos);
+        }
+        return true;
+    }
+    // Opens the key's document for one lock hold of a read that may span several. A document the read had to parse,
+    // or bytes it had to decompress or read back from disk, are private to it and reused by the later holds; a cached
+    // document or a resident binary value is looked up again each time. Sets `doc` or `binary`; throws if the value
+    // is not JSON.
+    void _open_for_read(const ValueEntry& entry, bool first, ReadTicket& ticket, std::string& scratch, const json*& doc, std::unique_ptr<nkb::Document>& binary) const {
+        doc = nullptr;
+        binary.reset();
+        if (ticket.parsed_doc) doc = ticket.parsed_doc.get();
+        else if (!scratch.empty()) binary = std::make_unique<nkb::Document>(scratch);
+        else if (entry.nkb && !entry.doc) binary = std::make_unique<nkb::Document>(_payload_view(entry, scratch, first ? &ticket.spilled_bytes : nullptr));
+        else doc = &_doc_for_read(entry, ticket);
+    }
+    // Runs `hold(doc, binary, error)` under the shared lock until it returns true. A false return means `writer` holds
+    // a frame: the lock is released, the frame is sent on the STREAM ON connection and the next hold continues where
+    // the walk stopped, so a large result never sits in memory as a whole. Returns {0, ""} on success. Once a frame
+    // has gone out the reply is committed to the array: a key that vanished, stopped being JSON or failed a later
+    // hold ends it there, and `hold` must not replace it with another body.
+    template <typename Hold>
+    HandlerResult _read_in_holds(const std::string& key, ArrayWriter& writer, ReadTicket& ticket, Hold hold) {
+        std::string scratch;
+        for (size_t holds = 0;; ++holds) {
+            HandlerResult error{0, ""};
+            bool complete;
+            {
+                std::shared_lock<std::shared_mutex> lock(data_mutex_);
+                auto entry_it = kv_store_.find(key);
+                if (entry_it == kv_store_.end()) { if (holds == 0) return {404, "(nil)"}; break; }
+                if (holds == 0) ticket = _ticket_for(entry_it->second);
+                const json* doc;
+                std::unique_ptr<nkb::Document> binary;
+                try { _open_for_read(entry_it->second, holds == 0, ticket, scratch, doc, binary); } catch (...) { if (holds == 0) return {500, "-ERR not a valid JSON document"}; break; }
+                complete = hold(doc, binary.get(), error);
+            }
+            if (error.first) { if (holds == 0) return error; break; }
+            if (complete) break;
+            if (!(*response_stream_)(writer.take())) return {500, "-ERR connection lost while streaming"};
+            reply_streamed_ = true;
+            streamed_frames_++;
+        }
+        return {0, ""};
+    }
+    // Finishes a walk's reply: the last frame of a streamed one, a {"cursor", "results"} page, or the whole array
+    // (or 404 with `empty_reply`, if given, when nothing matched).
+    HandlerResult _finish_walk(const std::string& key, ReadTicket ticket, ArrayWriter& writer, bool paged, const ElementWalk& walk, json& page, const std::string* empty_reply) {
+        bool touched = _touch_after_read(key, std::move(ticket));
+        if (writer.taken()) { streamed_replies_++; return {200, writer.finish()}; }
+        if (!touched) return {404, "(nil)"};
+        if (paged) return {200, _render(json{{"cursor", walk.cursor}, {"results", std::move(page)}})};
+        if (writer.size() == 0 && empty_reply) return {404, *empty_reply};
+        return {200, writer.finish()};
+    }
+    // Parses the CURSOR argument a plan recorded (see _query_plan); 0 without one.
+    static size_t _cursor_value(const JsonQuery& plan, const std::vector<std::string>& args) { size_t cursor = 0; if (plan.paged && plan.cursor_arg < args.size()) _parse_count(args[plan.cursor_arg], cursor); return cursor; }
+    // JSON.GET over the elements of an array: WHERE results, CURSOR pages and whole-array reads. Results are written
+    // element by element, and on a STREAM ON connection sent in frames of STREAM_FRAME_BYTES.
+    HandlerResult _json_get_elements(const std::string& key, const JsonQuery& plan, size_t cursor) {
+        const JsonPredicate& where = plan.where;
+        size_t limit = plan.paged && plan.limit == std::numeric_limits<size_t>::max() ? CURSOR_DEFAULT_LIMIT : plan.limit;
+        ArrayWriter writer(response_format_);
+        json page = json::array(); // a CURSOR page is bounded by LIMIT and rendered whole, with its cursor
+        bool streaming = response_stream_ && !plan.paged && writer.can_take();
+        auto full = [&] { return streaming && writer.buffered() >= STREAM_FRAME_BYTES; };
+        auto sink = [&](const json& item) { if (plan.paged) page.push_back(item); else writer.push(item); };
+        ElementWalk walk;
+        walk.every = !plan.has_where;
+        std::string whole; // a whole-document read that is not an array walk
+        const HandlerResult not_array = {400, plan.has_where ? "-ERR `WHERE` clause can only be used on JSON arrays." : "-ERR CURSOR can only be used on JSON arrays."};
+        auto run = [&](size_t size, auto match, auto emit) {
+            if (walk.holds == 0) {
+                std::vector<uint32_t> candidates;
+                bool indexed = plan.has_where && _index_candidates(key, where, size, candidates);
+                _start_walk(walk, size, cursor, plan.offset, limit, plan.paged, indexed ? &candidates : nullptr, match);
+            }
+            return _continue_walk(walk, size, match, emit, full);
+        };
+        ReadTicket ticket;
+        HandlerResult status = _read_in_holds(key, writer, ticket, [&](const json* doc, const nkb::Document* binary, HandlerResult& error) {
+            if (binary) {
+                // Binary JSON: walk the offset tables and decode only what is returned.
+                nkb::Value root = binary->root();
+                if (!root.is_array()) { if (walk.holds > 0) return true; if (plan.has_where || plan.paged) error = not_array; else whole = _render(root.to_json()); return true; }
+                auto binding = plan.bind(*binary);
+                return run(root.size(), [&](size_t pos) { return !plan.has_where || where.matches(root.at(pos), binding); }, [&](size_t pos) {
+                    nkb::Value item = root.at(pos);
+                    if (plan.fields.empty()) return sink(item.to_json());
+                    json projected = json::object();
+                    for (const auto& field : plan.fields) { nkb::Value v = field.resolve(item, binding[field.slot]); projected[_clean_path_key(field.text)] = v ? v.to_json() : json(nullptr); }
+                    sink(projected);
+                });
+            }
+            if (!doc->is_array() || (!plan.has_where && !plan.paged && !streaming)) {
+                if (walk.holds > 0) return true; // rewritten between frames: close the array already sent
+                if (plan.has_where || plan.paged) error = not_array; else whole = _render(*doc);
+                return true;
+            }
+            return run(doc->size(), [&](size_t pos) { return !plan.has_where || where.matches((*doc)[pos]); }, [&](size_t pos) {
+                const json& item = (*doc)[pos];
+                if (plan.fields.empty()) return sink(item);
+                json projected = json::object();
+                for (const auto& field : plan.fields) { const json* v = field.resolve(item); projected[_clean_path_key(field.text)] = v ? *v : json(nullptr); }
+                sink(projected);
+            });
+        });
+        if (status.first) return status;
+        if (!whole.empty()) { if (!_touch_after_read(key, std::move(ticket))) return {404, "(nil)"}; return {200, whole}; }
+        const std::string no_matches = _render(json::array());
+        return _finish_walk(key, std::move(ticket), writer, plan.paged, walk, page, plan.has_where ? &no_matches : nullptr);
+    }
+    // --- Result cache ---
+    // Serves a read on a JSON.CACHE ON key from the reply cached for the same query and format, if the value has
+    // not been written since; otherwise runs `handler` and keeps its reply. Streamed replies and errors are not kept.
+    template <typename Handler> HandlerResult _cached_read(const std::string& command, const std::vector<std::string>& args, Handler handler) {
+        if (args.empty() || RESULT_CACHE_BYTES == 0 || cached_key_count_.load() == 0) return handler();
+        const std::string& key = args[0];
+        uint64_t revision = 0;
+        {
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            auto it = kv_store_.find(key);
+            if (it != kv_store_.end() && cached_keys_.count(key)) revision = it->second.revision;
+        }
+        if (revision == 0) return handler();
+        std::string shape = command;
+        shape.push_back(static_cast<char>('0' + static_cast<int>(response_format_)));
+        for (size_t i = 1; i < args.size(); ++i) { shape.push_back('\x1f'); shape += args[i]; }
+        HandlerResult reply;
+        if (result_cache_.get(key, shape, revision, reply)) {
+            if (CACHING_ENABLED && max_memory_bytes_ > 0) { std::unique_lock<std::shared_mutex> lock(data_mutex_); if (kv_store_.count(key)) _update_lru(key); }
+            return reply;
+        }
+        reply_streamed_ = false;
+        reply = handler();
+        // Tagged with the revision seen before the read: if a write slipped in, the reply is never served.
+        if ((reply.first == 200 || reply.first == 404) && !reply_streamed_) result_cache_.put(key, shape, revision, reply, RESULT_CACHE_BYTES);
+        return reply;
+    }
+    HandlerResult _handle_json_cache(const std::vector<std::string>& args) {
+        // Syntax: JSON.CACHE ON|OFF <key>
+        if (args.size() != 2 || (_upper(args[0]) != "ON" && _upper(args[0]) != "OFF")) return {400, "-ERR syntax: JSON.CACHE ON|OFF <key>"};
+        const auto& key = args[1];
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        if (_upper(args[0]) == "OFF") {
+            if (!cached_keys_.erase(key)) return {200, "0"};
+            cached_key_count_ = cached_keys_.size();
+            result_cache_.drop(key);
+            dirty_operations_++;
+            return {200, "1"};
+        }
+        if (!kv_store_.count(key)) return {404, "(nil)"};
+        cached_keys_.insert(key);
+        cached_key_count_ = cached_keys_.size();
+        dirty_operations_++;
+        return {200, "+OK"};
+    }
+    HandlerResult _handle_json_get(const std::vector<std::string>& args) {
+        if (args.empty()) return {400, "-ERR wrong number of arguments"};
+        const auto& key = args[0];
+        HandlerResult error;
+        auto plan = _query_plan("GET", args, error);
+        if (!plan) return error;
+        if (plan->has_where || plan->paths.empty()) return _json_get_elements(key, *plan, _cursor_value(*plan, args));
+        std::string result_dump;
+        ReadTicket ticket;
+        {
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            auto entry_it = kv_store_.find(key);
+            if (entry_it == kv_store_.end()) return {404, "(nil)"};
+            const ValueEntry& entry = entry_it->second;
+            ticket = _ticket_for(entry);
+            if (entry.nkb && !entry.doc) {
+                // Binary JSON: walk the offset tables and decode only what is returned.
+                std::string scratch;
+                std::unique_ptr<nkb::Document> doc;
+                try { doc = std::make_unique<nkb::Document>(_payload_view(entry, scratch, &ticket.spilled_bytes)); } catch (...) { return {500, "-ERR not a valid JSON document"}; }
+                json result = json::object();
+                for (const auto& path : plan->paths) { nkb::Value v = path.valid ? doc->at_pointer(path.pointer_text) : nkb::Value(); result[path.label] = v ? v.to_json() : json(nullptr); }
+                result_dump = _render(result);
+            } else {
+                const json* doc_ptr;
+                try { doc_ptr = &_doc_for_read(entry, ticket); } catch (...) { return {500, "-ERR not a valid JSON document"}; }
+                const json& doc = *doc_ptr;
+                json result = json::object();
+                for (const auto& path : plan->paths) { try { if (!path.valid) throw std::invalid_argument("invalid path"); result[path.label] = doc.at(path.pointer); } catch (...) { result[path.label] = nullptr; } }
+                result_dump = _render(result);
+            }
+        }
+        if (!_touch_after_read(key, std::move(ticket))) return {404, "(nil)"};
+        return {200, result_dump};
+    }
+    HandlerResult _handle_json_agg(const std::vector<std::string>& args) {
+        if (args.size() < 2) return {400, "-ERR wrong number of arguments"};
+        const auto& key = args[0];
+        HandlerResult error;
+        auto plan = _query_plan("AGG", args, error);
+        if (!plan) return error;
+        const JsonPredicate& where = plan->where;
+        const size_t width = plan->aggregates.size();
+        // One row of accumulators per group, in order of first appearance; a single row without GROUP BY.
+        std::vector<std::pair<json, std::vector<JsonAccumulator>>> rows;
+        std::unordered_map<std::string, size_t> row_of;
+        if (!plan->has_group) rows.emplace_back(json(), std::vector<JsonAccumulator>(width));
+        auto row_for = [&](json group) -> std::vector<JsonAccumulator>& {
+            if (!plan->has_group) return rows[0].second;
+            auto inserted = row_of.emplace(JsonFieldIndex::key_for(group), rows.size());
+            if (inserted.second) rows.emplace_back(std::move(group), std::vector<JsonAccumulator>(width));
+            return rows[inserted.first->second].second;
+        };
+        ReadTicket ticket;
+        {
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            auto entry_it = kv_store_.find(key);
+            if (entry_it == kv_store_.end()) return {404, "(nil)"};
+            const ValueEntry& entry = entry_it->second;
+            ticket = _ticket_for(entry);
+            if (entry.nkb && !entry.doc) {
+                std::string scratch;
+                std::unique_ptr<nkb::Document> doc;
+                try { doc = std::make_unique<nkb::Document>(_payload_view(entry, scratch, &ticket.spilled_bytes)); } catch (...) { return {500, "-ERR not a valid JSON document"}; }
+                nkb::Value root = doc->root();
+                if (!root.is_array()) return {400, "-ERR JSON.AGG can only be used on JSON arrays."};
+                auto binding = plan->bind(*doc);
+                auto value_of = [&](const nkb::Value& item, const JsonFieldPath& field) { nkb::Value v = field.resolve(item, binding[field.slot]); return v ? v.to_json() : json(nullptr); };
+                _for_each_match(*plan, key, root.size(), [&](size_t pos) { return root.at(pos); },
+                    [&](const nkb::Value& item) { return !plan->has_where || where.matches(item, binding); },
+                    [&](const nkb::Value& item) {
+                        auto& row = row_for(plan->has_group ? value_of(item, plan->group_by) : json());
+                        for (size_t i = 0; i < width; ++i) row[i].add(value_of(item, plan->aggregates[i].field));
+                        return true;
+                    });
+            } else {
+                const json* doc_ptr;
+                try { doc_ptr = &_doc_for_read(entry, ticket); } catch (...) { return {500, "-ERR not a valid JSON document"}; }
+                const json& doc = *doc_ptr;
+                if (!doc.is_array()) return {400, "-ERR JSON.AGG can only be used on JSON arrays."};
+                static const json missing;
+                auto value_of = [&](const json& item, const JsonFieldPath& field) -> const json& { const json* v = field.resolve(item); return v ? *v : missing; };
+                _for_each_match(*plan, key, doc.size(), [&](size_t pos) -> const json& { return doc[pos]; },
+                    [&](const json& item) { return !plan->has_where || where.matches(item); },
+                    [&](const json& item) {
+                        auto& row = row_for(plan->has_group ? value_of(item, plan->group_by) : json());
+                        for (size_t i = 0; i < width; ++i) row[i].add(value_of(item, plan->aggregates[i].field));
+                        return true;
+                    });
+            }
+        }
+        if (!_touch_after_read(key, std::move(ticket))) return {404, "(nil)"};
+        auto render = [&](const std::vector<JsonAccumulator>& row, json& out) { for (size_t i = 0; i < width; ++i) out[plan->aggregates[i].label] = row[i].result(plan->aggregates[i].function); };
+        if (!plan->has_group) { json result = json::object(); render(rows[0].second, result); return {200, _render(result)}; }
+        json result = json::array();
+        for (auto& row : rows) { json out = json::object(); out[_clean_path_key(plan->group_by.text)] = std::move(row.first); render(row.second, out); result.push_back(std::move(out)); }
+        return {200, _render(result)};
+    }
+    HandlerResult _handle_json_update(const std::vector<std::string>& args) {
+        if (args.empty()) return {400, "-ERR invalid syntax for JSON.UPDATE"};
+        const std::string& key = args[0];
+        HandlerResult error;
+        auto plan = _query_plan("UPDATE", args, error);
+        if (!plan) return error;
+        const JsonPredicate& where = plan->where;
+        const auto& assignments = plan->assignments;
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        auto entry_it = kv_store_.find(key);
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        json* doc; try { doc = &_doc_for_write_unlocked(entry_it); } catch(...) { return {500, "-ERR not a valid JSON document"}; }
+        if (!doc->is_array()) return {400, "-ERR `WHERE` clause can only be used on JSON arrays."};
+        int updated_count = 0; long long delta_bytes = 0;
+        bool text_index = text_indexes_.count(key) > 0, trigram_index = trigram_indexes_.count(key) > 0, position_index = vector_indexes_.count(key) > 0 || geo_indexes_.count(key) > 0;
+        auto update_item = [&](uint32_t pos) {
+            json& item = (*doc)[pos];
+            if (!where.matches(item)) return;
+            delta_bytes -= estimate_json_bytes(item);
+            JsonTextIndex::WordCounts old_words;
+            if (text_index) JsonTextIndex::collect(item, old_words);
+            json old_item;
+            if (trigram_index) old_item = item;
+            auto assign = [&](std::map<std::string, JsonFieldIndex>* indexes) {
+                for (const auto& assignment : assignments) {
+                    JsonFieldIndex* index = nullptr;
+                    if (indexes) { auto found = indexes->find(assignment.first); if (found != indexes->end()) index = &found->second; }
+                    if (index) { auto old = item.find(assignment.first); if (old != item.end()) index->remove(*old, pos); index->add(assignment.second, pos); }
+                    item[assignment.first] = assignment.second;
+                }
+            };
+            if (json_indexes_.count(key)) _update_indexes_unlocked(key, [&](std::map<std::string, JsonFieldIndex>& indexes) { assign(&indexes); });
+            else assign(nullptr);
+            if (text_index) { JsonTextIndex::WordCounts new_words; JsonTextIndex::collect(item, new_words); _update_text_index_unlocked(key, [&](JsonTextIndex& index) { index.remove(old_words, pos); index.add(new_words, pos); }); }
+            if (trigram_index || position_index) _reindex_item_unlocked(key, old_item, item, pos);
+            delta_bytes += estimate_json_bytes(item);
+            updated_count++;
+        };
+        // With indexes covering the WHERE clause only the candidate positions are visited.
+        std::vector<uint32_t> candidates;
+        if (_index_candidates(key, where, doc->size(), candidates)) { for (uint32_t pos : candidates) if (pos < doc->size()) update_item(pos); }
+        else for (size_t pos = 0; pos < doc->size(); ++pos) update_item(static_cast<uint32_t>(pos));
+        if (updated_count == 0) return {200, "0"};
+        _doc_modified_unlocked(entry_it, delta_bytes);
+        dirty_operations_++; _enforce_memory_limit(); if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME);
+        return {200, std::to_string(updated_count)};
+    }
+    HandlerResult _handle_json_del(const std::vector<std::string>& args) {
+        if (args.empty()) return {400, "-ERR wrong number of arguments"};
+        if (args.size() == 1) return _handle_del(args);
+        const auto& key = args[0];
+        HandlerResult error;
+        auto plan = _query_plan("DEL", args, error);
+        if (!plan) return error;
+        const JsonPredicate& where = plan->where;
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        auto entry_it = kv_store_.find(key);
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        // An index answers "nothing matches" without touching the document.
+        std::vector<uint32_t> candidates;
+        if (_index_candidates(key, where, 0, candidates) && candidates.empty()) return {200, "0"};
+        json* doc; try { doc = &_doc_for_write_unlocked(entry_it); } catch (...) { return {500, "-ERR not a valid JSON document"}; }
+        if (!doc->is_array()) return {400, "-ERR WHERE clause can only be used on JSON arrays."};
+        auto original_array_size = doc->size(); long long removed_bytes = 0;
+        doc->erase(std::remove_if(doc->begin(), doc->end(), [&](const json& item) { bool match = where.matches(item); if (match) removed_bytes += estimate_json_bytes(item); return match; }), doc->end());
+        auto deleted_count = original_array_size - doc->size();
+        if (deleted_count == 0) return {200, "0"};
+        // Every later element has shifted, so positions are renumbered from scratch.
+        _rebuild_indexes_unlocked(entry_it);
+        _doc_modified_unlocked(entry_it, -removed_bytes);
+        dirty_operations_++; _enforce_memory_limit(); if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME);
+        return {200, std::to_string(deleted_count)};
+    }
+    // ** UPDATED: The new high-performance, whole-word JSON search implementation **
+    HandlerResult _handle_json_search(const std::vector<std::string>& args) {
+        // Syntax: JSON.SEARCH <key> "<term>" [MAX <count>] [CURSOR <cursor>] [RANK] [PREFIX] [FUZZY <edits>]
+        const std::string syntax = "-ERR syntax: JSON.SEARCH <key> \"<term>\" [MAX <count>] [CURSOR <cursor>] [RANK] [PREFIX] [FUZZY <edits>]";
+        if (args.size() < 2) {
+            return {400, syntax};
+        }
+        
+        const auto& key = args[0];
+        const auto& term = args[1];
+        if (term.empty()) {
+            return {400, "-ERR search term cannot be empty"};
+        }
+
+        size_t max_results = std::numeric_limits<size_t>::max(); // Default to all matches
+        size_t cursor = 0;
+        bool paged = false; // CURSOR given: reply with one page of MAX (or CURSOR_DEFAULT_LIMIT) matches and the next cursor
+        bool rank = false, prefix = false, querying = false; // RANK, PREFIX or FUZZY: the term is a TextQuery
+        size_t fuzzy = 0;
+        for (size_t i = 2; i < args.size(); i += 2) {
+            std::string mode = args[i];
+            std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+            if (mode == "RANK" || mode == "PREFIX") {
+                (mode == "RANK" ? rank : prefix) = true;
+                querying = true;
+                --i;
+                continue;
+            }
+            if (i + 1 >= args.size()) return {400, syntax};
+            if (mode == "FUZZY") {
+                if (!_parse_count(args[i + 1], fuzzy) || fuzzy > 2) return {400, "-ERR FUZZY edits must be 0, 1 or 2"};
+                querying = true;
+                continue;
+            }
+            if (mode == "CURSOR") {
+                if (!_parse_count(args[i + 1], cursor)) return {400, "-ERR CURSOR must be a non-negative integer"};
+                paged = true;
+                continue;
+            }
+            if (mode != "MAX" && mode != "LIMIT") {
+                return {400, "-ERR expected MAX, CURSOR, RANK, PREFIX or FUZZY keyword after term"};
+            }
+            try {
+                long long count = std::stoll(args[i + 1]);
+                if (count <= 0) {
+                     return {400, "-ERR MAX count must be a positive integer"};
+                }
+                max_results = static_cast<size_t>(count);
+            } catch (...) {
+                return {400, "-ERR invalid number for MAX count"};
+            }
+        }
+        if (rank && paged) return {400, "-ERR CURSOR cannot be combined with RANK"};
+        TextQuery query;
+        if (querying && !TextQuery::parse(term, query)) return {400, "-ERR search query has no words"};
+        if (paged && max_results == std::numeric_limits<size_t>::max()) max_results = CURSOR_DEFAULT_LIMIT;
+
+        // Matches are written one element at a time; on a STREAM ON connection they leave in frames as they are found.
+        ArrayWriter writer(response_format_);
+        json page = json::array();
+        bool streaming = response_stream_ && !paged && !rank && writer.can_take();
+        auto full = [&] { return streaming && writer.buffered() >= STREAM_FRAME_BYTES; };
+        auto sink = [&](const json& item) { if (paged) page.push_back(item); else writer.push(item); };
+        ElementWalk walk;
+        auto run = [&](size_t size, auto match, auto emit) {
+            if (walk.holds == 0) {
+                // With a text index only elements holding every word of the term are checked, in array order,
+                // so MAX stops the work as soon as enough matches are confirmed.
+                auto text_it = text_indexes_.find(key);
+                std::vector<uint32_t> candidates;
+                bool use_index = text_it != text_indexes_.end() && text_it->second.candidates(term, candidates);
+                _start_walk(walk, size, cursor, 0, max_results, paged, use_index ? &candidates : nullptr, match);
+            }
+            return _continue_walk(walk, size, match, emit, full);
+        };
+        // A query is answered from the text index, which alone decides matches unless a phrase has to be verified
+        // on the element. Unranked, matches come in array order through the same walk (so CURSOR and STREAM work as
+        // usual); with RANK the candidates are scored with BM25 and a heap of MAX entries keeps the best without
+        // sorting the rest.
+        bool exact = false;
+        auto answer = [&](const JsonTextIndex& index, size_t size, auto at) {
+            auto match = [&](size_t pos) { return query.matches(index, static_cast<uint32_t>(pos), at(pos)); };
+            auto emit = [&](size_t pos) { const auto& item = at(pos); if constexpr (std::is_same_v<std::decay_t<decltype(item)>, json>) sink(item); else sink(item.to_json()); };
+            if (walk.holds == 0) { query.expand(index, prefix, static_cast<int>(fuzzy)); exact = query.exact(); }
+            if (!rank) {
+                // Later holds recheck positions in full: the document may have changed in between.
+                auto check = [&](size_t pos) { return (exact && walk.holds == 0) || match(pos); };
+                if (walk.holds == 0) { std::vector<uint32_t> candidates = query.candidates(index); _start_walk(walk, size, cursor, 0, max_results, paged, &candidates, check); }
+                return _continue_walk(walk, size, check, emit, full);
+            }
+            using Scored = std::pair<double, uint32_t>;
+            auto better = [](const Scored& a, const Scored& b) { return a.first > b.first || (a.first == b.first && a.second < b.second); };
+            std::priority_queue<Scored, std::vector<Scored>, decltype(better)> best(better); // top: the worst kept
+            std::vector<uint32_t> candidates = query.candidates(index);
+            bool sweep = candidates.size() * query.scored.size() > query.postings_size(index);
+            std::vector<double> scores = sweep ? query.scores(index) : std::vector<double>();
+            for (uint32_t pos : candidates) {
+                if (pos >= size || (!exact && !match(pos))) continue;
+                Scored scored{sweep ? scores[pos] : query.score(index, pos), pos};
+                if (best.size() < max_results) best.push(scored);
+                else if (better(scored, best.top())) { best.pop(); best.push(scored); }
+            }
+            std::vector<Scored> ranked;
+            for (; !best.empty(); best.pop()) ranked.push_back(best.top());
+            for (auto it = ranked.rbegin(); it != ranked.rend(); ++it) emit(it->second);
+            return true;
+        };
+        ReadTicket ticket;
+        HandlerResult status = _read_in_holds(key, writer, ticket, [&](const json* doc, const nkb::Document* binary, HandlerResult& error) {
+            if (querying) {
+                auto text_it = text_indexes_.find(key);
+                if (text_it == text_indexes_.end()) { error = {400, "-ERR RANK, PREFIX and FUZZY need a text index: JSON.FTINDEX CREATE " + key}; return true; }
+                // The text index covers array elements; any other document has nothing to rank.
+                if (binary) { nkb::Value root = binary->root(); return !root.is_array() || answer(text_it->second, root.size(), [&](size_t pos) { return root.at(pos); }); }
+                return !doc->is_array() || answer(text_it->second, doc->size(), [&](size_t pos) -> const json& { return (*doc)[pos]; });
+            }
+            if (binary) {
+                // Binary JSON is searched in place, one element at a time
+                nkb::Value root = binary->root();
+                if (!root.is_array()) { if (walk.holds == 0 && nkb::contains_word(root, term)) sink(root.to_json()); return true; }
+                return run(root.size(), [&](size_t pos) { return nkb::contains_word(root.at(pos), term); }, [&](size_t pos) { sink(root.at(pos).to_json()); });
+            }
+            // Served from the cached document; only a cold key is parsed (and then kept by _touch_after_read)
+            if (!doc->is_array()) {
+                // If the doc is a single object or value (and not one written over an array between frames)
+                if (walk.holds == 0 && json_contains_word(*doc, term)) sink(*doc);
+                return true;
+            }
+            return run(doc->size(), [&](size_t pos) { return json_contains_word((*doc)[pos], term); }, [&](size_t pos) { sink((*doc)[pos]); });
+        });
+        if (status.first) return status;
+
+        // Update LRU cache (and promote the value if it was read back from disk). For client-side consistency,
+        // the result is always a JSON array of matches.
+        const std::string no_matches = "(nil)";
+        return _finish_walk(key, std::move(ticket), writer, paged, walk, page, &no_matches);
+    }
+    // Chooses the keys JSON.FIND evaluates. As in _index_candidates, every AND group must contribute its cheapest
+    // indexed equality or IN condition, here from a collection index whose prefix covers the query's; if some group
+    // has none, returns false and the caller scans the keys. Otherwise `out` receives the sorted union of the
+    // candidate keys under `prefix`, still to be checked in full.
+    bool _collection_candidates(const std::string& prefix, const JsonPredicate& where, std::vector<std::string>& out) const {
+        if (collection_indexes_.empty() || where.groups.empty()) return false;
+        std::vector<const std::set<std::string>*> lists;
+        for (const auto& group : where.groups) {
+            size_t best_cost = std::numeric_limits<size_t>::max();
+            std::vector<const std::set<std::string>*> best;
+            for (const auto& condition : group) {
+                for (const auto& index : collection_indexes_) {
+                    if (!index.covers(prefix) || !index.serves(condition)) continue;
+                    std::vector<const std::set<std::string>*> buckets;
+                    size_t cost = 0;
+                    for (const auto& index_key : condition.index_keys) { auto bucket = index.keys.find(index_key); if (bucket != index.keys.end()) { buckets.push_back(&bucket->second); cost += bucket->second.size(); } }
+                    if (cost < best_cost) { best_cost = cost; best = std::move(buckets); }
+                }
+            }
+            if (best_cost == std::numeric_limits<size_t>::max()) return false;
+            lists.insert(lists.end(), best.begin(), best.end());
+        }
+        out.clear();
+        for (const auto* list : lists) for (auto it = list->lower_bound(prefix); it != list->end() && it->compare(0, prefix.size(), prefix) == 0; ++it) out.push_back(*it);
+        if (lists.size() > 1) { std::sort(out.begin(), out.end()); out.erase(std::unique(out.begin(), out.end()), out.end()); }
+        return true;
+    }
+    // JSON.FIND <prefix> [WHERE ...]: treats the keys starting with `prefix` as one collection and returns the matching
+    // documents (or their FIELDS) as an object keyed by key, in key order. Values that are not JSON are skipped.
+    HandlerResult _handle_json_find(const std::vector<std::string>& args) {
+        if (args.empty()) return {400, "-ERR wrong number of arguments"};
+        const auto& prefix = args[0];
+        HandlerResult error;
+        auto plan = _query_plan("FIND", args, error);
+        if (!plan) return error;
+        const JsonPredicate& where = plan->where;
+        json results = json::object();
+        std::vector<std::string> found;
+        {
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            std::vector<std::string> keys;
+            if (!plan->has_where || !_collection_candidates(prefix, where, keys)) {
+                for (const auto& pair : kv_store_) if (pair.first.compare(0, prefix.size(), prefix) == 0) keys.push_back(pair.first);
+                std::sort(keys.begin(), keys.end());
+            }
+            size_t skipped = 0;
+            for (const auto& key : keys) {
+                if (found.size() >= plan->limit) break;
+                auto it = kv_store_.find(key);
+                if (it == kv_store_.end()) continue;
+                const ValueEntry& entry = it->second;
+                json value;
+                try {
+                    if (entry.nkb && !entry.doc) {
+                        // Binary JSON: evaluate on the offset tables and decode only what is returned.
+                        std::string scratch;
+                        nkb::Document doc(_payload_view(entry, scratch));
+                        nkb::Value root = doc.root();
+                        auto binding = plan->bind(doc);
+                        if (plan->has_where && !where.matches(root, binding)) continue;
+                        if (skipped < plan->offset) { skipped++; continue; }
+                        if (plan->fields.empty()) value = root.to_json();
+                        else { value = json::object(); for (const auto& field : plan->fields) { nkb::Value v = field.resolve(root, binding[field.slot]); value[_clean_path_key(field.text)] = v ? v.to_json() : json(nullptr); } }
+                    } else {
+                        // A document the cache does not hold is parsed for this request only, not installed: one
+                        // query over a collection would otherwise push every other document out of the cache.
+                        json parsed;
+                        const json* doc = entry.doc.get();
+                        if (!doc) { parsed = _parse_value(entry); doc = &parsed; }
+                        if (plan->has_where && !where.matches(*doc)) continue;
+                        if (skipped < plan->offset) { skipped++; continue; }
+                        if (plan->fields.empty()) value = doc == &parsed ? std::move(parsed) : *doc;
+                        else { value = json::object(); for (const auto& field : plan->fields) { const json* v = field.resolve(*doc); value[_clean_path_key(field.text)] = v ? *v : json(nullptr); } }
+                    }
+                } catch (...) { continue; }
+                results[key] = std::move(value);
+                found.push_back(key);
+            }
+        }
+        if (CACHING_ENABLED && max_memory_bytes_ > 0 && !found.empty()) {
+            std::unique_lock<std::shared_mutex> lock(data_mutex_);
+            for (const auto& key : found) if (kv_store_.count(key)) _update_lru(key);
+        }
+        if (found.empty()) return {404, _render(json::object())};
+        return {200, _render(results)};
+    }
+    HandlerResult _handle_json_append(const std::vector<std::string>& args) {
+        if (args.size() != 2) return {400, "-ERR wrong number of arguments. Syntax: JSON.APPEND <key> '<json_to_append>'"};
+        const auto& key = args[0];
+        std::string minified;
+        jsonscan::Info info;
+        if (!jsonscan::minify(args[1], minified, &info)) return {400, "-ERR invalid JSON for append: " + _json_error(args[1])};
+        if (info.root != '{' && info.root != '[') return {400, "-ERR append value must be a JSON object or array"};
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        auto entry_it = kv_store_.find(key);
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        // With no indexes to maintain, the compacted text is spliced into a text array as is.
+        if (!_has_indexes(key)) {
+            size_t count = info.root == '[' ? info.items : 1;
+            long long old_size = _append_text_unlocked(entry_it, info.root == '[' ? std::string_view(minified).substr(1, minified.size() - 2) : std::string_view(minified), count);
+            if (old_size >= 0) {
+                dirty_operations_++;
+                _enforce_memory_limit();
+                if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME);
+                return {200, std::to_string(old_size + static_cast<long long>(count))};
+            }
+        }
+        lock.unlock();
+        std::vector<json> items;
+        {
+            json new_json = json::parse(minified);
+            if (new_json.is_object()) items.push_back(std::move(new_json));
+            else { items.reserve(new_json.size()); for (auto& item : new_json) items.push_back(std::move(item)); }
+        }
+        lock.lock();
+        entry_it = kv_store_.find(key);
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        long long old_size = _append_in_place_unlocked(entry_it, items);
+        if (old_size < 0) {
+            json* doc;
+            try { doc = &_doc_for_write_unlocked(entry_it); } catch (...) { return {500, "-ERR value at key is not a valid JSON document"}; }
+            if (!doc->is_array()) return {400, "-ERR APPEND requires the value at key to be a JSON array"};
+            const auto& arr = doc->get_ref<const json::array_t&>();
+            long long delta_bytes = -static_cast<long long>((arr.capacity() - arr.size()) * sizeof(json));
+            old_size = static_cast<long long>(doc->size());
+            for (const auto& item : items) { delta_bytes += estimate_json_bytes(item); doc->push_back(item); }
+            delta_bytes += static_cast<long long>((arr.capacity() - arr.size()) * sizeof(json));
+            _doc_modified_unlocked(entry_it, delta_bytes);
+        }
+        _update_indexes_unlocked(key, [&](std::map<std::string, JsonFieldIndex>& indexes) { for (auto& pair : indexes) for (size_t i = 0; i < items.size(); ++i) { if (!items[i].is_object()) continue; auto f = items[i].find(pair.first); if (f != items[i].end()) pair.second.add(*f, static_cast<uint32_t>(old_size + i)); } });
+        _update_text_index_unlocked(key, [&](JsonTextIndex& index) { for (size_t i = 0; i < items.size(); ++i) index.add_item(items[i], static_cast<uint32_t>(old_size + i)); });
+        _update_trigram_indexes_unlocked(key, [&](std::map<std::string, JsonTrigramIndex>& indexes) { for (auto& pair : indexes) for (size_t i = 0; i < items.size(); ++i) pair.second.add_item(items[i], static_cast<uint32_t>(old_size + i)); });
+        _update_vector_indexes_unlocked(key, [&](std::map<std::string, JsonVectorIndex>& indexes) { for (auto& pair : indexes) for (size_t i = 0; i < items.size(); ++i) pair.second.add_item(items[i], static_cast<uint32_t>(old_size + i)); });
+        _update_geo_indexes_unlocked(key, [&](std::map<std::string, JsonGeoIndex>& indexes) { for (auto& pair : indexes) for (size_t i = 0; i < items.size(); ++i) pair.second.add_item(items[i], static_cast<uint32_t>(old_size + i)); });
+        dirty_operations_++;
+        _enforce_memory_limit();
+        if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME);
+        return {200, std::to_string(old_size + static_cast<long long>(items.size()))};
+    }
+    HandlerResult _handle_json_index(const std::vector<std::string>& args) {
+        // Syntax: JSON.INDEX CREATE|DROP <key> <field> | JSON.INDEX LIST <key>
+        const std::string syntax = "-ERR syntax: JSON.INDEX CREATE|DROP <key> <field> | JSON.INDEX LIST <key>";
+        if (args.size() < 2) return {400, syntax};
+        std::string sub = args[0];
+        std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+        const auto& key = args[1];
+        if (sub == "LIST") {
+            if (args.size() != 2) return {400, syntax};
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            auto it = json_indexes_.find(key);
+            if (it == json_indexes_.end()) return {404, "(nil)"};
+            json list = json::array();
+            for (const auto& pair : it->second) list.push_back({{"field", pair.first}, {"distinct_values", pair.second.positions.size()}, {"memory", format_memory_size(pair.second.bytes)}});
+            return {200, _render(list)};
+        }
+        if ((sub != "CREATE" && sub != "DROP") || args.size() != 3) return {400, syntax};
+        const auto& field = args[2];
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        if (sub == "DROP") {
+            auto it = json_indexes_.find(key);
+            if (it == json_indexes_.end() || !it->second.count(field)) return {200, "0"};
+            _update_indexes_unlocked(key, [&](std::map<std::string, JsonFieldIndex>& indexes) { indexes.erase(field); });
+            if (it->second.empty()) json_indexes_.erase(it);
+            dirty_operations_++;
+            return {200, "1"};
+        }
+        auto entry_it = kv_store_.find(key);
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        if (_find_index(key, field)) return {400, "-ERR index already exists"};
+        _create_index_unlocked(entry_it, field);
+        dirty_operations_++;
+        _enforce_memory_limit();
+        size_t indexed = 0;
+        for (const auto& bucket : json_indexes_[key][field].positions) indexed += bucket.second.size();
+        return {200, "+OK indexed " + std::to_string(indexed) + " item(s) on '" + field + "'."};
+    }
+    HandlerResult _handle_json_ftindex(const std::vector<std::string>& args) {
+        // Syntax: JSON.FTINDEX CREATE|DROP <key>
+        if (args.size() != 2) return {400, "-ERR syntax: JSON.FTINDEX CREATE|DROP <key>"};
+        std::string sub = args[0];
+        std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+        const auto& key = args[1];
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        if (sub == "DROP") {
+            auto it = text_indexes_.find(key);
+            if (it == text_indexes_.end()) return {200, "0"};
+            unsigned long long bytes = sizeof(JsonTextIndex) + it->second.bytes;
+            estimated_memory_usage_ -= bytes; json_index_bytes_ -= bytes;
+            text_indexes_.erase(it);
+            result_cache_.drop(key); // RANK, PREFIX and FUZZY replies need the index
+            dirty_operations_++;
+            return {200, "1"};
+        }
+        if (sub != "CREATE") return {400, "-ERR syntax: JSON.FTINDEX CREATE|DROP <key>"};
+        auto entry_it = kv_store_.find(key);
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        if (text_indexes_.count(key)) return {400, "-ERR text index already exists"};
+        text_indexes_[key];
+        estimated_memory_usage_ += sizeof(JsonTextIndex); json_index_bytes_ += sizeof(JsonTextIndex);
+        _rebuild_indexes_unlocked(entry_it);
+        result_cache_.drop(key);
+        dirty_operations_++;
+        _enforce_memory_limit();
+        const JsonTextIndex& index = text_indexes_[key];
+        return {200, "+OK indexed " + std::to_string(index.postings.size()) + " distinct word(s) across " + std::to_string(index.items) + " item(s)."};
+    }
+    HandlerResult _handle_json_trigram(const std::vector<std::string>& args) {
+        // Syntax: JSON.TRIGRAM CREATE|DROP <key> <field> | JSON.TRIGRAM CREATE|DROP KEYS | JSON.TRIGRAM LIST <key>
+        const std::string syntax = "-ERR syntax: JSON.TRIGRAM CREATE|DROP <key> <field> | JSON.TRIGRAM CREATE|DROP KEYS | JSON.TRIGRAM LIST <key>";
+        if (args.size() < 2) return {400, syntax};
+        std::string sub = _upper(args[0]);
+        const auto& key = args[1];
+        if (sub == "LIST") {
+            if (args.size() != 2) return {400, syntax};
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            auto it = trigram_indexes_.find(key);
+            if (it == trigram_indexes_.end()) return {404, "(nil)"};
+            json list = json::array();
+            for (const auto& pair : it->second) list.push_back({{"field", pair.first}, {"trigrams", pair.second.postings.size()}, {"items", pair.second.items}, {"memory", format_memory_size(pair.second.bytes)}});
+            return {200, _render(list)};
+        }
+        if ((sub != "CREATE" && sub != "DROP") || args.size() > 3) return {400, syntax};
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        if (args.size() == 2) {
+            // Over key names, for KEYS.MATCH.
+            if (_upper(key) != "KEYS") return {400, syntax};
+            if (sub == "DROP") {
+                if (!key_trigrams_) return {200, "0"};
+                estimated_memory_usage_ -= key_trigrams_->bytes; json_index_bytes_ -= key_trigrams_->bytes;
+                key_trigrams_.reset();
+                dirty_operations_++;
+                return {200, "1"};
+            }
+            if (key_trigrams_) return {400, "-ERR key trigram index already exists"};
+            key_trigrams_ = std::make_unique<KeyTrigramIndex>();
+            _update_key_trigrams_unlocked([&](KeyTrigramIndex& index) { _fill_key_trigrams_unlocked(index); });
+            dirty_operations_++;
+            _enforce_memory_limit();
+            return {200, "+OK indexed " + std::to_string(key_trigrams_->ids.size()) + " key(s)."};
+        }
+        const auto& field = args[2];
+        if (sub == "DROP") {
+            auto it = trigram_indexes_.find(key);
+            if (it == trigram_indexes_.end() || !it->second.count(field)) return {200, "0"};
+            _update_trigram_indexes_unlocked(key, [&](std::map<std::string, JsonTrigramIndex>& indexes) { indexes.erase(field); });
+            if (it->second.empty()) trigram_indexes_.erase(it);
+            dirty_operations_++;
+            return {200, "1"};
+        }
+        auto entry_it = kv_store_.find(key);
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        if (_find_trigram_index(key, field)) return {400, "-ERR trigram index already exists"};
+        try { JsonFieldPath::parse(field); } catch (...) { return {400, "-ERR invalid field path '" + field + "'"}; }
+        _create_trigram_index_unlocked(entry_it, field);
+        dirty_operations_++;
+        _enforce_memory_limit();
+        return {200, "+OK indexed " + std::to_string(_find_trigram_index(key, field)->items) + " item(s) on '" + field + "'."};
+    }
+    // Parses the SUBSTR|REGEX "<pattern>" [MAX <count>] [CURSOR <cursor>] tail shared by JSON.MATCH and KEYS.MATCH.
+    bool _parse_match_args(const std::vector<std::string>& args, size_t i, bool cursor_allowed, StringMatcher& matcher, size_t& max_results, size_t& cursor, bool& paged, HandlerResult& error) {
+        std::string message;
+        if (!StringMatcher::parse(args[i], args[i + 1], matcher, message)) { error = {400, "-ERR " + message}; return false; }
+        for (i += 2; i < args.size(); i += 2) {
+            std::string mode = _upper(args[i]);
+            if (i + 1 >= args.size() || (mode != "MAX" && mode != "LIMIT" && (mode != "CURSOR" || !cursor_allowed))) { error = {400, cursor_allowed ? "-ERR expected MAX or CURSOR after the pattern" : "-ERR expected MAX after the pattern"}; return false; }
+            size_t value;
+            if (!_parse_count(args[i + 1], value) || (mode != "CURSOR" && value == 0)) { error = {400, "-ERR " + mode + " must be a " + (mode == "CURSOR" ? "non-negative" : "positive") + " integer"}; return false; }
+            if (mode == "CURSOR") { cursor = value; paged = true; }
+            else max_results = value;
+        }
+        if (paged && max_results == std::numeric_limits<size_t>::max()) max_results = CURSOR_DEFAULT_LIMIT;
+        return true;
+    }
+    const JsonTrigramIndex* _find_trigram_index(const std::string& key, const std::string& field) const {
+        auto it = trigram_indexes_.find(key);
+        if (it == trigram_indexes_.end()) return nullptr;
+        auto f = it->second.find(field);
+        return f == it->second.end() ? nullptr : &f->second;
+    }
+    HandlerResult _handle_json_match(const std::vector<std::string>& args) {
+        // Syntax: JSON.MATCH <key> <field> SUBSTR|REGEX "<pattern>" [MAX <count>] [CURSOR <cursor>]
+        if (args.size() < 4) return {400, "-ERR syntax: JSON.MATCH <key> <field> SUBSTR|REGEX \"<pattern>\" [MAX <count>] [CURSOR <cursor>]"};
+        const auto& key = args[0];
+        JsonFieldPath field;
+        try { field = JsonFieldPath::parse(args[1]); } catch (...) { return {400, "-ERR invalid field path '" + args[1] + "'"}; }
+        StringMatcher matcher;
+        size_t max_results = std::numeric_limits<size_t>::max(), cursor = 0;
+        bool paged = false;
+        HandlerResult error;
+        if (!_parse_match_args(args, 2, true, matcher, max_results, cursor, paged, error)) return error;
+
+        ArrayWriter writer(response_format_);
+        json page = json::array();
+        bool streaming = response_stream_ && !paged && writer.can_take();
+        auto full = [&] { return streaming && writer.buffered() >= STREAM_FRAME_BYTES; };
+        auto sink = [&](const json& item) { if (paged) page.push_back(item); else writer.push(item); };
+        ElementWalk walk;
+        auto run = [&](size_t size, auto match, auto emit) {
+            if (walk.holds == 0) {
+                // With a trigram index on the field, only elements holding every trigram the pattern requires are checked.
+                const JsonTrigramIndex* index = _find_trigram_index(key, args[1]);
+                std::vector<uint32_t> candidates;
+                bool use_index = index && trigram::lookup(index->postings, matcher.required(), candidates);
+                _start_walk(walk, size, cursor, 0, max_results, paged, use_index ? &candidates : nullptr, match);
+            }
+            return _continue_walk(walk, size, match, emit, full);
+        };
+        ReadTicket ticket;
+        HandlerResult status = _read_in_holds(key, writer, ticket, [&](const json* doc, const nkb::Document* binary, HandlerResult&) {
+            if (binary) {
+                nkb::Value root = binary->root();
+                std::vector<long long> ids;
+                for (const auto& token : field.tokens) ids.push_back(binary->key_id(token));
+                auto matches = [&](const nkb::Value& item) { nkb::Value v = field.resolve(item, ids); return v && v.is_string() && matcher.matches(v.str()); };
+                if (!root.is_array()) { if (walk.holds == 0 && matches(root)) sink(root.to_json()); return true; }
+                return run(root.size(), [&](size_t pos) { return matches(root.at(pos)); }, [&](size_t pos) { sink(root.at(pos).to_json()); });
+            }
+            auto matches = [&](const json& item) { const json* v = field.resolve(item); return v && v->is_string() && matcher.matches(v->get_ref<const std::string&>()); };
+            if (!doc->is_array()) { if (walk.holds == 0 && matches(*doc)) sink(*doc); return true; } // not one written over the array between frames
+            return run(doc->size(), [&](size_t pos) { return matches((*doc)[pos]); }, [&](size_t pos) { sink((*doc)[pos]); });
+        });
+        if (status.first) return status;
+        const std::string no_matches = "(nil)";
+        return _finish_walk(key, std::move(ticket), writer, paged, walk, page, &no_matches);
+    }
+    HandlerResult _handle_keys_match(const std::vector<std::string>& args) {
+        // Syntax: KEYS.MATCH SUBSTR|REGEX "<pattern>" [MAX <count>]
+        if (args.size() < 2) return {400, "-ERR syntax: KEYS.MATCH SUBSTR|REGEX \"<pattern>\" [MAX <count>]"};
+        StringMatcher matcher;
+        size_t max_results = std::numeric_limits<size_t>::max(), cursor = 0;
+        bool paged = false;
+        HandlerResult error;
+        if (!_parse_match_args(args, 0, false, matcher, max_results, cursor, paged, error)) return error;
+        std::vector<std::string> found;
+        {
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            std::vector<uint32_t> ids;
+            if (key_trigrams_ && trigram::lookup(key_trigrams_->postings, matcher.required(), ids)) {
+                for (uint32_t id : ids) { const std::string& name = key_trigrams_->names[id]; if (!name.empty() && matcher.matches(name)) found.push_back(name); }
+            } else {
+                for (const auto& pair : kv_store_) if (matcher.matches(pair.first)) found.push_back(pair.first);
+            }
+        }
+        if (found.empty()) return {404, "(nil)"};
+        // Sorted by name; with MAX only the first names need ordering.
+        if (found.size() > max_results) { std::partial_sort(found.begin(), found.begin() + max_results, found.end()); found.resize(max_results); }
+        else std::sort(found.begin(), found.end());
+        return {200, _render(found)};
+    }
+    const JsonVectorIndex* _find_vector_index(const std::string& key, const std::string& field) const {
+        auto it = vector_indexes_.find(key);
+        if (it == vector_indexes_.end()) return nullptr;
+        auto f = it->second.find(field);
+        return f == it->second.end() ? nullptr : &f->second;
+    }
+    HandlerResult _handle_json_vindex(const std::vector<std::string>& args) {
+        // Syntax: JSON.VINDEX CREATE <key> <field> [METRIC L2|COSINE|DOT] | JSON.VINDEX DROP <key> <field> | JSON.VINDEX LIST <key>
+        const std::string syntax = "-ERR syntax: JSON.VINDEX CREATE <key> <field> [METRIC L2|COSINE|DOT] | JSON.VINDEX DROP <key> <field> | JSON.VINDEX LIST <key>";
+        if (args.size() < 2) return {400, syntax};
+        std::string sub = _upper(args[0]);
+        const auto& key = args[1];
+        if (sub == "LIST") {
+            if (args.size() != 2) return {400, syntax};
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            auto it = vector_indexes_.find(key);
+            if (it == vector_indexes_.end()) return {404, "(nil)"};
+            json list = json::array();
+            for (const auto& pair : it->second) list.push_back({{"field", pair.first}, {"metric", vectors::metric_name(pair.second.metric)}, {"dimensions", pair.second.dim}, {"vectors", pair.second.live}, {"memory", format_memory_size(pair.second.bytes)}});
+            return {200, _render(list)};
+        }
+        if (args.size() < 3) return {400, syntax};
+        const auto& field = args[2];
+        if (sub == "DROP") {
+            if (args.size() != 3) return {400, syntax};
+            std::unique_lock<std::shared_mutex> lock(data_mutex_);
+            auto it = vector_indexes_.find(key);
+            if (it == vector_indexes_.end() || !it->second.count(field)) return {200, "0"};
+            _update_vector_indexes_unlocked(key, [&](std::map<std::string, JsonVectorIndex>& indexes) { indexes.erase(field); });
+            if (it->second.empty()) vector_indexes_.erase(it);
+            result_cache_.drop(key); // cached JSON.VSEARCH replies came from the graph (and maybe another metric)
+            dirty_operations_++;
+            return {200, "1"};
+        }
+        if (sub != "CREATE" || (args.size() != 3 && args.size() != 5)) return {400, syntax};
+        vectors::Metric metric = vectors::Metric::L2;
+        if (args.size() == 5 && (_upper(args[3]) != "METRIC" || !vectors::parse_metric(args[4], metric))) return {400, "-ERR METRIC must be L2, COSINE or DOT"};
+        try { JsonFieldPath::parse(field); } catch (...) { return {400, "-ERR invalid field path '" + field + "'"}; }
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        auto entry_it = kv_store_.find(key);
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        if (_find_vector_index(key, field)) return {400, "-ERR vector index already exists"};
+        _create_vector_index_unlocked(entry_it, field, metric);
+        result_cache_.drop(key);
+        dirty_operations_++;
+        _enforce_memory_limit();
+        const JsonVectorIndex* index = _find_vector_index(key, field);
+        return {200, "+OK indexed " + std::to_string(index->live) + " vector(s) of " + std::to_string(index->dim) + " dimension(s) on '" + field + "'."};
+    }
+    HandlerResult _handle_json_vsearch(const std::vector<std::string>& args) {
+        // Syntax: JSON.VSEARCH <key> <field> <vector> K <k> [EF <n>] [EXACT] [METRIC L2|COSINE|DOT]
+        const std::string syntax = "-ERR syntax: JSON.VSEARCH <key> <field> <vector> K <k> [EF <n>] [EXACT] [METRIC L2|COSINE|DOT]";
+        if (args.size() < 5) return {400, syntax};
+        const auto& key = args[0];
+        JsonFieldPath field;
+        try { field = JsonFieldPath::parse(args[1]); } catch (...) { return {400, "-ERR invalid field path '" + args[1] + "'"}; }
+        std::vector<float> query;
+        try { if (!vectors::read(json::parse(args[2]), query) || query.empty()) throw std::invalid_argument("not a vector"); } catch (...) { return {400, "-ERR vector must be a non-empty JSON array of numbers"}; }
+        size_t k = 0, ef = 0;
+        bool exact = false, metric_given = false;
+        vectors::Metric metric = vectors::Metric::L2;
+        for (size_t i = 3; i < args.size(); i += 2) {
+            std::string mode = _upper(args[i]);
+            if (mode == "EXACT") { exact = true; --i; continue; }
+            if (i + 1 >= args.size()) return {400, syntax};
+            if (mode == "K") { if (!_parse_count(args[i + 1], k) || k == 0) return {400, "-ERR K must be a positive integer"}; }
+            else if (mode == "EF") { if (!_parse_count(args[i + 1], ef) || ef == 0) return {400, "-ERR EF must be a positive integer"}; }
+            else if (mode == "METRIC") { if (!vectors::parse_metric(args[i + 1], metric)) return {400, "-ERR METRIC must be L2, COSINE or DOT"}; metric_given = true; }
+            else return {400, "-ERR expected K, EF, EXACT or METRIC after the vector"};
+        }
+        if (k == 0) return {400, syntax};
+
+        // Nearest first, each as {"pos", "distance", "item"}. With a vector index on the field the graph is searched
+        // (or, with EXACT, every indexed vector compared); without one every element's vector is compared.
+        ArrayWriter writer(response_format_);
+        ReadTicket ticket;
+        HandlerResult status = _read_in_holds(key, writer, ticket, [&](const json* doc, const nkb::Document* binary, HandlerResult& error) {
+            nkb::Value root;
+            if (binary) root = binary->root();
+            size_t size = binary ? (root.is_array() ? root.size() : 0) : (doc->is_array() ? doc->size() : 0);
+            std::vector<vectors::Scored> hits;
+            const JsonVectorIndex* index = _find_vector_index(key, args[1]);
+            if (index) {
+                if (metric_given && metric != index->metric) { error = {400, std::string("-ERR the vector index on this field uses METRIC ") + vectors::metric_name(index->metric)}; return true; }
+                metric = index->metric;
+                if (index->dim && query.size() != index->dim) { error = {400, "-ERR vector has " + std::to_string(query.size()) + " dimension(s), the index holds " + std::to_string(index->dim)}; return true; }
+                if (!vectors::prepare(metric, query)) { error = {400, "-ERR a zero vector has no COSINE distance"}; return true; }
+                hits = exact ? index->exact(query.data(), k, vectors::best()) : index->search(query.data(), k, std::max(ef ? ef : VECTOR_EF_SEARCH, k));
+            } else {
+                if (!vectors::prepare(metric, query)) { error = {400, "-ERR a zero vector has no COSINE distance"}; return true; }
+                vectors::Nearest nearest(k);
+                std::vector<float> v;
+                auto offer = [&](size_t pos) { if (vectors::prepare(metric, v) && v.size() == query.size()) nearest.offer(vectors::distance(metric, vectors::best(), query.data(), v.data(), v.size()), static_cast<uint32_t>(pos)); };
+                if (binary) {
+                    std::vector<long long> ids;
+                    for (const auto& token : field.tokens) ids.push_back(binary->key_id(token));
+                    for (size_t pos = 0; pos < size; ++pos) { nkb::Value value = field.resolve(root.at(pos), ids); if (value && vectors::read(value, v)) offer(pos); }
+                } else {
+                    for (size_t pos = 0; pos < size; ++pos) { const json* value = field.resolve((*doc)[pos]); if (value && vectors::read(*value, v)) offer(pos); }
+                }
+                hits = nearest.sorted();
+            }
+            for (const auto& hit : hits) {
+                if (hit.second >= size) continue;
+                writer.push(json{{"pos", hit.second}, {"distance", vectors::reported(metric, hit.first)}, {"item", binary ? root.at(hit.second).to_json() : (*doc)[hit.second]}});
+            }
+            return true;
+        });
+        if (status.first) return status;
+        const std::string no_matches = "(nil)";
+        ElementWalk walk;
+        json page;
+        return _finish_walk(key, std::move(ticket), writer, false, walk, page, &no_matches);
+    }
+    HandlerResult _handle_json_geoindex(const std::vector<std::string>& args) {
+        // Syntax: JSON.GEOINDEX CREATE|DROP <key> <lat_field> <lon_field> | JSON.GEOINDEX LIST <key>
+        const std::string syntax = "-ERR syntax: JSON.GEOINDEX CREATE|DROP <key> <lat_field> <lon_field> | JSON.GEOINDEX LIST <key>";
+        if (args.size() < 2) return {400, syntax};
+        std::string sub = _upper(args[0]);
+        const auto& key = args[1];
+        if (sub == "LIST") {
+            if (args.size() != 2) return {400, syntax};
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            auto it = geo_indexes_.find(key);
+            if (it == geo_indexes_.end()) return {404, "(nil)"};
+            json list = json::array();
+            for (const auto& pair : it->second) list.push_back({{"lat", pair.second.lat_field.text}, {"lon", pair.second.lon_field.text}, {"points", pair.second.items}, {"memory", format_memory_size(pair.second.bytes)}});
+            return {200, _render(list)};
+        }
+        if ((sub != "CREATE" && sub != "DROP") || args.size() != 4) return {400, syntax};
+        const std::string name = _geo_name(args[2], args[3]);
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        if (sub == "DROP") {
+            auto it = geo_indexes_.find(key);
+            if (it == geo_indexes_.end() || !it->second.count(name)) return {200, "0"};
+            _update_geo_indexes_unlocked(key, [&](std::map<std::string, JsonGeoIndex>& indexes) { indexes.erase(name); });
+            if (it->second.empty()) geo_indexes_.erase(it);
+            result_cache_.drop(key); // JSON.GEORADIUS without FIELDS may now read other fields
+            dirty_operations_++;
+            return {200, "1"};
+        }
+        auto entry_it = kv_store_.find(key);
+        if (entry_it == kv_store_.end()) return {404, "(nil)"};
+        auto existing = geo_indexes_.find(key);
+        if (existing != geo_indexes_.end() && existing->second.count(name)) return {400, "-ERR geo index already exists"};
+        for (const auto& field : {args[2], args[3]}) { try { JsonFieldPath::parse(field); } catch (...) { return {400, "-ERR invalid field path '" + field + "'"}; } }
+        _create_geo_index_unlocked(entry_it, args[2], args[3]);
+        result_cache_.drop(key);
+        dirty_operations_++;
+        _enforce_memory_limit();
+        return {200, "+OK indexed " + std::to_string(geo_indexes_[key][name].items) + " point(s) on '" + args[2] + "', '" + args[3] + "'."};
+    }
+    HandlerResult _handle_json_georadius(const std::vector<std::string>& args) {
+        // Syntax: JSON.GEORADIUS <key> <lat> <lon> <radius> [M|KM|MI|FT] [LIMIT <count>] [FIELDS <lat_field> <lon_field>]
+        const std::string syntax = "-ERR syntax: JSON.GEORADIUS <key> <lat> <lon> <radius> [M|KM|MI|FT] [LIMIT <count>] [FIELDS <lat_field> <lon_field>]";
+        if (args.size() < 4) return {400, syntax};
+        const auto& key = args[0];
+        double lat, lon, radius, unit = 1;
+        try { size_t used; lat = std::stod(args[1], &used); if (used != args[1].size()) throw std::invalid_argument("lat"); lon = std::stod(args[2], &used); if (used != args[2].size()) throw std::invalid_argument("lon"); radius = std::stod(args[3], &used); if (used != args[3].size()) throw std::invalid_argument("radius"); } catch (...) { return {400, "-ERR latitude, longitude and radius must be numbers"}; }
+        if (!geo::valid(lat, lon)) return {400, "-ERR latitude must be within -90..90 and longitude within -180..180"};
+        if (!std::isfinite(radius) || radius < 0) return {400, "-ERR radius must be a non-negative number"};
+        size_t limit = std::numeric_limits<size_t>::max();
+        std::string lat_name, lon_name; // FIELDS, if given
+        for (size_t i = 4; i < args.size();) {
+            std::string mode = _upper(args[i]);
+            if (i == 4 && geo::parse_unit(mode, unit)) { ++i; continue; }
+            if (mode == "LIMIT" && i + 1 < args.size()) { if (!_parse_count(args[i + 1], limit) || limit == 0) return {400, "-ERR LIMIT must be a positive integer"}; i += 2; continue; }
+            if (mode == "FIELDS" && i + 2 < args.size()) { lat_name = args[i + 1]; lon_name = args[i + 2]; i += 3; continue; }
+            return {400, "-ERR expected a unit (M, KM, MI, FT), LIMIT or FIELDS after the radius"};
+        }
+        double radius_m = radius * unit;
+
+        // Nearest first, each as {"pos", "distance", "item"} with the distance in the query's unit. With a geo index
+        // only the points in the cells around the circle are measured; without one every element is.
+        ArrayWriter writer(response_format_);
+        ReadTicket ticket;
+        HandlerResult status = _read_in_holds(key, writer, ticket, [&](const json* doc, const nkb::Document* binary, HandlerResult& error) {
+            const JsonGeoIndex* index = nullptr;
+            auto indexes = geo_indexes_.find(key);
+            if (indexes != geo_indexes_.end()) {
+                if (!lat_name.empty()) { auto f = indexes->second.find(_geo_name(lat_name, lon_name)); if (f != indexes->second.end()) index = &f->second; }
+                else if (indexes->second.size() == 1) index = &indexes->second.begin()->second;
+                else { error = {400, "-ERR the key has several geo indexes: choose one with FIELDS <lat_field> <lon_field>"}; return true; }
+            }
+            JsonFieldPath lat_field, lon_field;
+            if (!index) {
+                try { lat_field = JsonFieldPath::parse(lat_name.empty() ? "lat" : lat_name); lon_field = JsonFieldPath::parse(lon_name.empty() ? "lon" : lon_name); }
+                catch (...) { error = {400, "-ERR invalid field path in FIELDS"}; return true; }
+            }
+            nkb::Value root;
+            if (binary) root = binary->root();
+            size_t size = binary ? (root.is_array() ? root.size() : 0) : (doc->is_array() ? doc->size() : 0);
+            std::vector<std::pair<double, uint32_t>> hits; // meters, position
+            auto offer = [&](size_t pos, double d) { hits.push_back({d, static_cast<uint32_t>(pos)}); };
+            auto measure = [&](size_t pos, double point_lat, double point_lon) { if (geo::valid(point_lat, point_lon)) { double d = geo::distance(lat, lon, point_lat, point_lon); if (d <= radius_m) offer(pos, d); } };
+            if (index) index->within(lat, lon, radius_m, offer);
+            else if (binary) {
+                std::vector<long long> lat_ids, lon_ids;
+                for (const auto& token : lat_field.tokens) lat_ids.push_back(binary->key_id(token));
+                for (const auto& token : lon_field.tokens) lon_ids.push_back(binary->key_id(token));
+                for (size_t pos = 0; pos < size; ++pos) {
+                    nkb::Value item = root.at(pos), a = lat_field.resolve(item, lat_ids), b = lon_field.resolve(item, lon_ids);
+                    if (a && b && a.is_number() && b.is_number()) measure(pos, a.number(), b.number());
+                }
+            } else {
+                for (size_t pos = 0; pos < size; ++pos) {
+                    const json* a = lat_field.resolve((*doc)[pos]);
+                    const json* b = lon_field.resolve((*doc)[pos]);
+                    if (a && b && a->is_number() && b->is_number()) measure(pos, a->get<double>(), b->get<double>());
+                }
+            }
+            // With LIMIT only the nearest need ordering.
+            if (hits.size() > limit) { std::partial_sort(hits.begin(), hits.begin() + limit, hits.end()); hits.resize(limit); }
+            else std::sort(hits.begin(), hits.end());
+            for (const auto& hit : hits) {
+                if (hit.second >= size) continue;
+                writer.push(json{{"pos", hit.second}, {"distance", std::round(hit.first / unit * 10000) / 10000}, {"item", binary ? root.at(hit.second).to_json() : (*doc)[hit.second]}});
+            }
+            return true;
+        });
+        if (status.first) return status;
+        const std::string no_matches = "(nil)";
+        ElementWalk walk;
+        json page;
+        return _finish_walk(key, std::move(ticket), writer, false, walk, page, &no_matches);
+    }
+    HandlerResult _handle_json_findindex(const std::vector<std::string>& args) {
+        // Syntax: JSON.FINDINDEX CREATE|DROP <prefix> <field> | JSON.FINDINDEX LIST
+        const std::string syntax = "-ERR syntax: JSON.FINDINDEX CREATE|DROP <prefix> <field> | JSON.FINDINDEX LIST";
+        if (args.empty()) return {400, syntax};
+        std::string sub = _upper(args[0]);
+        if (sub == "LIST") {
+            if (args.size() != 1) return {400, syntax};
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            if (collection_indexes_.empty()) return {404, "(nil)"};
+            json list = json::array();
+            for (const auto& index : collection_indexes_) list.push_back({{"prefix", index.prefix}, {"field", index.field.text}, {"keys", index.value_of.size()}, {"distinct_values", index.keys.size()}, {"memory", format_memory_size(index.bytes)}});
+            return {200, _render(list)};
+        }
+        if ((sub != "CREATE" && sub != "DROP") || args.size() != 3) return {400, syntax};
+        const auto& prefix = args[1];
+        const auto& field_text = args[2];
+        auto same = [&](const JsonCollectionIndex& index) { return index.prefix == prefix && index.field.text == field_text; };
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        auto existing = std::find_if(collection_indexes_.begin(), collection_indexes_.end(), same);
+        if (sub == "DROP") {
+            if (existing == collection_indexes_.end()) return {200, "0"};
+            unsigned long long bytes = _collection_index_bytes(*existing);
+            estimated_memory_usage_ -= bytes; json_index_bytes_ -= bytes;
+            collection_indexes_.erase(existing);
+            dirty_operations_++;
+            return {200, "1"};
+        }
+        if (existing != collection_indexes_.end()) return {400, "-ERR index already exists"};
+        JsonFieldPath field;
+        try { if (field_text.empty()) throw std::invalid_argument("empty field"); field = JsonFieldPath::parse(field_text); } catch (...) { return {400, "-ERR invalid field path '" + field_text + "'"}; }
+        size_t indexed = _create_collection_index_unlocked(prefix, std::move(field)).value_of.size();
+        dirty_operations_++;
+        _enforce_memory_limit();
+        return {200, "+OK indexed " + std::to_string(indexed) + " key(s) under '" + prefix + "' on '" + field_text + "'."};
+    }
+    HandlerResult _handle_ttl(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR wrong number of arguments"}; std::shared_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(args[0])) return {404, "(nil)"}; if (!ttl_map_.count(args[0])) return {200, "-1"}; auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count(); long long expiry_ms = ttl_map_.at(args[0]); if (now_ms > expiry_ms) return {404, "(nil)"}; return {200, std::to_string((expiry_ms - now_ms) / 1000)}; }
+    HandlerResult _handle_expire(const std::vector<std::string>& args) { if (args.size() != 2) return {400, "-ERR wrong number of arguments"}; std::unique_lock<std::shared_mutex> lock(data_mutex_); if (!kv_store_.count(args[0])) return {404, "(nil)"}; try { long long ttl_s = std::stoll(args[1]); if (ttl_s <= 0) { ttl_map_.erase(args[0]); } else { ttl_map_[args[0]] = std::chrono::duration_cast<std::chrono::milliseconds>((std::chrono::system_clock::now() + std::chrono::seconds(ttl_s)).time_since_epoch()).count(); } } catch (...) { return {400, "-ERR invalid TTL value"}; } dirty_operations_++; if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME); return {200, "+OK"}; }
+    HandlerResult _handle_stats() { std::shared_lock<std::shared_mutex> lock(data_mutex_); int num_threads = (WORKERS_THREAD_COUNT <= 0) ? std::max(1u, std::thread::hardware_concurrency() - 1) : WORKERS_THREAD_COUNT; std::stringstream ss; ss << "Version: NukeKV v2.5-Stable ☢️\n"; ss << "Protocol: Nuke-Wire (CUSTOM RAW TCP)\n"; ss << "Debug Mode: " << (DEBUG_MODE.load() ? "ON" : "OFF") << "\n"; ss << "Worker Threads: " << num_threads << "\n"; ss << "-------------------------\n"; ss << "Persistence Disk: " << (PERSISTENCE_ENABLED ? "Enabled" : "Disabled") << "\n"; if (PERSISTENCE_ENABLED) { ss << "  - Batch Size: " << BATCH_PROCESSING_SIZE.load() << "\n"; ss << "  - Unsaved Ops: " << dirty_operations_.load() << "\n"; long long file_size = get_file_size(DATABASE_FILENAME); ss << "  - Disk Size: " << (file_size >= 0 ? format_memory_size(file_size) : "N/A") << "\n"; } ss << "-------------------------\n"; ss << "Caching: " << (CACHING_ENABLED ? "Enabled" : "Disabled") << "\n"; if (CACHING_ENABLED) { ss << "  - Memory Limit: " << (max_memory_bytes_ > 0 ? format_memory_size(max_memory_bytes_) : "Unlimited") << "\n"; ss << "  - Memory Used: " << format_memory_size(get_current_ram_usage()) << "\n"; if (max_memory_bytes_ > 0) { ss << "  - Eviction Watermarks: " << format_memory_size(low_watermark_bytes_) << " / " << format_memory_size(high_watermark_bytes_) << "\n"; ss << "  - Evicted Keys: " << evicted_keys_.load() << "\n"; } } ss << "-------------------------\n"; ss << "Compression: " << (COMPRESSION_ENABLED.load() ? "Enabled" : "Disabled") << "\n"; { unsigned long long raw = compressed_raw_bytes_.load(), stored = compressed_stored_bytes_.load(); ss << "  - Compressed Values: " << compressed_values_.load() << "\n"; ss << "  - Compression Ratio: " << std::fixed << std::setprecision(2) << (stored > 0 ? static_cast<double>(raw) / stored : 1.0) << "x (" << format_memory_size(raw) << " -> " << format_memory_size(stored) << ")\n"; std::shared_lock<std::shared_mutex> dict_lock(dict_mutex_); ss << "  - Dictionaries: " << compression_dicts_.size() << "\n"; } ss << "-------------------------\n"; ss << "Tiered Storage: " << (TIERED_STORAGE_ENABLED ? "Enabled" : "Disabled") << "\n"; if (TIERED_STORAGE_ENABLED) { ss << "  - Spilled Keys: " << spilled_keys_.load() << "\n"; ss << "  - Promoted Keys: " << promoted_keys_.load() << "\n"; ss << "  - Value File: " << format_memory_size(value_file_size_) << " (" << format_memory_size(value_file_dead_bytes_.load()) << " reclaimable)\n"; } ss << "-------------------------\n"; ss << "JSON Storage: " << (JSON_BINARY_STORAGE ? "Binary (NKB)" : "Parsed Tree") << "\n"; ss << "JSON Doc Cache: " << doc_lru_.size() << " document(s), " << format_memory_size(doc_cache_bytes_) << " / " << format_memory_size(JSON_DOC_CACHE_BYTES) << "\n"; { unsigned long long hits = doc_cache_hits_.load(), misses = doc_cache_misses_.load(); ss << "  - Hit Rate: " << std::fixed << std::setprecision(2) << (hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0) << "% (" << hits << " hits, " << misses << " parses)\n"; } ss << "JSON Indexes: " << json_indexes_.size() << " key(s) with field indexes, " << text_indexes_.size() << " with text indexes, " << trigram_indexes_.size() << " with trigram indexes, " << vector_indexes_.size() << " with vector indexes, " << geo_indexes_.size() << " with geo indexes, " << (key_trigrams_ ? "key trigrams on, " : "") << collection_indexes_.size() << " collection index(es), " << format_memory_size(json_index_bytes_.load()) << "\n"; { unsigned long long hits = query_cache_.hits(), misses = query_cache_.misses(); ss << "JSON Query Plans: " << query_cache_.size() << " / " << QUERY_CACHE_SIZE << " cached, " << std::fixed << std::setprecision(2) << (hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0) << "% hit rate (" << misses << " compiled)\n"; } ss << "Parallel Scans: " << parallel_scans_.load() << " (arrays of " << PARALLEL_SCAN_MIN_ITEMS << "+ elements across " << workers_.size() << " workers)\n"; { unsigned long long hits = result_cache_.hits(), misses = result_cache_.misses(); ss << "Result Cache: " << cached_keys_.size() << " key(s), " << result_cache_.size() << " replies, " << format_memory_size(result_cache_.bytes()) << " / " << format_memory_size(RESULT_CACHE_BYTES) << ", " << std::fixed << std::setprecision(2) << (hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0) << "% hit rate (" << hits << " hits, " << misses << " misses)\n"; } ss << "Streamed Replies: " << streamed_replies_.load() << " (" << streamed_frames_.load() << " frames of ~" << format_memory_size(STREAM_FRAME_BYTES) << " sent while reading)\n"; ss << "-------------------------\n"; ss << "Lazy Free: " << (LAZY_FREE_ENABLED ? "Enabled" : "Disabled") << "\n"; ss << "  - Pending Reclaim: " << format_memory_size(reclaim_pending_bytes_.load()) << "\n"; ss << "  - Objects Freed Lazily: " << lazy_freed_objects_.load() << "\n"; ss << "-------------------------\n"; ss << "Total Keys: " << kv_store_.size() << "\n"; ss << "Keys with TTL: " << ttl_map_.size() << "\n"; ss << "-------------------------\n"; return {200, ss.str()}; }
+    HandlerResult _handle_batch(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR BATCH requires one argument"}; int new_size; try { new_size = std::stoi(args[0]); } catch(...) { return {400, "-ERR value is not an integer"}; } if (new_size < 0) return {400, "-ERR batch size cannot be negative"}; BATCH_PROCESSING_SIZE.store(new_size); return {200, "+OK"}; }
+    HandlerResult _handle_debug(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR DEBUG requires one argument"}; std::string mode = args[0]; std::transform(mode.begin(), mode.end(), mode.begin(), [](unsigned char c){ return ::tolower(c); }); if (mode == "true") { DEBUG_MODE.store(true); return {200, "+OK Debug mode enabled."}; } else if (mode == "false") { DEBUG_MODE.store(false); return {200, "+OK Debug mode disabled."}; } return {400, "-ERR Invalid argument. Use 'true' or 'false'."}; }
+    // STRESS SEARCH <count>: times the legacy scalar word matcher against the dispatched vector kernel over <count>
+    // generated article paragraphs, for a mix of present, absent and mixed-case terms.
+    HandlerResult _stress_search(const std::string& count_arg) {
+        int count; try { count = std::stoi(count_arg); } catch (...) { return {400, "-ERR invalid number"}; }
+        if (count <= 0) return {400, "-ERR count must be positive"};
+        static const char* words[] = {"the", "market", "reported", "growth", "in", "quarterly", "earnings", "while", "analysts", "expected", "a", "slowdown",
+            "across", "European", "technology", "sector", "with", "investors", "watching", "interest", "rates", "closely", "and", "central", "bank", "officials",
+            "signalled", "caution", "over", "inflation", "data", "released", "on", "Tuesday", "by", "the", "statistics", "office", "of", "government", "policy"};
+        const size_t word_count = sizeof(words) / sizeof(words[0]);
+        std::mt19937 rng(42);
+        std::vector<std::string> paragraphs(count);
+        size_t total_bytes = 0;
+        for (auto& paragraph : paragraphs) {
+            size_t length = 40 + rng() % 120;
+            for (size_t w = 0; w < length; ++w) {
+                if (w) paragraph += (rng() % 12 == 0) ? ", " : " ";
+                paragraph += words[rng() % word_count];
+                if (rng() % 15 == 0) paragraph += '.';
+            }
+            total_bytes += paragraph.size();
+        }
+        const std::vector<std::string> terms = {"inflation", "MARKET", "Tuesday", "growth", "recession", "blockchain", "officials", "rate", "bank", "Quarterly"};
+        auto run = [&](auto kernel, size_t& matches) {
+            matches = 0;
+            auto start = high_res_clock::now();
+            for (const auto& term : terms) for (const auto& paragraph : paragraphs) matches += kernel(paragraph, term);
+            return std::chrono::duration<double>(high_res_clock::now() - start).count();
+        };
+        size_t scalar_matches, kernel_matches;
+        double scalar_dur = run(wordsearch::scalar, scalar_matches);
+        double kernel_dur = run(wordsearch::best().kernel, kernel_matches);
+        double scanned_mb = static_cast<double>(total_bytes) * terms.size() / (1024.0 * 1024.0);
+        std::stringstream ss;
+        ss << "Word search over " << count << " paragraphs (" << format_memory_size(total_bytes) << ", " << terms.size() << " terms)\n"
+           << "-------------------------------------------"
+           << "\n" << std::left << std::setw(10) << "scalar:" << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (scanned_mb / scalar_dur) << " MB/sec (" << format_duration(scalar_dur) << " total)"
+           << "\n" << std::left << std::setw(10) << (std::string(wordsearch::best().name) + ":") << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (scanned_mb / kernel_dur) << " MB/sec (" << format_duration(kernel_dur) << " total)"
+           << "\n-------------------------------------------"
+           << "\nSpeedup: " << std::setprecision(2) << (scalar_dur / kernel_dur) << "x, matches " << kernel_matches << (kernel_matches == scalar_matches ? " (identical)" : " (MISMATCH with scalar " + std::to_string(scalar_matches) + ")");
+        return {200, ss.str()};
+    }
+
+    HandlerResult _stress_vector(const std::string& count_arg, const std::string& dim_arg) {
+        int count, dim; try { count = std::stoi(count_arg); dim = std::stoi(dim_arg); } catch (...) { return {400, "-ERR invalid number"}; }
+        if (count <= 0 || dim <= 0 || dim > 4096) return {400, "-ERR count must be positive and dimensions between 1 and 4096"};
+        // Clustered vectors, as embeddings tend to be; queries come from the same clusters.
+        std::mt19937 rng(42);
+        std::normal_distribution<float> noise(0.0f, 1.0f);
+        const size_t clusters = 64, query_count = 200, k = 10;
+        std::vector<std::vector<float>> centers(clusters, std::vector<float>(dim));
+        for (auto& center : centers) for (float& x : center) x = noise(rng) * 4.0f;
+        auto sample = [&] { std::vector<float> v(centers[rng() % clusters]); for (float& x : v) x += noise(rng); return v; };
+        std::vector<std::vector<float>> points(count), queries(query_count);
+        for (auto& p : points) p = sample();
+        for (auto& q : queries) q = sample();
+
+        JsonVectorIndex index;
+        auto build_start = high_res_clock::now();
+        for (int i = 0; i < count; ++i) index.add(points[i], static_cast<uint32_t>(i));
+        double build_dur = std::chrono::duration<double>(high_res_clock::now() - build_start).count();
+        auto run = [&](auto search, std::vector<std::vector<vectors::Scored>>& results) {
+            results.assign(query_count, {});
+            auto start = high_res_clock::now();
+            for (size_t i = 0; i < query_count; ++i) results[i] = search(queries[i].data());
+            return std::chrono::duration<double>(high_res_clock::now() - start).count();
+        };
+        std::vector<std::vector<vectors::Scored>> scalar_hits, exact_hits, graph_hits;
+        double scalar_dur = run([&](const float* q) { return index.exact(q, k, vectors::scalar()); }, scalar_hits);
+        double exact_dur = run([&](const float* q) { return index.exact(q, k, vectors::best()); }, exact_hits);
+        double graph_dur = run([&](const float* q) { return index.search(q, k, std::max(VECTOR_EF_SEARCH, k)); }, graph_hits);
+        size_t found = 0, same = 0;
+        for (size_t i = 0; i < query_count; ++i) {
+            std::unordered_set<uint32_t> truth;
+            for (const auto& hit : exact_hits[i]) truth.insert(hit.second);
+            for (const auto& hit : graph_hits[i]) found += truth.count(hit.second);
+            for (size_t j = 0; j < k && j < scalar_hits[i].size() && j < exact_hits[i].size(); ++j) same += scalar_hits[i][j].second == exact_hits[i][j].second;
+        }
+        std::stringstream ss;
+        auto row = [&](const std::string& name, double dur) { ss << "\n" << std::left << std::setw(20) << name << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (query_count / dur) << " queries/sec (" << format_duration(dur) << " total)"; };
+        ss << "Vector search over " << count << " vectors of " << dim << " dimensions (L2, " << query_count << " queries, K " << k << ")\n"
+           << "-------------------------------------------"
+           << "\nHNSW build: " << format_duration(build_dur) << ", " << format_memory_size(index.bytes);
+        row("exact (scalar):", scalar_dur);
+        row(std::string("exact (") + vectors::best().name + "):", exact_dur);
+        row("HNSW (EF " + std::to_string(std::max(VECTOR_EF_SEARCH, k)) + "):", graph_dur);
+        ss << "\n-------------------------------------------"
+           << "\nKernel speedup: " << std::setprecision(2) << (scalar_dur / exact_dur) << "x (" << same << "/" << query_count * k << " ranks agree with scalar)"
+           << "\nHNSW speedup over exact: " << (exact_dur / graph_dur) << "x, recall@" << k << " " << std::setprecision(3) << (static_cast<double>(found) / (query_count * k));
+        return {200, ss.str()};
+    }
+
+    HandlerResult _handle_stress(const std::vector<std::string>& args) { if (args.size() == 2 || args.size() == 3) { std::string mode = args[0]; std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper); if (mode == "SEARCH" && args.size() == 2) return _stress_search(args[1]); if (mode == "VECTOR") return _stress_vector(args[1], args.size() == 3 ? args[2] : "128"); } if (args.size() != 1) return {400, "-ERR STRESS requires one argument"}; int count; try { count = std::stoi(args[0]); } catch (...) { return {400, "-ERR invalid number"}; } if (count <= 0) return {400, "-ERR count must be positive"}; std::cout << "\n[INFO] Starting stress test" << std::endl; auto overall_start = high_res_clock::now(); std::stringstream ss; ss << "Stress Test running for " << count << " ops ...\n" << "-------------------------------------------"; { std::vector<std::string> keys(count); for(int i=0; i<count; ++i) keys[i] = "stress:" + std::to_string(i); std::unordered_map<std::string, std::string> stress_store; stress_store.reserve(count); auto run_benchmark = [&](auto op){ auto start = high_res_clock::now(); for(int i=0; i<count; ++i) op(stress_store, i); return std::chrono::duration<double>(high_res_clock::now() - start).count(); }; auto set_op = [&](auto& store, int i){ store[keys[i]] = "svalue"; }; double set_dur = run_benchmark(set_op); ss << "\n" << std::left << std::setw(8) << "SET:" << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (count/set_dur) << " ops/sec (" << format_duration(set_dur) << " total)"; auto update_op = [&](auto& store, int i){ store[keys[i]] = "nvalue"; }; double update_dur = run_benchmark(update_op); ss << "\n" << std::left << std::setw(8) << "UPDATE:" << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (count/update_dur) << " ops/sec (" << format_duration(update_dur) << " total)"; auto get_op = [&](auto& store, int i){ (void)store.at(keys[i]); }; double get_dur = run_benchmark(get_op); ss << "\n" << std::left << std::setw(8) << "GET:" << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (count/get_dur) << " ops/sec (" << format_duration(get_dur) << " total)"; auto del_op = [&](auto& store, int i){ store.erase(keys[i]); }; double del_dur = run_benchmark(del_op); ss << "\n" << std::left << std::setw(8) << "DEL:" << std::right << std::setw(12) << std::fixed << std::setprecision(2) << (count/del_dur) << " ops/sec (" << format_duration(del_dur) << " total)"; } double total_time = std::chrono::duration<double>(high_res_clock::now() - overall_start).count(); ss << "\n-------------------------------------------\n" << "MAX RAM USAGE: " << format_memory_size(get_peak_ram_usage()) << "\nTotal Stress Test Time: " << format_duration(total_time); std::cout << "[INFO] Stress test complete. All test data disposed from memory." << std::endl; return {200, ss.str()}; }
+    HandlerResult _handle_clrdb(const std::vector<std::string>& args) {
+        bool async = false;
+        if (args.size() == 1) { std::string mode = args[0]; std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper); if (mode != "ASYNC" && mode != "SYNC") return {400, "-ERR syntax: CLRDB [ASYNC|SYNC]"}; async = (mode == "ASYNC"); }
+        else if (!args.empty()) return {400, "-ERR syntax: CLRDB [ASYNC|SYNC]"};
+        std::unique_lock<std::shared_mutex> lock(data_mutex_);
+        size_t keys_cleared = kv_store_.size();
+        // Collection indexes belong to a prefix rather than to keys: they stay defined, empty.
+        std::vector<JsonCollectionIndex> collections(collection_indexes_.size());
+        for (size_t i = 0; i < collections.size(); ++i) { collections[i].prefix = collection_indexes_[i].prefix; collections[i].field = collection_indexes_[i].field; }
+        if (async) {
+            // Swap the containers out under the lock; tearing down millions of nodes happens on the reclaimer thread.
+            auto old_data = std::make_tuple(std::move(kv_store_), std::move(ttl_map_), std::move(lru_list_), std::move(lru_map_), std::move(doc_lru_), std::move(json_indexes_), std::move(text_indexes_), std::move(trigram_indexes_), std::move(vector_indexes_), std::move(geo_indexes_), std::move(collection_indexes_));
+            _free_lazily(std::move(old_data), estimated_memory_usage_.load());
+        }
+        kv_store_.clear(); ttl_map_.clear(); lru_list_.clear(); lru_map_.clear(); doc_lru_.clear(); json_indexes_.clear(); text_indexes_.clear(); trigram_indexes_.clear(); vector_indexes_.clear(); geo_indexes_.clear();
+        if (key_trigrams_) key_trigrams_->clear(); // like collection indexes, stays on
+        collection_indexes_ = std::move(collections);
+        cached_keys_.clear(); cached_key_count_ = 0; result_cache_.clear();
+        doc_cache_bytes_ = 0; json_index_bytes_ = 0;
+        estimated_memory_usage_ = 0;
+        for (const auto& index : collection_indexes_) { json_index_bytes_ += _collection_index_bytes(index); estimated_memory_usage_ += _collection_index_bytes(index); }
+        spilled_keys_ = 0;
+        compressed_values_ = 0; compressed_raw_bytes_ = 0; compressed_stored_bytes_ = 0;
+        if (TIERED_STORAGE_ENABLED) _open_value_file();
+        dirty_operations_++;
+        if (BATCH_PROCESSING_SIZE.load() == 0) _save_to_file_unlocked(DATABASE_FILENAME);
+        return {200, "+OK " + std::to_string(keys_cleared) + " keys cleared" + (async ? " (freeing in background)." : ".")};
+    }
+    HandlerResult _handle_compression(const std::vector<std::string>& args) {
+        // Syntax: COMPRESSION ON | OFF | TRAIN [samples]
+        if (args.empty() || args.size() > 2) return {400, "-ERR syntax: COMPRESSION ON|OFF|TRAIN [samples]"};
+        std::string mode = args[0];
+        std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+        if (mode == "ON" || mode == "OFF") { if (args.size() != 1) return {400, "-ERR syntax: COMPRESSION ON|OFF"}; COMPRESSION_ENABLED.store(mode == "ON"); return {200, "+OK Compression " + std::string(mode == "ON" ? "enabled." : "disabled.")}; }
+        if (mode != "TRAIN") return {400, "-ERR syntax: COMPRESSION ON|OFF|TRAIN [samples]"};
+        long long sample_count = 256;
+        if (args.size() == 2) { try { sample_count = std::stoll(args[1]); } catch (...) { return {400, "-ERR invalid number of samples"}; } if (sample_count <= 0) return {400, "-ERR samples must be positive"}; }
+
+        // Collect decoded samples under the shared lock; training itself runs without it.
+        const size_t max_sample_bytes = 16 * 1024 * 1024;
+        std::vector<std::string> samples;
+        {
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            size_t total = 0;
+            for (const auto& pair : kv_store_) {
+                if (samples.size() >= static_cast<size_t>(sample_count) || total >= max_sample_bytes) break;
+                if (pair.second.on_disk || pair.second.raw_size < 64) continue;
+                samples.push_back(_read_value(pair.second));
+                total += samples.back().size();
+            }
+        }
+        if (samples.size() < 2) return {400, "-ERR need at least 2 values of 64+ bytes to train a dictionary"};
+        auto dict = std::make_shared<const std::string>(nukelz::train_dictionary(samples, std::min<size_t>(COMPRESSION_DICT_SIZE, nukelz::MAX_OFFSET / 2)));
+        if (dict->empty()) return {400, "-ERR samples share no common content, dictionary not created"};
+
+        size_t raw = 0, plain = 0, with_dict = 0;
+        for (const auto& sample : samples) { raw += sample.size(); plain += nukelz::compress(sample).size(); with_dict += nukelz::compress(sample, *dict).size(); }
+        size_t dict_id;
+        {
+            std::unique_lock<std::shared_mutex> lock(dict_mutex_);
+            if (compression_dicts_.size() >= std::numeric_limits<uint16_t>::max()) return {400, "-ERR dictionary limit reached"};
+            compression_dicts_.push_back(dict);
+            dict_id = compression_dicts_.size();
+        }
+        std::stringstream ss;
+        ss << "+OK dictionary #" << dict_id << " (" << format_memory_size(dict->size()) << ") trained on " << samples.size() << " samples. Sample ratio: "
+           << std::fixed << std::setprecision(2) << (plain ? static_cast<double>(raw) / plain : 1.0) << "x without, " << (with_dict ? static_cast<double>(raw) / with_dict : 1.0) << "x with dictionary.";
+        return {200, ss.str()};
+    }
+    static unsigned long long _task_bytes(const Task& task) { unsigned long long bytes = sizeof(Task) + string_heap_bytes(task.command_str) + task.args.capacity() * sizeof(std::string); for (const auto& arg : task.args) bytes += string_heap_bytes(arg); return bytes; }
+    // Approximate heap cost of one hash-map node holding `Pair`: the pair, a next pointer, the cached hash and a bucket slot.
+    template <typename Pair> static constexpr size_t _map_node_bytes() { return sizeof(Pair) + 3 * sizeof(void*); }
+    static constexpr size_t _list_node_bytes() { return sizeof(std::string) + 2 * sizeof(void*); }
+    // Everything a key costs in RAM: its store node, key and value buffers, and its TTL and LRU bookkeeping. Caller holds a lock.
+    unsigned long long _key_memory_usage_unlocked(const std::string& key, const ValueEntry& entry) const {
+        unsigned long long bytes = _map_node_bytes<std::pair<const std::string, ValueEntry>>() + string_heap_bytes(key) + string_heap_bytes(entry.data) + entry.doc_bytes;
+        auto indexes = json_indexes_.find(key);
+        if (indexes != json_indexes_.end()) bytes += _index_bytes(indexes->second);
+        auto text = text_indexes_.find(key);
+        if (text != text_indexes_.end()) bytes += sizeof(JsonTextIndex) + text->second.bytes;
+        auto trigrams = trigram_indexes_.find(key);
+        if (trigrams != trigram_indexes_.end()) bytes += _trigram_bytes(trigrams->second);
+        auto vector_fields = vector_indexes_.find(key);
+        if (vector_fields != vector_indexes_.end()) bytes += _vector_bytes(vector_fields->second);
+        auto geo_fields = geo_indexes_.find(key);
+        if (geo_fields != geo_indexes_.end()) bytes += _geo_bytes(geo_fields->second);
+        if (ttl_map_.count(key)) bytes += _map_node_bytes<std::pair<const std::string, long long>>() + string_heap_bytes(key);
+        if (lru_map_.count(key)) bytes += _list_node_bytes() + _map_node_bytes<std::pair<const std::string, std::list<std::string>::iterator>>() + 2 * string_heap_bytes(key);
+        return bytes;
+    }
+    HandlerResult _handle_memory(const std::vector<std::string>& args) {
+        // Syntax: MEMORY USAGE <key> | MEMORY STATS | MEMORY BIGKEYS [samples] [top]
+        const std::string syntax = "-ERR syntax: MEMORY USAGE <key> | MEMORY STATS | MEMORY BIGKEYS [samples] [top]";
+        if (args.empty()) return {400, syntax};
+        std::string sub = args[0];
+        std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+
+        if (sub == "USAGE") {
+            if (args.size() != 2) return {400, "-ERR syntax: MEMORY USAGE <key>"};
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            auto it = kv_store_.find(args[1]);
+            if (it == kv_store_.end()) return {404, "(nil)"};
+            return {200, std::to_string(_key_memory_usage_unlocked(it->first, it->second))};
+        }
+
+        if (sub == "BIGKEYS") {
+            if (args.size() > 3) return {400, "-ERR syntax: MEMORY BIGKEYS [samples] [top]"};
+            long long samples = 1000, top = 10;
+            try { if (args.size() > 1) samples = std::stoll(args[1]); if (args.size() > 2) top = std::stoll(args[2]); } catch (...) { return {400, "-ERR samples and top must be integers"}; }
+            if (samples <= 0 || top <= 0) return {400, "-ERR samples and top must be positive"};
+            std::vector<std::pair<unsigned long long, std::string>> heap; // min-heap of the biggest keys seen so far
+            auto smaller = [](const auto& a, const auto& b) { return a.first > b.first; };
+            size_t seen = 0;
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            if (kv_store_.empty()) return {404, "(nil)"};
+            // Walk the buckets from a random starting point so repeated runs look at different keys.
+            size_t buckets = kv_store_.bucket_count();
+            static thread_local std::mt19937_64 rng(std::random_device{}());
+            size_t start = std::uniform_int_distribution<size_t>(0, buckets - 1)(rng);
+            for (size_t b = 0; b < buckets && seen < static_cast<size_t>(samples); ++b) {
+                size_t bucket = (start + b) % buckets;
+                for (auto it = kv_store_.begin(bucket); it != kv_store_.end(bucket) && seen < static_cast<size_t>(samples); ++it, ++seen) {
+                    unsigned long long bytes = _key_memory_usage_unlocked(it->first, it->second);
+                    if (heap.size() < static_cast<size_t>(top)) { heap.emplace_back(bytes, it->first); std::push_heap(heap.begin(), heap.end(), smaller); }
+                    else if (bytes > heap.front().first) { std::pop_heap(heap.begin(), heap.end(), smaller); heap.back() = {bytes, it->first}; std::push_heap(heap.begin(), heap.end(), smaller); }
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end(), smaller);
+            std::stringstream ss;
+            ss << "Sampled " << seen << " of " << kv_store_.size() << " keys. Biggest:\n";
+            for (size_t i = 0; i < heap.size(); ++i) ss << "  " << (i + 1) << ") " << heap[i].second << ": " << format_memory_size(heap[i].first) << "\n";
+            return {200, ss.str()};
+        }
+
+        if (sub != "STATS" || args.size() != 1) return {400, syntax};
+        unsigned long long key_bytes = 0, value_bytes = 0, spilled_bytes = 0, ttl_bytes = 0, lru_bytes = 0, table_bytes = 0, doc_bytes = 0;
+        size_t key_count, doc_count;
+        {
+            std::shared_lock<std::shared_mutex> lock(data_mutex_);
+            key_count = kv_store_.size();
+            for (const auto& pair : kv_store_) {
+                key_bytes += string_heap_bytes(pair.first);
+                value_bytes += string_heap_bytes(pair.second.data);
+                if (pair.second.on_disk) spilled_bytes += pair.second.disk_length;
+            }
+            table_bytes = kv_store_.size() * _map_node_bytes<std::pair<const std::string, ValueEntry>>() + kv_store_.bucket_count() * sizeof(void*);
+            ttl_bytes = ttl_map_.size() * _map_node_bytes<std::pair<const std::string, long long>>() + ttl_map_.bucket_count() * sizeof(void*);
+            for (const auto& pair : ttl_map_) ttl_bytes += string_heap_bytes(pair.first);
+            lru_bytes = lru_list_.size() * _list_node_bytes() + lru_map_.size() * _map_node_bytes<std::pair<const std::string, std::list<std::string>::iterator>>() + lru_map_.bucket_count() * sizeof(void*);
+            for (const auto& key : lru_list_) lru_bytes += 2 * string_heap_bytes(key);
+            doc_count = doc_lru_.size();
+            doc_bytes = doc_cache_bytes_ + doc_lru_.size() * _list_node_bytes();
+            for (const auto& key : doc_lru_) doc_bytes += string_heap_bytes(key);
+        }
+        size_t dict_bytes = 0;
+        { std::shared_lock<std::shared_mutex> lock(dict_mutex_); for (const auto& d : compression_dicts_) dict_bytes += d->capacity(); }
+        size_t queued_tasks;
+        { std::lock_guard<std::mutex> lock(queue_mutex_); queued_tasks = task_queue_.size(); }
+        unsigned long long tracked = key_bytes + value_bytes + table_bytes + ttl_bytes + lru_bytes + queued_task_bytes_.load() + CLIENT_BUFFER_BYTES.load() + reclaim_pending_bytes_.load() + dict_bytes + doc_bytes + json_index_bytes_.load() + result_cache_.bytes();
+        unsigned long long rss = get_current_ram_usage();
+        AllocatorStats alloc = get_allocator_stats();
+
+        std::stringstream ss;
+        ss << std::fixed << std::setprecision(2);
+        ss << "Process RSS: " << format_memory_size(rss) << " (peak " << format_memory_size(get_peak_ram_usage()) << ")\n";
+        if (alloc.available) {
+            ss << "Allocator: " << format_memory_size(alloc.allocated) << " allocated, " << format_memory_size(alloc.free_in_heap) << " free in heap, " << format_memory_size(alloc.mapped) << " mmapped\n";
+            ss << "Fragmentation Ratio: " << (alloc.allocated > 0 ? static_cast<double>(rss) / alloc.allocated : 0.0) << "\n";
+        } else {
+            ss << "Allocator: (statistics not available on this platform)\n";
+        }
+        ss << "-------------------------\n";
+        ss << "Keys: " << key_count << " (" << format_memory_size(key_bytes) << " in key buffers)\n";
+        ss << "Values: " << format_memory_size(value_bytes) << " resident, " << format_memory_size(spilled_bytes) << " spilled to disk\n";
+        ss << "Parsed JSON Documents: " << doc_count << " (" << format_memory_size(doc_bytes) << ")\n";
+        ss << "JSON Indexes: " << format_memory_size(json_index_bytes_.load()) << "\n";
+        ss << "Result Cache: " << format_memory_size(result_cache_.bytes()) << "\n";
+        ss << "Hash Table: " << format_memory_size(table_bytes) << "\n";
+        ss << "TTL Index: " << format_memory_size(ttl_bytes) << "\n";
+        ss << "LRU Structures: " << format_memory_size(lru_bytes) << "\n";
+        ss << "Task Queue: " << queued_tasks << " task(s), " << format_memory_size(queued_task_bytes_.load()) << "\n";
+        ss << "Client Buffers: " << ACTIVE_CONNECTIONS.load() << " connection(s), " << format_memory_size(CLIENT_BUFFER_BYTES.load()) << "\n";
+        ss << "Pending Lazy Free: " << format_memory_size(reclaim_pending_bytes_.load()) << "\n";
+        ss << "Compression Dictionaries: " << format_memory_size(dict_bytes) << "\n";
+        ss << "-------------------------\n";
+        ss << "Total Tracked: " << format_memory_size(tracked) << "\n";
+        ss << "Untracked (code, stacks, allocator overhead): " << format_memory_size(rss > tracked ? rss - tracked : 0) << "\n";
+        return {200, ss.str()};
+    }
+    HandlerResult _handle_similar(const std::vector<std::string>& args) { if (args.size() != 1) return {400, "-ERR wrong number of arguments, expected: SIMILAR <prefix>"}; const auto& prefix = args[0]; if (prefix.empty()) return {400, "-ERR prefix cannot be empty"}; std::shared_lock<std::shared_mutex> lock(data_mutex_); size_t count = 0; for (const auto& pair : kv_store_) { if (pair.first.rfind(prefix, 0) == 0) count++; } return {200, std::to_string(count)}; }
+
+public:
+    NukeKV() { if (MAX_RAM_GB > 0) { max_memory_bytes_ = MAX_RAM_GB * 1024 * 1024 * 1024; double low = std::clamp(EVICTION_LOW_WATERMARK, 0.0, 1.0), high = std::clamp(EVICTION_HIGH_WATERMARK, low, 1.0); high_watermark_bytes_ = static_cast<unsigned long long>(max_memory_bytes_ * high); low_watermark_bytes_ = static_cast<unsigned long long>(max_memory_bytes_ * low); eviction_thread_ = std::thread(&NukeKV::_eviction_loop, this); } reclaimer_thread_ = std::thread(&NukeKV::_reclaimer_loop, this); if (TIERED_STORAGE_ENABLED && !_open_value_file()) { std::cerr << "[WARN] Could not open " << VALUE_FILENAME << ", tiered storage disabled." << std::endl; TIERED_STORAGE_ENABLED = false; } int num_threads = (WORKERS_THREAD_COUNT <= 0) ? std::max(1u, std::thread::hardware_concurrency() - 1) : WORKERS_THREAD_COUNT; for (int i = 0; i < num_threads; ++i) workers_.emplace_back(&NukeKV::_worker_function, this); background_manager_thread_ = std::thread(&NukeKV::_background_manager, this); }
+    ~NukeKV() { stop_all_ = true; condition_.notify_all(); for (auto& worker : workers_) if (worker.joinable()) worker.join(); if (background_manager_thread_.joinable()) background_manager_thread_.join(); eviction_cv_.notify_all(); if (eviction_thread_.joinable()) eviction_thread_.join(); reclaim_cv_.notify_all(); if (reclaimer_thread_.joinable()) reclaimer_thread_.join(); if (dirty_operations_ > 0) { std::cout << "\nPerforming final save of " << dirty_operations_.load() << " operations..." << std::endl; std::unique_lock<std::shared_mutex> lock(data_mutex_); _save_to_file_unlocked(DATABASE_FILENAME); } }
+    void load_from_file();
+    std::future<HandlerResult> dispatch_command(const std::string& cmd, const std::vector<std::string>& args, ResponseFormat format = ResponseFormat::Pretty, std::function<bool(const std::string&)> stream = nullptr) { Task task; task.command_str = cmd; task.args = args; task.format = format; task.stream = std::move(stream); queued_task_bytes_ += _task_bytes(task); auto future = task.promise.get_future(); { std::lock_guard<std::mutex> lock(queue_mutex_); task_queue_.push(std::move(task)); } condition_.notify_one(); return future; }
+};
+
+void NukeKV::_worker_function() {
+    const std::unordered_map<std::string, std::function<HandlerResult(const std::vector<std::string>&)>> command_map = {
+        {"SET", [this](const auto&a){return _handle_set(a);}}, {"GET", [this](const auto&a){return _handle_get(a);}}, {"DEL", [this](const auto&a){return _handle_del(a);}}, {"UPDATE", [this](const auto&a){return _handle_update(a);}}, {"INCR", [this](const auto&a){return _handle_incr_decr(a,true);}}, {"DECR", [this](const auto&a){return _handle_incr_decr(a,false);}}, {"TTL", [this](const auto&a){return _handle_ttl(a);}}, {"EXPIRE", [this](const auto&a){return _handle_expire(a);}}, {"JSON.SET", [this](const auto&a){return _handle_json_set(a);}}, {"JSON.GET", [this](const auto&a){return _cached_read("JSON.GET", a, [&]{return _handle_json_get(a);});}}, {"JSON.UPDATE", [this](const auto&a){return _handle_json_update(a);}}, {"JSON.AGG", [this](const auto&a){return _cached_read("JSON.AGG", a, [&]{return _handle_json_agg(a);});}}, {"JSON.SEARCH", [this](const auto&a){return _cached_read("JSON.SEARCH", a, [&]{return _handle_json_search(a);});}}, {"JSON.DEL", [this](const auto&a){return _handle_json_del(a);}}, {"JSON.APPEND", [this](const auto&a){return _handle_json_append(a);}}, {"JSON.MERGE", [this](const auto&a){return _handle_json_merge(a);}}, {"JSON.NUMINCRBY", [this](const auto&a){return _handle_json_numincrby(a);}}, {"JSON.INDEX", [this](const auto&a){return _handle_json_index(a);}}, {"JSON.FTINDEX", [this](const auto&a){return _handle_json_ftindex(a);}}, {"JSON.FIND", [this](const auto&a){return _handle_json_find(a);}}, {"JSON.FINDINDEX", [this](const auto&a){return _handle_json_findindex(a);}}, {"JSON.CACHE", [this](const auto&a){return _handle_json_cache(a);}}, {"JSON.TRIGRAM", [this](const auto&a){return _handle_json_trigram(a);}}, {"JSON.MATCH", [this](const auto&a){return _cached_read("JSON.MATCH", a, [&]{return _handle_json_match(a);});}}, {"KEYS.MATCH", [this](const auto&a){return _handle_keys_match(a);}}, {"JSON.VINDEX", [this](const auto&a){return _handle_json_vindex(a);}}, {"JSON.VSEARCH", [this](const auto&a){return _cached_read("JSON.VSEARCH", a, [&]{return _handle_json_vsearch(a);});}}, {"JSON.GEOINDEX", [this](const auto&a){return _handle_json_geoindex(a);}}, {"JSON.GEORADIUS", [this](const auto&a){return _cached_read("JSON.GEORADIUS", a, [&]{return _handle_json_georadius(a);});}}, {"STATS", [this](const auto&a){return _handle_stats();}}, {"STRESS", [this](const auto&a){return _handle_stress(a);}}, {"BATCH", [this](const auto&a){return _handle_batch(a);}}, {"DEBUG", [this](const auto&a){return _handle_debug(a);}}, {"CLRDB", [this](const auto&a){return _handle_clrdb(a);}}, {"UNLINK", [this](const auto&a){return _handle_del(a, true, true);}}, {"COMPRESSION", [this](const auto&a){return _handle_compression(a);}}, {"MEMORY", [this](const auto&a){return _handle_memory(a);}}, {"SIMILAR", [this](const auto&a){return _handle_similar(a);}},
+    };
+    const std::unordered_set<std::string> write_commands = {"SET", "UPDATE", "INCR", "DECR", "JSON.SET", "JSON.UPDATE", "JSON.APPEND", "JSON.MERGE", "JSON.NUMINCRBY"};
+    while (!stop_all_) { Task task; { std::unique_lock<std::mutex> lock(queue_mutex_); condition_.wait(lock, [this]{return !task_queue_.empty() || stop_all_;}); if (stop_all_ && task_queue_.empty()) return; task = std::move(task_queue_.front()); task_queue_.pop(); } queued_task_bytes_ -= _task_bytes(task); try { if (write_commands.count(task.command_str)) _throttle_writes(); if (task.job) { task.job(); continue; } response_format_ = task.format; response_stream_ = task.stream ? &task.stream : nullptr; auto it = command_map.find(task.command_str); task.promise.set_value(it != command_map.end() ? it->second(task.args) : HandlerResult{400, "-ERR unknown command '" + task.command_str + "'"}); } catch (const std::exception& e) { task.promise.set_value(HandlerResult{500, std::string("-ERR worker exception: ") + e.what()}); } catch (...) { task.promise.set_value(HandlerResult{500, "-ERR unknown worker exception"}); } }
+}
+void NukeKV::load_from_file() { if (!PERSISTENCE_ENABLED) return; std::unique_lock<std::shared_mutex> lock(data_mutex_); uint64_t snapshot_seq = 0; std::ifstream ifs(DATABASE_FILENAME); if (!ifs.is_open()) { std::cout << "[INFO] Database file not found." << std::endl; _replay_journal_unlocked(snapshot_seq); return; } try { json db_json; ifs >> db_json; if (db_json.count("journal_seq")) snapshot_seq = db_json["journal_seq"].get<uint64_t>(); std::unordered_set<std::string> binary_keys; if (JSON_BINARY_STORAGE && db_json.count("binary_json")) binary_keys = db_json["binary_json"].get<std::unordered_set<std::string>>(); if (db_json.count("store")) { for (auto& item : db_json["store"].items()) { if (binary_keys.count(item.key())) _put_entry_unlocked(item.key(), _encode_binary_json(json::parse(item.value().get<std::string>()))); else _put_value_unlocked(item.key(), item.value().get<std::string>()); } } if (db_json.count("ttl")) ttl_map_ = db_json["ttl"].get<std::unordered_map<std::string, long long>>(); if (db_json.count("json_indexes")) { for (auto& item : db_json["json_indexes"].items()) { auto it = kv_store_.find(item.key()); if (it == kv_store_.end()) continue; for (const auto& field : item.value()) _create_index_unlocked(it, field.get<std::string>()); } } if (db_json.count("text_indexes")) { for (const auto& item : db_json["text_indexes"]) { auto it = kv_store_.find(item.get<std::string>()); if (it == kv_store_.end()) continue; text_indexes_[it->first]; estimated_memory_usage_ += sizeof(JsonTextIndex); json_index_bytes_ += sizeof(JsonTextIndex); _rebuild_indexes_unlocked(it); } } if (db_json.count("trigram_indexes")) { for (auto& item : db_json["trigram_indexes"].items()) { auto it = kv_store_.find(item.key()); if (it == kv_store_.end()) continue; for (const auto& field : item.value()) _create_trigram_index_unlocked(it, field.get<std::string>()); } } if (db_json.count("key_trigrams")) { key_trigrams_ = std::make_unique<KeyTrigramIndex>(); _update_key_trigrams_unlocked([&](KeyTrigramIndex& index) { _fill_key_trigrams_unlocked(index); }); } if (db_json.count("vector_indexes")) { for (auto& item : db_json["vector_indexes"].items()) { auto it = kv_store_.find(item.key()); if (it == kv_store_.end()) continue; for (const auto& index : item.value()) { vectors::Metric metric = vectors::Metric::L2; vectors::parse_metric(index["metric"].get<std::string>(), metric); _create_vector_index_unlocked(it, index["field"].get<std::string>(), metric); } } } if (db_json.count("geo_indexes")) { for (auto& item : db_json["geo_indexes"].items()) { auto it = kv_store_.find(item.key()); if (it == kv_store_.end()) continue; for (const auto& index : item.value()) _create_geo_index_unlocked(it, index["lat"].get<std::string>(), index["lon"].get<std::string>()); } } if (db_json.count("collection_indexes")) { for (const auto& item : db_json["collection_indexes"]) _create_collection_index_unlocked(item["prefix"].get<std::string>(), JsonFieldPath::parse(item["field"].get<std::string>())); } if (db_json.count("cached_keys")) { for (const auto& item : db_json["cached_keys"]) if (kv_store_.count(item.get<std::string>())) cached_keys_.insert(item.get<std::string>()); cached_key_count_ = cached_keys_.size(); } if (CACHING_ENABLED && max_memory_bytes_ > 0) _evict_lru_unlocked(std::numeric_limits<size_t>::max(), low_watermark_bytes_); std::cout << "[INFO] Loaded " << kv_store_.size() << " keys." << std::endl; } catch (...) { std::cerr << "[ERROR] Could not parse database file." << std::endl; } _replay_journal_unlocked(snapshot_seq); }
+
+// --- Command Line Parser ---
+inline std::vector<std::string> parse_command_line(const std::string& line) {
+    std::vector<std::string> args; if (line.empty()) return args;
+    size_t cmd_end = line.find(' ');
+    std::string command = (cmd_end == std::string::npos) ? line : line.substr(0, cmd_end);
+    args.push_back(command);
+    std::string command_upper = command;
+    std::transform(command_upper.begin(), command_upper.end(), command_upper.begin(), ::toupper);
+    char required_quote = 0;
+    if (command_upper == "SET" || command_upper == "UPDATE") required_quote = '"';
+    else if (command_upper == "JSON.SET" || command_upper == "JSON.APPEND") required_quote = '\'';
+    if (required_quote != 0) {
+        if (cmd_end == std::string::npos) return args;
+        size_t key_start = cmd_end + 1;
+        size_t value_divider_pos = line.find(' ', key_start);
+        if (value_divider_pos == std::string::npos) { args.push_back(line.substr(key_start)); return args; }
+        std::string key = line.substr(key_start, value_divider_pos - key_start);
+        size_t value_start = line.find_first_not_of(" \t", value_divider_pos);
+        // JSON.SET <key> <$.path> '<json>' writes below the root; the path is a bare word.
+        if (command_upper == "JSON.SET" && value_start != std::string::npos && line[value_start] == '$') {
+            size_t path_end = line.find(' ', value_start);
+            if (path_end == std::string::npos) return args;
+            std::string path = line.substr(value_start, path_end - value_start);
+            value_start = line.find_first_not_of(" \t", path_end);
+            if (value_start == std::string::npos || line[value_start] != required_quote || line.back() != required_quote || value_start == line.length() - 1) return args;
+            args.push_back(key); args.push_back(path); args.push_back(line.substr(value_start + 1, line.length() - value_start - 2));
+            return args;
+        }
+        size_t ex_pos = line.rfind(" EX ");
+        if (ex_pos != std::string::npos && ex_pos > value_divider_pos) {
+            if (line[value_start] != required_quote || ex_pos < value_start || line[ex_pos - 1] != required_quote) return args;
+            args.push_back(key); args.push_back(line.substr(value_start + 1, ex_pos - value_start - 2)); args.push_back("EX"); args.push_back(line.substr(ex_pos + 4));
+        } else {
+             if (value_start == std::string::npos || line[value_start] != required_quote || line.back() != required_quote) return args;
+             args.push_back(key); args.push_back(line.substr(value_start + 1, line.length() - value_start - 2));
+        }
+    } else {
+        std::string current_arg; char quote_type=0; for (size_t i=(cmd_end == std::string::npos ? line.length() : cmd_end+1); i<line.length(); ++i) { char c=line[i]; if(quote_type==0 && (c=='\''||c=='"')) {if(!current_arg.empty()){args.push_back(current_arg);current_arg.clear();} quote_type=c;} else if(c==quote_type){quote_type=0;} else if(quote_type==0&&isspace(c)){if(!current_arg.empty()){args.push_back(current_arg);current_arg.clear();}} else{current_arg+=c;}} if(!current_arg.empty())args.push_back(current_arg);
+        if (command_upper == "JSON.UPDATE" || command_upper == "JSON.GET") { auto transform_keywords = [](std::string& s) { std::string lower_s = s; std::transform(lower_s.begin(), lower_s.end(), lower_s.begin(), [](unsigned char c){ return ::tolower(c); }); if (lower_s == "where") s = "WHERE"; else if (lower_s == "set") s = "SET"; }; for(size_t i = 1; i < args.size(); ++i) { transform_keywords(args[i]); } }
+    }
+    return args;
+}
+
+// --- nuke-wire Protocol Implementation ---
+inline bool send_all(socket_t sock, const char* buf, size_t len) { size_t sent=0; while(sent<len){int n=send(sock,buf+sent,len-sent,0); if(n<=0)return false; sent+=n;} return true; }
+// A reply may be split into frames: every frame but the last has the top bit of its length set (STREAM ON).
+const uint64_t MORE_FRAMES_FLAG = 1ULL << 63;
+inline bool send_message(socket_t sock, const std::string& msg, bool more = false) { uint64_t len=msg.length(), net_len=nuke_htonll(more ? len | MORE_FRAMES_FLAG : len); if(!send_all(sock,reinterpret_cast<const char*>(&net_len),sizeof(net_len)))return false; if(len>0&&!send_all(sock,msg.c_str(),len))return false; return true; }
+inline bool recv_all(socket_t sock, char* buf, size_t len) { size_t recvd=0; while(recvd<len){int n=recv(sock,buf+recvd,len-recvd,0); if(n<=0)return false; recvd+=n;} return true; }
+
+// --- BUG FIX & ENHANCEMENT: Hardened against internet scanners and bots ---
+inline bool recv_message(socket_t sock, std::string& msg) {
+    uint64_t net_len;
+    // If a scanner connects and disconnects, or sends garbage that isn't 8 bytes,
+    // this will fail. We return false to silently close the connection without logging errors.
+    if (!recv_all(sock, reinterpret_cast<char*>(&net_len), sizeof(net_len))) {
+        return false;
+    }
+
+    uint64_t msg_len = nuke_ntohll(net_len);
+
+    // This is the CRITICAL security check. If a bot sends junk (like an HTTP request),
+    // the first 8 bytes will be interpreted as a massive number. This check prevents
+    // the server from crashing by trying to allocate that memory.
+    if (msg_len > MAX_PAYLOAD_SIZE) { 
+        // We now ONLY log this if DEBUG_MODE is on, to keep production logs clean.
+        if (DEBUG_MODE.load(std::memory_order_relaxed)) {
+            std::cout << "[INFO] A client sent a malformed header with payload size " 
+                      << format_memory_size(msg_len) << ", exceeding the " 
+                      << format_memory_size(MAX_PAYLOAD_SIZE) << " limit. Connection closed." << std::endl;
+        }
+        return false; // Silently and safely close the connection.
+    }
+
+    if (msg_len == 0) { 
+        msg.clear(); 
         return true; 
     } 
     
@@ -414,13 +5306,33 @@ inline bool recv_message(socket_t sock, std::string& msg) {
 }
 
 
+// Commands whose JSON results follow FORMAT; they also take a trailing `FORMAT <format>` for a single request.
+const std::unordered_set<std::string> JSON_RESULT_COMMANDS = {"JSON.GET", "JSON.SEARCH", "JSON.AGG", "JSON.INDEX", "JSON.FIND", "JSON.FINDINDEX", "JSON.TRIGRAM", "JSON.MATCH", "KEYS.MATCH", "JSON.VINDEX", "JSON.VSEARCH", "JSON.GEOINDEX", "JSON.GEORADIUS"};
+// Commands whose array results may be sent in frames to a STREAM ON connection.
+const std::unordered_set<std::string> STREAMED_COMMANDS = {"JSON.GET", "JSON.SEARCH", "JSON.MATCH"};
+
 void handle_client(socket_t client_socket, NukeKV* db_engine) {
+    ACTIVE_CONNECTIONS++;
+    ResponseFormat connection_format = ResponseFormat::Pretty;
+    bool stream_results = false, stream_failed = false, reply_framed = false;
+    // Sends a non-final frame from the worker running this connection's request; the connection thread is
+    // blocked on that request's future meanwhile, so frames never interleave with other replies.
+    auto send_frame = [&](const std::string& frame) {
+        CLIENT_BUFFER_BYTES += frame.capacity();
+        bool sent = send_message(client_socket, frame, true);
+        CLIENT_BUFFER_BYTES -= frame.capacity();
+        reply_framed = true;
+        if (!sent) stream_failed = true;
+        return sent;
+    };
     while (true) {
         std::string command_line;
         if (!recv_message(client_socket, command_line)) {
             // This will now trigger for legitimate disconnects OR silent scanner rejections.
             break; 
         }
+        unsigned long long request_bytes = command_line.capacity();
+        CLIENT_BUFFER_BYTES += request_bytes;
 
         auto args = parse_command_line(command_line);
         high_res_clock::time_point start_time;
@@ -429,6 +5341,8 @@ void handle_client(socket_t client_socket, NukeKV* db_engine) {
         }
 
         HandlerResult result_pair;
+        bool binary_reply = false; // CBOR / MessagePack bytes
+        reply_framed = false;
         if (args.empty()) { 
             result_pair = {400, "-ERR empty command"};
         } else {
@@ -439,25 +5353,49 @@ void handle_client(socket_t client_socket, NukeKV* db_engine) {
             if (command == "QUIT") { 
                 result_pair = {200, "+OK Bye"}; 
                 send_message(client_socket, result_pair.second); 
+                CLIENT_BUFFER_BYTES -= request_bytes;
                 break; 
             } else if (command == "PING") { 
                 result_pair = {200, "+PONG"}; 
+            } else if (command == "FORMAT") {
+                if (args.empty()) result_pair = {200, std::string("+") + response_format_name(connection_format)};
+                else if (args.size() == 1 && parse_response_format(args[0], connection_format)) result_pair = {200, "+OK"};
+                else result_pair = {400, "-ERR syntax: FORMAT [PRETTY|COMPACT|CBOR|MSGPACK]"};
+            } else if (command == "STREAM") {
+                std::string mode = args.size() == 1 ? args[0] : std::string();
+                std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+                if (args.empty()) result_pair = {200, stream_results ? "+ON" : "+OFF"};
+                else if (mode == "ON" || mode == "OFF") { stream_results = mode == "ON"; result_pair = {200, "+OK"}; }
+                else result_pair = {400, "-ERR syntax: STREAM [ON|OFF]"};
             } else { 
-                auto future = db_engine->dispatch_command(command, args); 
+                ResponseFormat format = connection_format;
+                std::string last_but_one = args.size() >= 3 ? args[args.size() - 2] : std::string();
+                std::transform(last_but_one.begin(), last_but_one.end(), last_but_one.begin(), ::toupper);
+                if (last_but_one == "FORMAT" && JSON_RESULT_COMMANDS.count(command) && parse_response_format(args.back(), format)) args.resize(args.size() - 2);
+                binary_reply = JSON_RESULT_COMMANDS.count(command) && (format == ResponseFormat::Cbor || format == ResponseFormat::MsgPack);
+                auto future = db_engine->dispatch_command(command, args, format, stream_results && STREAMED_COMMANDS.count(command) ? std::function<bool(const std::string&)>(send_frame) : nullptr); 
                 result_pair = future.get(); 
+                if (stream_failed) { CLIENT_BUFFER_BYTES -= request_bytes; break; }
             }
         }
         
         std::string result_text = result_pair.second;
         if (DEBUG_MODE.load(std::memory_order_relaxed) && result_text.rfind("Stress Test", 0) != 0) {
             auto duration_s = std::chrono::duration<double>(high_res_clock::now() - start_time).count();
-            result_text += " (" + format_duration(duration_s) + ")";
+            // Binary bodies and framed replies cannot take a text suffix; their timing goes to the log instead.
+            if (binary_reply || reply_framed) std::cout << "[DEBUG] " << (binary_reply ? "Binary" : "Streamed") << " reply took " << format_duration(duration_s) << std::endl;
+            else result_text += " (" + format_duration(duration_s) + ")";
         }
 
-        if (!send_message(client_socket, result_text)) {
+        unsigned long long response_bytes = result_pair.second.capacity() + result_text.capacity();
+        CLIENT_BUFFER_BYTES += response_bytes;
+        bool sent = send_message(client_socket, result_text);
+        CLIENT_BUFFER_BYTES -= request_bytes + response_bytes;
+        if (!sent) {
             break;
         }
     }
+    ACTIVE_CONNECTIONS--;
     close_socket(client_socket);
 }
 
@@ -468,6 +5406,7 @@ int main() {
         WSADATA wsaData; if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) { std::cerr << "[FATAL] WSAStartup failed." << std::endl; return 1; }
     #else
         std::setlocale(LC_ALL, "en_US.UTF-8");
+        std::signal(SIGPIPE, SIG_IGN); // a client closing mid-reply (e.g. during a streamed one) must only end its own connection
     #endif
 
     std::future<std::string> public_ip_future = std::async(std::launch::async, get_public_ip);